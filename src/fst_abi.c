@@ -0,0 +1,249 @@
+/**
+ * Plain C ABI for foreign callers
+ * @file fst_abi.c
+ */
+#include "fst_abi.h"
+#include "fst_compact.h"
+#include "fst_fast.h"
+#include "fst_hybrid.h"
+#include "fst_wide.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int fst_abi_version(void) { return FST_ABI_VERSION; }
+
+static FrozenTape *fst_adopt_narrow(InstructionTape *it) {
+  if (!it) {
+    return NULL;
+  }
+  FrozenTape *ft = frozen_tape_adopt_narrow(it);
+  free(it);
+  return ft;
+}
+
+static FrozenTape *fst_adopt_wide(WideInstructionTape *it) {
+  if (!it) {
+    return NULL;
+  }
+  FrozenTape *ft = frozen_tape_adopt_wide(it);
+  free(it);
+  return ft;
+}
+
+/**
+ * The plain narrow dump has no magic, so check that its state count
+ * fits the file's size
+ */
+static int fst_is_narrow_dump(FILE *f) {
+  size_t length;
+  if (fread(&length, sizeof(size_t), 1, f) != 1 || fseek(f, 0, SEEK_END)) {
+    return 0;
+  }
+  long size = ftell(f);
+  rewind(f);
+  return size >= 0 &&
+         length == ((size_t) size - sizeof(size_t)) /
+                       (sizeof(FstStateEntry) * 256) &&
+         ((size_t) size - sizeof(size_t)) % (sizeof(FstStateEntry) * 256) ==
+             0;
+}
+
+/**
+ * The plain dumps are read as they are, so check that every entry
+ * leads to a state of the tape before anything matches on it
+ * @return the tape, or NULL (freeing it) if an entry leads elsewhere
+ */
+static InstructionTape *fst_checked_narrow(InstructionTape *it) {
+  if (!it) {
+    return NULL;
+  }
+  const FstStateEntry *fse = (const FstStateEntry *) it->beginning;
+  for (size_t i = 0; i < it->length * 256; i++) {
+    if (fse[i].components.out_state >= it->length) {
+      instruction_tape_destroy(it);
+      free(it);
+      return NULL;
+    }
+  }
+  return it;
+}
+
+/**
+ * As fst_checked_narrow, also checking that every output lies in the
+ * pool
+ */
+static WideInstructionTape *fst_checked_wide(WideInstructionTape *it) {
+  if (!it) {
+    return NULL;
+  }
+  for (size_t i = 0; i < it->length * 256; i++) {
+    const FstWideEntry *fwe = it->beginning + i;
+    if (fwe->out_state >= it->length ||
+        (size_t) fwe->out_offset + fwe->out_length > it->pool_length) {
+      wide_instruction_tape_destroy(it);
+      free(it);
+      return NULL;
+    }
+  }
+  return it;
+}
+
+/**
+ * Load a tape dumped in any of the formats: compact (narrow or wide),
+ * wide, or the plain narrow dump
+ * @return the tape, holding one reference, or NULL
+ */
+FrozenTape *fst_tape_load(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+
+  char magic[4];
+  size_t got = fread(magic, 1, sizeof(magic), f);
+  rewind(f);
+
+  FrozenTape *ft = NULL;
+  if (got == sizeof(magic) && memcmp(magic, "FSTC", 4) == 0) {
+    ft = fst_adopt_narrow(compact_loadfile(f, 0));
+    if (!ft) {
+      rewind(f);
+      ft = fst_adopt_wide(wide_compact_loadfile(f, 0));
+    }
+  } else if (got == sizeof(magic) && memcmp(magic, "FSTW", 4) == 0) {
+    ft = fst_adopt_wide(fst_checked_wide(wide_inspector_loadfile(f)));
+  } else if (got == sizeof(magic) && fst_is_narrow_dump(f)) {
+    ft = fst_adopt_narrow(fst_checked_narrow(inspector_loadfile(f)));
+  }
+  fclose(f);
+  return ft;
+}
+
+/**
+ * Take over the reference of an export() from the Lua API
+ * @return the tape, or NULL if token is not a pending export
+ */
+FrozenTape *fst_tape_import(void *token) { return frozen_tape_import(token); }
+
+void fst_tape_retain(FrozenTape *tape) { frozen_tape_retain(tape); }
+
+void fst_tape_release(FrozenTape *tape) {
+  if (tape) {
+    frozen_tape_release(tape);
+  }
+}
+
+size_t fst_tape_length(const FrozenTape *tape) {
+  return frozen_tape_length((FrozenTape *) tape);
+}
+
+int fst_tape_is_wide(const FrozenTape *tape) {
+  return tape->kind == FROZEN_WIDE;
+}
+
+/**
+ * Match length more bytes of input from *state into the caller's
+ * buffers, leaving *state where the match stopped, so a stream can be
+ * matched a chunk at a time. Output past output_capacity and states
+ * past states_capacity are counted but not written. Either buffer may
+ * be NULL with a capacity of 0 when it isn't wanted. result->accepted
+ * says whether *state is final.
+ * @return 0 if everything wanted fit, 1 if output or states were cut
+ * short
+ */
+int fst_match_continue(const FrozenTape *tape, unsigned int *state,
+                       const char *input, size_t length, char *output,
+                       size_t output_capacity, unsigned int *states,
+                       size_t states_capacity, FstMatchResult *result) {
+  size_t output_length = 0;
+  int accepted = 0;
+
+  if (tape->kind == FROZEN_WIDE && tape->wide.length) {
+    const FstWideEntry *base = tape->wide.beginning;
+    const char *pool = tape->wide.output_pool;
+    const FstWideEntry *current = base + (size_t) *state * 256;
+    for (size_t i = 0; i < length; i++) {
+      const FstWideEntry *fwe = current + (unsigned char) input[i];
+      if (fwe->out_length) {
+        if (output_length + fwe->out_length <= output_capacity) {
+          memcpy(output + output_length, pool + fwe->out_offset,
+                 fwe->out_length);
+        } else if (output_length < output_capacity) {
+          memcpy(output + output_length, pool + fwe->out_offset,
+                 output_capacity - output_length);
+        }
+        output_length += fwe->out_length;
+      }
+      *state = fwe->out_state;
+      if (i < states_capacity) {
+        states[i] = *state;
+      }
+      current = base + (size_t) *state * 256;
+    }
+    accepted = current->flags & FST_FLAG_FINAL;
+  } else if (tape->kind == FROZEN_NARROW && tape->narrow.length) {
+    const FstStateEntry *base = (const FstStateEntry *) tape->narrow.beginning;
+    const FstStateEntry *current = base + (size_t) *state * 256;
+    for (size_t i = 0; i < length; i++) {
+      const FstStateEntry *fse = current + (unsigned char) input[i];
+      if (fse->components.outchar) {
+        if (output_length < output_capacity) {
+          output[output_length] = fse->components.outchar;
+        }
+        output_length += 1;
+      }
+      *state = fse->components.out_state;
+      if (i < states_capacity) {
+        states[i] = *state;
+      }
+      current = base + (size_t) *state * 256;
+    }
+    accepted = current->components.flags & FST_FLAG_FINAL;
+  } else if (tape->kind == FROZEN_HYBRID && tape->hybrid.length) {
+    const HybridRow *rows = tape->hybrid.rows;
+    const HybridRow *row = rows + *state;
+    for (size_t i = 0; i < length; i++) {
+      FstStateEntry fse = hybrid_lookup(row, (unsigned char) input[i]);
+      if (fse.components.outchar) {
+        if (output_length < output_capacity) {
+          output[output_length] = fse.components.outchar;
+        }
+        output_length += 1;
+      }
+      *state = fse.components.out_state;
+      if (i < states_capacity) {
+        states[i] = *state;
+      }
+      row = rows + *state;
+    }
+    accepted = hybrid_lookup(row, 0).components.flags & FST_FLAG_FINAL;
+  } else {
+    length = 0;
+  }
+
+  result->output_length = output_length;
+  result->state_length = length;
+  result->accepted = accepted != 0;
+  if ((output && output_length > output_capacity) ||
+      (states && length > states_capacity)) {
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Match length bytes of input from the start state, as
+ * fst_match_continue. The input is accepted iff it is not empty and
+ * the match ends in a final state.
+ */
+int fst_match(const FrozenTape *tape, const char *input, size_t length,
+              char *output, size_t output_capacity, unsigned int *states,
+              size_t states_capacity, FstMatchResult *result) {
+  unsigned int state = 0;
+  int cut = fst_match_continue(tape, &state, input, length, output,
+                               output_capacity, states, states_capacity,
+                               result);
+  result->accepted = result->accepted && length > 0;
+  return cut;
+}
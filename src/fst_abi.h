@@ -0,0 +1,64 @@
+#ifndef FST_ABI_H
+#define FST_ABI_H
+
+#include "fst_frozen.h"
+#include <stdlib.h>
+
+/*
+ * Plain C entry points for foreign callers, LuaJIT's FFI first of all
+ * (see fst_fast_ffi.lua, which carries the matching ffi.cdef).
+ *
+ * Only opaque frozen tape handles, sizes and caller owned buffers
+ * cross the boundary, and fst_match allocates nothing, so a LuaJIT
+ * loop calling it with cdata buffers compiles into one trace.
+ *
+ * Handles are refcounted frozen tapes (fst_frozen.h). A frozen tape's
+ * export() from the Lua API becomes a handle holding its own reference
+ * through fst_tape_import, once.
+ *
+ * FST_ABI_VERSION goes up whenever any of this changes.
+ */
+
+#define FST_ABI_VERSION 3
+
+typedef struct FstMatchResult FstMatchResult;
+
+struct FstMatchResult {
+  /**
+   * Output bytes the match produced, even those that didn't fit
+   */
+  size_t output_length;
+  /**
+   * States the match went through, one per input byte
+   */
+  size_t state_length;
+  /**
+   * Whether the input was accepted
+   */
+  int accepted;
+};
+
+int fst_abi_version(void);
+
+FrozenTape *fst_tape_load(const char *path);
+
+FrozenTape *fst_tape_import(void *token);
+
+void fst_tape_retain(FrozenTape *tape);
+
+void fst_tape_release(FrozenTape *tape);
+
+size_t fst_tape_length(const FrozenTape *tape);
+
+int fst_tape_is_wide(const FrozenTape *tape);
+
+int fst_match_continue(const FrozenTape *tape, unsigned int *state,
+                       const char *input, size_t length, char *output,
+                       size_t output_capacity, unsigned int *states,
+                       size_t states_capacity, FstMatchResult *result);
+
+int fst_match(const FrozenTape *tape, const char *input, size_t length,
+              char *output, size_t output_capacity, unsigned int *states,
+              size_t states_capacity, FstMatchResult *result);
+
+#endif /* FST_ABI_H */
@@ -0,0 +1,254 @@
+/**
+ * Whole tape statistics and edge lists
+ * @file fst_analysis.c
+ */
+#include "fst_analysis.h"
+#include "fst_fast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static void *analysis_calloc(size_t count, size_t size) {
+  void *ptr = calloc(MAX(count, 1), size);
+  if (!ptr) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  return ptr;
+}
+
+static int analysis_compare_entries(const void *a, const void *b) {
+  int x = *(const int *) a;
+  int y = *(const int *) b;
+  return (x > y) - (x < y);
+}
+
+static FstStateEntry analysis_entry(int entry) {
+  FstStateEntry fse;
+  fse.entry = entry;
+  return fse;
+}
+
+/**
+ * The entry most bytes of row share, the smallest one on a tie
+ */
+FstStateEntry tape_row_default(const FstStateEntry *row) {
+  /* Most rows have an entry more than half the bytes share, which a
+   * majority vote finds without sorting */
+  int candidate = row[0].entry;
+  int votes = 0;
+  for (int i = 0; i < 256; i++) {
+    if (votes == 0) {
+      candidate = row[i].entry;
+    }
+    votes += row[i].entry == candidate ? 1 : -1;
+  }
+  int candidate_count = 0;
+  for (int i = 0; i < 256; i++) {
+    candidate_count += row[i].entry == candidate;
+  }
+  if (candidate_count > 128) {
+    return analysis_entry(candidate);
+  }
+
+  int sorted[256];
+  for (int i = 0; i < 256; i++) {
+    sorted[i] = row[i].entry;
+  }
+  qsort(sorted, 256, sizeof(int), analysis_compare_entries);
+
+  int best = sorted[0];
+  int best_count = 0;
+  int run = 0;
+  for (int i = 0; i < 256; i++) {
+    run = (i > 0 && sorted[i] == sorted[i - 1]) ? run + 1 : 1;
+    if (run > best_count) {
+      best = sorted[i];
+      best_count = run;
+    }
+  }
+  return analysis_entry(best);
+}
+
+/**
+ * Mark every state a breadth first walk from the marked ones reaches,
+ * over the graph given as adjacency lists in CSR form
+ */
+static size_t analysis_walk(const size_t *offsets, const unsigned int *next,
+                            size_t length, unsigned char *marked) {
+  unsigned int *queue =
+      (unsigned int *) analysis_calloc(length, sizeof(unsigned int));
+  size_t head = 0;
+  size_t tail = 0;
+  for (size_t s = 0; s < length; s++) {
+    if (marked[s]) {
+      queue[tail++] = (unsigned int) s;
+    }
+  }
+  while (head < tail) {
+    unsigned int s = queue[head++];
+    for (size_t k = offsets[s]; k < offsets[s + 1]; k++) {
+      if (!marked[next[k]]) {
+        marked[next[k]] = 1;
+        queue[tail++] = next[k];
+      }
+    }
+  }
+  free(queue);
+  return tail;
+}
+
+/**
+ * Fill in ta for the finished states of it
+ */
+void tape_analyze(InstructionTape *it, TapeAnalysis *ta) {
+  fse_freeze_arena(it);
+  size_t length = it->length;
+  const FstStateEntry *states = (const FstStateEntry *) it->beginning;
+
+  memset(ta, 0, sizeof(TapeAnalysis));
+  ta->length = length;
+  ta->defaults =
+      (FstStateEntry *) analysis_calloc(length, sizeof(FstStateEntry));
+  ta->fan_out =
+      (unsigned short *) analysis_calloc(length, sizeof(unsigned short));
+  ta->distinct_targets =
+      (unsigned short *) analysis_calloc(length, sizeof(unsigned short));
+  ta->reachable = (unsigned char *) analysis_calloc(length, 1);
+  ta->dead = (unsigned char *) analysis_calloc(length, 1);
+
+  /* The distinct targets of each state are its successors */
+  size_t *offsets = (size_t *) analysis_calloc(length + 1, sizeof(size_t));
+  unsigned int *successors = NULL;
+  size_t successor_capacity = 0;
+  unsigned char *seen = (unsigned char *) analysis_calloc(length, 1);
+
+  for (size_t s = 0; s < length; s++) {
+    const FstStateEntry *row = states + s * 256;
+    FstStateEntry def = tape_row_default(row);
+    ta->defaults[s] = def;
+
+    if (successor_capacity < offsets[s] + 256) {
+      successor_capacity = MAX(successor_capacity * 2, offsets[s] + 256);
+      successors = (unsigned int *) realloc(
+          successors, successor_capacity * sizeof(unsigned int));
+      if (!successors) {
+        perror("Memory allocation failure");
+        exit(1);
+      }
+    }
+    size_t count = offsets[s];
+    for (int b = 0; b < 256; b++) {
+      unsigned short to = row[b].components.out_state;
+      if (row[b].entry != def.entry) {
+        ta->fan_out[s] += 1;
+      }
+      if (to == s) {
+        ta->self_loops += 1;
+      }
+      if (to < length && !seen[to]) {
+        seen[to] = 1;
+        successors[count++] = to;
+      }
+    }
+    for (size_t k = offsets[s]; k < count; k++) {
+      seen[successors[k]] = 0;
+    }
+    ta->distinct_targets[s] = (unsigned short) (count - offsets[s]);
+    ta->edge_count += ta->fan_out[s];
+    offsets[s + 1] = count;
+  }
+  free(seen);
+
+  if (length) {
+    ta->reachable[0] = 1;
+    ta->reachable_count =
+        analysis_walk(offsets, successors, length, ta->reachable);
+  }
+
+  /* Walk back from the final states over the reversed edges */
+  size_t edges = offsets[length];
+  size_t *reverse_offsets =
+      (size_t *) analysis_calloc(length + 1, sizeof(size_t));
+  unsigned int *predecessors =
+      (unsigned int *) analysis_calloc(edges, sizeof(unsigned int));
+  for (size_t k = 0; k < edges; k++) {
+    reverse_offsets[successors[k] + 1] += 1;
+  }
+  for (size_t s = 0; s < length; s++) {
+    reverse_offsets[s + 1] += reverse_offsets[s];
+  }
+  size_t *fill = (size_t *) analysis_calloc(length, sizeof(size_t));
+  for (size_t s = 0; s < length; s++) {
+    for (size_t k = offsets[s]; k < offsets[s + 1]; k++) {
+      unsigned int to = successors[k];
+      predecessors[reverse_offsets[to] + fill[to]++] = (unsigned int) s;
+    }
+  }
+  free(fill);
+
+  unsigned char *live = (unsigned char *) analysis_calloc(length, 1);
+  for (size_t s = 0; s < length; s++) {
+    live[s] = (states[s * 256].components.flags & FST_FLAG_FINAL) != 0;
+  }
+  size_t live_count =
+      length ? analysis_walk(reverse_offsets, predecessors, length, live) : 0;
+  for (size_t s = 0; s < length; s++) {
+    ta->dead[s] = !live[s];
+  }
+  ta->dead_count = length - live_count;
+
+  free(live);
+  free(predecessors);
+  free(reverse_offsets);
+  free(successors);
+  free(offsets);
+}
+
+/**
+ * Write ta->length packed defaults to out
+ */
+void tape_analysis_pack_defaults(const TapeAnalysis *ta, unsigned char *out) {
+  for (size_t s = 0; s < ta->length; s++) {
+    FstStateEntry def = ta->defaults[s];
+    out[0] = (unsigned char) def.components.outchar;
+    out[1] = (unsigned char) (def.components.out_state & 0xff);
+    out[2] = (unsigned char) (def.components.out_state >> 8);
+    out += ANALYSIS_DEFAULT_SIZE;
+  }
+}
+
+/**
+ * Write ta->edge_count packed edges to out
+ */
+void tape_analysis_pack_edges(InstructionTape *it, const TapeAnalysis *ta,
+                              unsigned char *out) {
+  fse_freeze_arena(it);
+  const FstStateEntry *states = (const FstStateEntry *) it->beginning;
+  for (size_t s = 0; s < ta->length; s++) {
+    const FstStateEntry *row = states + s * 256;
+    for (int b = 0; b < 256; b++) {
+      if (row[b].entry == ta->defaults[s].entry) {
+        continue;
+      }
+      out[0] = (unsigned char) (s & 0xff);
+      out[1] = (unsigned char) (s >> 8);
+      out[2] = (unsigned char) b;
+      out[3] = (unsigned char) row[b].components.outchar;
+      out[4] = (unsigned char) (row[b].components.out_state & 0xff);
+      out[5] = (unsigned char) (row[b].components.out_state >> 8);
+      out += ANALYSIS_EDGE_SIZE;
+    }
+  }
+}
+
+void tape_analysis_destroy(TapeAnalysis *ta) {
+  free(ta->defaults);
+  free(ta->fan_out);
+  free(ta->distinct_targets);
+  free(ta->reachable);
+  free(ta->dead);
+  memset(ta, 0, sizeof(TapeAnalysis));
+}
@@ -0,0 +1,67 @@
+#ifndef FST_ANALYSIS_H
+#define FST_ANALYSIS_H
+
+#include "fst_fast.h"
+#include <stdlib.h>
+
+/*
+ * Whole tape analysis of a narrow tape in one pass, instead of one
+ * inspector call per state.
+ *
+ * Each state's row is summed up as its default, the entry most of its
+ * bytes share, plus the edges that differ from it, as in the compact
+ * format. Together they give back every transition.
+ *
+ * Packed forms, all little endian:
+ * default: outchar (1 byte), out state (2 bytes), one per state
+ * edge: from state (2), input byte (1), outchar (1), out state (2),
+ * sorted by state, then byte
+ */
+
+#define ANALYSIS_DEFAULT_SIZE 3
+#define ANALYSIS_EDGE_SIZE 6
+
+typedef struct TapeAnalysis TapeAnalysis;
+
+struct TapeAnalysis {
+  size_t length;
+
+  FstStateEntry *defaults;
+  /**
+   * Edges that differ from the default, per state
+   */
+  unsigned short *fan_out;
+  /**
+   * Different out states among all 256 transitions, per state
+   */
+  unsigned short *distinct_targets;
+  size_t edge_count;
+  /**
+   * Transitions, defaults included, that stay in their state
+   */
+  size_t self_loops;
+
+  /**
+   * Per state, whether matching from state 0 can get there
+   */
+  unsigned char *reachable;
+  size_t reachable_count;
+  /**
+   * Per state, whether no final state can be reached from it
+   */
+  unsigned char *dead;
+  size_t dead_count;
+};
+
+FstStateEntry tape_row_default(const FstStateEntry *row);
+
+void tape_analyze(InstructionTape *it, TapeAnalysis *ta);
+
+void tape_analysis_pack_defaults(const TapeAnalysis *ta, unsigned char *out);
+
+void tape_analysis_pack_edges(InstructionTape *it, const TapeAnalysis *ta,
+                              unsigned char *out);
+
+void tape_analysis_destroy(TapeAnalysis *ta);
+
+#endif /* FST_ANALYSIS_H */
@@ -0,0 +1,130 @@
+/**
+ * Chunked tape arenas and huge page backed frozen tapes
+ * @file fst_arena.c
+ */
+#include "fst_arena.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/**
+ * Make an empty arena for states of row_size bytes
+ */
+TapeArena *arena_create(size_t row_size) {
+  TapeArena *arena = (TapeArena *) malloc(sizeof(TapeArena));
+  if (!arena) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  arena->chunks = NULL;
+  arena->chunk_count = 0;
+  arena->chunk_capacity = 0;
+  arena->row_size = row_size;
+  arena->chunk_states = MAX(ARENA_HUGE_PAGE_SIZE / row_size, 1);
+  return arena;
+}
+
+/**
+ * Get the storage of state, adding a chunk if it's the first state past
+ * the last one
+ */
+unsigned char *arena_row(TapeArena *arena, size_t state) {
+  size_t chunk = state / arena->chunk_states;
+  while (chunk >= arena->chunk_count) {
+    if (arena->chunk_count == arena->chunk_capacity) {
+      arena->chunk_capacity = MAX(arena->chunk_capacity * 2, 16);
+      arena->chunks = (unsigned char **) realloc(
+          arena->chunks, arena->chunk_capacity * sizeof(unsigned char *));
+      if (!arena->chunks) {
+        perror("Memory allocation failure");
+        exit(1);
+      }
+    }
+    unsigned char *fresh =
+        (unsigned char *) malloc(arena->chunk_states * arena->row_size);
+    if (!fresh) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+    arena->chunks[arena->chunk_count] = fresh;
+    arena->chunk_count += 1;
+  }
+  return arena->chunks[chunk] +
+         (state % arena->chunk_states) * arena->row_size;
+}
+
+/**
+ * Copy the first states states to out, back to back
+ */
+void arena_copy_out(TapeArena *arena, unsigned char *out, size_t states) {
+  for (size_t chunk = 0; states > 0; chunk++) {
+    size_t n = MIN(states, arena->chunk_states);
+    memcpy(out, arena->chunks[chunk], n * arena->row_size);
+    out += n * arena->row_size;
+    states -= n;
+  }
+}
+
+/**
+ * Free arena and its chunks
+ */
+void arena_destroy(TapeArena *arena) {
+  for (size_t i = 0; i < arena->chunk_count; i++) {
+    free(arena->chunks[i]);
+  }
+  free(arena->chunks);
+  free(arena);
+}
+
+/**
+ * Map at least size bytes, on huge pages if possible
+ * @param mapped_size set to what must be passed to arena_unmap
+ * @return the region, or NULL if nothing could be mapped
+ */
+void *arena_map(size_t size, size_t *mapped_size) {
+  size_t rounded =
+      (size + ARENA_HUGE_PAGE_SIZE - 1) & ~(ARENA_HUGE_PAGE_SIZE - 1);
+  if (rounded == 0) {
+    return NULL;
+  }
+
+#ifdef MAP_HUGETLB
+  void *region = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (region != MAP_FAILED) {
+    *mapped_size = rounded;
+    return region;
+  }
+#endif
+
+  /* No reserved huge pages: map aligned and ask for transparent ones */
+  size_t padded = rounded + ARENA_HUGE_PAGE_SIZE;
+  unsigned char *raw = (unsigned char *) mmap(
+      NULL, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == (unsigned char *) MAP_FAILED) {
+    return NULL;
+  }
+  unsigned char *aligned =
+      (unsigned char *) (((uintptr_t) raw + ARENA_HUGE_PAGE_SIZE - 1) &
+                         ~(uintptr_t) (ARENA_HUGE_PAGE_SIZE - 1));
+  if (aligned > raw) {
+    munmap(raw, aligned - raw);
+  }
+  if (raw + padded > aligned + rounded) {
+    munmap(aligned + rounded, raw + padded - (aligned + rounded));
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(aligned, rounded, MADV_HUGEPAGE);
+#endif
+  *mapped_size = rounded;
+  return aligned;
+}
+
+void arena_unmap(void *region, size_t mapped_size) {
+  munmap(region, mapped_size);
+}
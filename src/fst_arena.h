@@ -0,0 +1,49 @@
+#ifndef FST_ARENA_H
+#define FST_ARENA_H
+
+#include <stdlib.h>
+
+/*
+ * Tape memory.
+ *
+ * While a tape is built in an arena its states go into fixed size
+ * chunks that never move, so growing never copies the tape and
+ * pointers from fse_get_outgoing stay good until the tape is frozen.
+ *
+ * Freezing copies the states once into a single region backed by 2 MB
+ * pages when the system has them (MAP_HUGETLB, else transparent huge
+ * pages through madvise), so hopping between states misses the TLB
+ * less.
+ */
+
+#define ARENA_HUGE_PAGE_SIZE ((size_t) 2 * 1024 * 1024)
+
+typedef struct TapeArena TapeArena;
+
+struct TapeArena {
+  unsigned char **chunks;
+  size_t chunk_count;
+  size_t chunk_capacity;
+  /**
+   * Bytes per state
+   */
+  size_t row_size;
+  /**
+   * States per chunk
+   */
+  size_t chunk_states;
+};
+
+TapeArena *arena_create(size_t row_size);
+
+unsigned char *arena_row(TapeArena *arena, size_t state);
+
+void arena_copy_out(TapeArena *arena, unsigned char *out, size_t states);
+
+void arena_destroy(TapeArena *arena);
+
+void *arena_map(size_t size, size_t *mapped_size);
+
+void arena_unmap(void *region, size_t mapped_size);
+
+#endif /* FST_ARENA_H */
@@ -0,0 +1,232 @@
+/**
+ * Bounded cache of match results
+ * @file fst_cache.c
+ */
+#include "fst_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define CACHE_MIN_BUCKETS 64
+
+/**
+ * Mix a 64 bit word (the finalizer of MurmurHash3)
+ */
+static unsigned long long cache_mix(unsigned long long h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/**
+ * Hash the key eight bytes at a time
+ */
+static unsigned long long cache_hash(unsigned long tape, const char *input,
+                                     size_t length) {
+  unsigned long long h = cache_mix(tape ^ (length * 0x9e3779b97f4a7c15ULL));
+  unsigned long long word;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    memcpy(&word, input + i, 8);
+    h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+  if (i < length) {
+    word = 0;
+    memcpy(&word, input + i, length - i);
+    h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+  }
+  return cache_mix(h);
+}
+
+static const char *cache_input(MatchCacheEntry *entry) {
+  return (const char *) (match_cache_states(entry) + entry->state_length);
+}
+
+unsigned int *match_cache_states(MatchCacheEntry *entry) {
+  return (unsigned int *) (entry + 1);
+}
+
+const char *match_cache_output(MatchCacheEntry *entry) {
+  return cache_input(entry) + entry->input_length;
+}
+
+static MatchCacheEntry **cache_allocate_buckets(size_t count) {
+  MatchCacheEntry **buckets =
+      (MatchCacheEntry **) calloc(count, sizeof(MatchCacheEntry *));
+  if (!buckets) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  return buckets;
+}
+
+/**
+ * Make a cache that holds at most budget bytes of entries, with the
+ * states of each match if keep_states is set
+ */
+MatchCache *match_cache_create(size_t budget, int keep_states) {
+  MatchCache *mc = (MatchCache *) calloc(1, sizeof(MatchCache));
+  if (!mc) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  mc->bucket_count = CACHE_MIN_BUCKETS;
+  mc->buckets = cache_allocate_buckets(mc->bucket_count);
+  mc->budget = budget;
+  mc->keep_states = keep_states;
+  return mc;
+}
+
+/**
+ * Drop every entry, keeping the counters
+ */
+void match_cache_clear(MatchCache *mc) {
+  for (size_t i = 0; i < mc->clock_length; i++) {
+    free(mc->clock[i]);
+  }
+  memset(mc->buckets, 0, mc->bucket_count * sizeof(MatchCacheEntry *));
+  mc->clock_length = 0;
+  mc->hand = 0;
+  mc->bytes = 0;
+}
+
+void match_cache_destroy(MatchCache *mc) {
+  match_cache_clear(mc);
+  free(mc->clock);
+  free(mc->buckets);
+  free(mc);
+}
+
+/**
+ * The entry for input matched on tape, or NULL. The entry stays valid
+ * until the next insert or clear.
+ */
+MatchCacheEntry *match_cache_lookup(MatchCache *mc, unsigned long tape,
+                                    const char *input, size_t length) {
+  unsigned long long hash = cache_hash(tape, input, length);
+  MatchCacheEntry *entry = mc->buckets[hash & (mc->bucket_count - 1)];
+  for (; entry; entry = entry->next) {
+    if (entry->hash == hash && entry->tape == tape &&
+        entry->input_length == length &&
+        memcmp(cache_input(entry), input, length) == 0) {
+      entry->referenced = 1;
+      mc->hits++;
+      return entry;
+    }
+  }
+  mc->misses++;
+  return NULL;
+}
+
+static void cache_unlink(MatchCache *mc, MatchCacheEntry *entry) {
+  MatchCacheEntry **link = &mc->buckets[entry->hash & (mc->bucket_count - 1)];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+}
+
+/**
+ * Evict the entry under the hand, or move past it if it was used since
+ * the hand last came by
+ */
+static void cache_tick(MatchCache *mc) {
+  if (mc->hand >= mc->clock_length) {
+    mc->hand = 0;
+  }
+  MatchCacheEntry *entry = mc->clock[mc->hand];
+  if (entry->referenced) {
+    entry->referenced = 0;
+    mc->hand++;
+    return;
+  }
+  cache_unlink(mc, entry);
+  mc->bytes -= entry->size;
+  mc->evictions++;
+  free(entry);
+
+  /* The last entry takes the empty slot, the hand looks at it next */
+  mc->clock_length--;
+  if (mc->hand < mc->clock_length) {
+    mc->clock[mc->hand] = mc->clock[mc->clock_length];
+  }
+}
+
+static void cache_grow_buckets(MatchCache *mc) {
+  size_t count = mc->bucket_count * 2;
+  MatchCacheEntry **buckets = cache_allocate_buckets(count);
+  for (size_t i = 0; i < mc->clock_length; i++) {
+    MatchCacheEntry *entry = mc->clock[i];
+    MatchCacheEntry **bucket = &buckets[entry->hash & (count - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+  }
+  free(mc->buckets);
+  mc->buckets = buckets;
+  mc->bucket_count = count;
+}
+
+/**
+ * Add the result of matching input on tape, evicting entries to stay in
+ * the budget. The states aren't copied in: the caller writes
+ * state_length of them to match_cache_states of the entry.
+ * @return the entry, or NULL if it's too big to cache
+ */
+MatchCacheEntry *match_cache_insert(MatchCache *mc, unsigned long tape,
+                                    const char *input, size_t length,
+                                    const char *output, size_t output_length,
+                                    int accepted, size_t state_length) {
+  if (!mc->keep_states) {
+    state_length = 0;
+  }
+  size_t size = sizeof(MatchCacheEntry) + state_length * sizeof(unsigned int) +
+                length + output_length;
+  if (size > mc->budget / 8) {
+    return NULL;
+  }
+
+  while (mc->clock_length && mc->bytes + size > mc->budget) {
+    cache_tick(mc);
+  }
+
+  MatchCacheEntry *entry = (MatchCacheEntry *) malloc(size);
+  if (!entry) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  entry->hash = cache_hash(tape, input, length);
+  entry->tape = tape;
+  entry->input_length = length;
+  entry->output_length = output_length;
+  entry->state_length = state_length;
+  entry->accepted = accepted;
+  entry->referenced = 0;
+  entry->size = size;
+  memcpy((char *) cache_input(entry), input, length);
+  memcpy((char *) match_cache_output(entry), output, output_length);
+
+  if (mc->clock_length == mc->clock_capacity) {
+    mc->clock_capacity = MAX(mc->clock_capacity * 2, CACHE_MIN_BUCKETS);
+    mc->clock = (MatchCacheEntry **) realloc(
+        mc->clock, mc->clock_capacity * sizeof(MatchCacheEntry *));
+    if (!mc->clock) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+  }
+  mc->clock[mc->clock_length++] = entry;
+  MatchCacheEntry **bucket = &mc->buckets[entry->hash & (mc->bucket_count - 1)];
+  entry->next = *bucket;
+  *bucket = entry;
+  if (mc->clock_length > mc->bucket_count) {
+    cache_grow_buckets(mc);
+  }
+  mc->bytes += size;
+  return entry;
+}
@@ -0,0 +1,91 @@
+#ifndef FST_CACHE_H
+#define FST_CACHE_H
+
+#include <stdlib.h>
+
+/*
+ * Match cache: results of earlier matches, keyed by the tape's serial
+ * (fst_frozen.h) and the input bytes.
+ *
+ * A repeated input costs one hash of the input and one probe instead
+ * of a walk and a fresh MatchObject. Entries hold the output, whether
+ * the input was accepted and, if the cache keeps them, the states.
+ *
+ * The cache stays under a budget in bytes, counting each entry's
+ * allocation. Eviction is CLOCK: a hit sets the entry's referenced bit,
+ * and the hand evicts the first entry it finds with the bit clear,
+ * clearing bits as it passes. An entry that would take more than an
+ * eighth of the budget is not cached at all.
+ *
+ * Nothing here locks; a cache belongs to one thread (one Lua state).
+ */
+
+typedef struct MatchCacheEntry MatchCacheEntry;
+
+struct MatchCacheEntry {
+  /**
+   * Next entry in the same bucket
+   */
+  MatchCacheEntry *next;
+  unsigned long long hash;
+  unsigned long tape;
+  size_t input_length;
+  size_t output_length;
+  /**
+   * 0 if the cache doesn't keep states
+   */
+  size_t state_length;
+  int accepted;
+  int referenced;
+  /**
+   * Bytes allocated for the entry, counted against the budget
+   */
+  size_t size;
+  /* Followed by the states, the input and the output */
+};
+
+typedef struct MatchCache MatchCache;
+
+struct MatchCache {
+  MatchCacheEntry **buckets;
+  /**
+   * Always a power of 2
+   */
+  size_t bucket_count;
+
+  /**
+   * Every entry, in the order the hand visits them
+   */
+  MatchCacheEntry **clock;
+  size_t clock_length;
+  size_t clock_capacity;
+  size_t hand;
+
+  size_t budget;
+  size_t bytes;
+  int keep_states;
+
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;
+};
+
+MatchCache *match_cache_create(size_t budget, int keep_states);
+
+void match_cache_destroy(MatchCache *mc);
+
+void match_cache_clear(MatchCache *mc);
+
+MatchCacheEntry *match_cache_lookup(MatchCache *mc, unsigned long tape,
+                                    const char *input, size_t length);
+
+MatchCacheEntry *match_cache_insert(MatchCache *mc, unsigned long tape,
+                                    const char *input, size_t length,
+                                    const char *output, size_t output_length,
+                                    int accepted, size_t state_length);
+
+unsigned int *match_cache_states(MatchCacheEntry *entry);
+
+const char *match_cache_output(MatchCacheEntry *entry);
+
+#endif /* FST_CACHE_H */
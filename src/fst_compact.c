@@ -0,0 +1,620 @@
+/**
+ * Compact serialized tapes: default entry plus exceptions per state
+ * @file fst_compact.c
+ */
+#include "fst_compact.h"
+#include "fst_fast.h"
+#include "fst_wide.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define COMPACT_VERSION 2
+#define COMPACT_BLOCK_STATES 1024
+#define COMPACT_HEADER_SIZE (8 + 4 * 8)
+
+static const char compact_magic[4] = {'F', 'S', 'T', 'C'};
+
+/**
+ * One transition, whatever kind of tape it came from
+ */
+typedef struct CompactEntry CompactEntry;
+
+struct CompactEntry {
+  unsigned int out_state;
+  unsigned int flags;
+  const char *output;
+  size_t output_length;
+  /**
+   * Where output is in a wide tape's pool
+   */
+  size_t output_offset;
+};
+
+typedef struct CompactBuffer CompactBuffer;
+
+struct CompactBuffer {
+  unsigned char *data;
+  size_t length;
+  size_t capacity;
+};
+
+static void compact_reserve(CompactBuffer *buffer, size_t extra) {
+  if (buffer->capacity < buffer->length + extra) {
+    buffer->capacity = MAX(buffer->capacity * 2, buffer->length + extra);
+    buffer->data = (unsigned char *) realloc(buffer->data, buffer->capacity);
+    if (!buffer->data) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+  }
+}
+
+static void compact_put_byte(CompactBuffer *buffer, unsigned char b) {
+  compact_reserve(buffer, 1);
+  buffer->data[buffer->length] = b;
+  buffer->length += 1;
+}
+
+static void compact_put_bytes(CompactBuffer *buffer, const void *data,
+                              size_t length) {
+  compact_reserve(buffer, length);
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+}
+
+static void compact_put_varint(CompactBuffer *buffer, uint64_t n) {
+  while (n >= 0x80) {
+    compact_put_byte(buffer, (unsigned char) (n | 0x80));
+    n >>= 7;
+  }
+  compact_put_byte(buffer, (unsigned char) n);
+}
+
+static void compact_put_u64(unsigned char *out, uint64_t n) {
+  for (int i = 0; i < 8; i++) {
+    out[i] = (unsigned char) (n >> (8 * i));
+  }
+}
+
+static uint64_t compact_get_u64(const unsigned char *in) {
+  uint64_t n = 0;
+  for (int i = 0; i < 8; i++) {
+    n |= (uint64_t) in[i] << (8 * i);
+  }
+  return n;
+}
+
+static uint64_t compact_zigzag(int64_t n) {
+  return ((uint64_t) n << 1) ^ (uint64_t) (n >> 63);
+}
+
+static int64_t compact_unzigzag(uint64_t n) {
+  return (int64_t) (n >> 1) ^ -(int64_t) (n & 1);
+}
+
+static int compact_entry_cmp(const CompactEntry *a, const CompactEntry *b) {
+  if (a->out_state != b->out_state) {
+    return a->out_state < b->out_state ? -1 : 1;
+  }
+  if (a->flags != b->flags) {
+    return a->flags < b->flags ? -1 : 1;
+  }
+  if (a->output_length != b->output_length) {
+    return a->output_length < b->output_length ? -1 : 1;
+  }
+  return memcmp(a->output, b->output, a->output_length);
+}
+
+static int compact_entry_qsort_cmp(const void *a, const void *b) {
+  return compact_entry_cmp(*(const CompactEntry *const *) a,
+                           *(const CompactEntry *const *) b);
+}
+
+/**
+ * Append an entry's out state and output: inline for a narrow tape,
+ * where in the pool for a wide one
+ */
+static void compact_put_target(CompactBuffer *buffer, int kind, size_t state,
+                               const CompactEntry *e) {
+  compact_put_varint(buffer, compact_zigzag((int64_t) e->out_state -
+                                            (int64_t) state));
+  compact_put_varint(buffer, e->output_length);
+  if (kind == COMPACT_KIND_NARROW) {
+    compact_put_bytes(buffer, e->output, e->output_length);
+  } else if (e->output_length) {
+    compact_put_varint(buffer, e->output_offset);
+  }
+}
+
+/**
+ * Append one state, given as its 256 entries
+ */
+static void compact_encode_state(CompactBuffer *buffer, int kind,
+                                 size_t state, CompactEntry *row) {
+  /* The default is the most common entry */
+  CompactEntry *sorted[256];
+  for (int i = 0; i < 256; i++) {
+    sorted[i] = row + i;
+  }
+  qsort(sorted, 256, sizeof(CompactEntry *), compact_entry_qsort_cmp);
+  CompactEntry *def = sorted[0];
+  int best = 0;
+  int run = 0;
+  for (int i = 0; i < 256; i++) {
+    run = (i > 0 && compact_entry_cmp(sorted[i - 1], sorted[i]) == 0)
+              ? run + 1
+              : 1;
+    if (run > best) {
+      best = run;
+      def = sorted[i];
+    }
+  }
+
+  compact_put_byte(buffer, (unsigned char) def->flags);
+  compact_put_target(buffer, kind, state, def);
+
+  compact_put_varint(buffer, 256 - best);
+  int next = 0;
+  for (int i = 0; i < 256; i++) {
+    CompactEntry *e = row + i;
+    if (compact_entry_cmp(e, def) == 0) {
+      continue;
+    }
+    int flags_differ = e->flags != def->flags;
+    compact_put_varint(buffer, ((uint64_t) (i - next) << 1) | flags_differ);
+    if (flags_differ) {
+      compact_put_byte(buffer, (unsigned char) e->flags);
+    }
+    compact_put_target(buffer, kind, state, e);
+    next = i + 1;
+  }
+}
+
+/**
+ * Write header, block index, pool and data.
+ * get_row fills the 256 entries of a state.
+ */
+static int compact_write(FILE *f, int kind, size_t length, const char *pool,
+                         size_t pool_length, void *tape,
+                         void (*get_row)(void *, size_t, CompactEntry *)) {
+  size_t blocks = (length + COMPACT_BLOCK_STATES - 1) / COMPACT_BLOCK_STATES;
+  unsigned char *index = (unsigned char *) malloc(MAX(blocks, 1) * 8);
+  if (!index) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+
+  CompactBuffer buffer = {NULL, 0, 0};
+  CompactEntry row[256];
+  for (size_t state = 0; state < length; state++) {
+    if (state % COMPACT_BLOCK_STATES == 0) {
+      compact_put_u64(index + state / COMPACT_BLOCK_STATES * 8, buffer.length);
+    }
+    get_row(tape, state, row);
+    compact_encode_state(&buffer, kind, state, row);
+  }
+
+  unsigned char header[COMPACT_HEADER_SIZE];
+  memcpy(header, compact_magic, 4);
+  header[4] = (unsigned char) kind;
+  header[5] = COMPACT_VERSION;
+  header[6] = 0;
+  header[7] = 0;
+  compact_put_u64(header + 8, length);
+  compact_put_u64(header + 16, COMPACT_BLOCK_STATES);
+  compact_put_u64(header + 24, pool_length);
+  compact_put_u64(header + 32, blocks);
+
+  int ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+           fwrite(index, 8, blocks, f) == blocks &&
+           fwrite(pool, 1, pool_length, f) == pool_length &&
+           fwrite(buffer.data, 1, buffer.length, f) == buffer.length;
+
+  free(index);
+  free(buffer.data);
+  return ok ? 0 : -1;
+}
+
+static void compact_narrow_row(void *tape, size_t state, CompactEntry *row) {
+  InstructionTape *it = (InstructionTape *) tape;
+  FstStateEntry *fse = (FstStateEntry *) it->beginning + state * 256;
+  for (int i = 0; i < 256; i++) {
+    row[i].out_state = fse[i].components.out_state;
+    row[i].flags = (unsigned char) fse[i].components.flags;
+    row[i].output = &fse[i].components.outchar;
+    row[i].output_length = fse[i].components.outchar ? 1 : 0;
+    row[i].output_offset = 0;
+  }
+}
+
+static void compact_wide_row(void *tape, size_t state, CompactEntry *row) {
+  WideInstructionTape *it = (WideInstructionTape *) tape;
+  FstWideEntry *fwe = it->beginning + state * 256;
+  for (int i = 0; i < 256; i++) {
+    row[i].out_state = fwe[i].out_state;
+    row[i].flags = fwe[i].flags & 0xff;
+    row[i].output = it->output_pool + fwe[i].out_offset;
+    row[i].output_length = fwe[i].out_length;
+    row[i].output_offset = fwe[i].out_offset;
+  }
+}
+
+/**
+ * Dump it in the compact format
+ * @return 0 on success, -1 if writing failed
+ */
+int compact_dumpfile(FILE *f, InstructionTape *it) {
+  fse_freeze_arena(it);
+  return compact_write(f, COMPACT_KIND_NARROW, it->length, NULL, 0, it,
+                       compact_narrow_row);
+}
+
+/**
+ * Dump a wide tape in the compact format
+ * @return 0 on success, -1 if writing failed
+ */
+int wide_compact_dumpfile(FILE *f, WideInstructionTape *it) {
+  fwe_freeze_arena(it);
+  return compact_write(f, COMPACT_KIND_WIDE, it->length, it->output_pool,
+                       it->pool_length, it, compact_wide_row);
+}
+
+typedef struct CompactReader CompactReader;
+
+struct CompactReader {
+  const unsigned char *p;
+  const unsigned char *end;
+  int error;
+};
+
+static unsigned char compact_get_byte(CompactReader *r) {
+  if (r->p >= r->end) {
+    r->error = 1;
+    return 0;
+  }
+  return *(r->p++);
+}
+
+static uint64_t compact_get_varint(CompactReader *r) {
+  uint64_t n = 0;
+  for (int shift = 0; shift < 64 && r->p < r->end; shift += 7) {
+    unsigned char b = *(r->p++);
+    n |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return n;
+    }
+  }
+  r->error = 1;
+  return 0;
+}
+
+/**
+ * Decoding of a run of blocks, one per thread
+ */
+typedef struct CompactJob CompactJob;
+
+struct CompactJob {
+  int kind;
+  const unsigned char *index;
+  const unsigned char *data;
+  size_t data_length;
+  size_t blocks;
+  size_t block_states;
+  size_t length;
+  size_t first_block;
+  size_t last_block;
+  /**
+   * FstStateEntry or FstWideEntry rows
+   */
+  void *rows;
+  size_t pool_length;
+  int error;
+};
+
+/**
+ * Read an entry of state: flags (unless given), out state and output,
+ * which is inline for a narrow tape and in the pool for a wide one
+ */
+static void compact_get_entry(CompactJob *job, CompactReader *r, size_t state,
+                              int read_flags, unsigned int flags, void *out) {
+  if (read_flags) {
+    flags = compact_get_byte(r);
+  }
+  int64_t target = (int64_t) state + compact_unzigzag(compact_get_varint(r));
+  uint64_t output_length = compact_get_varint(r);
+  if (r->error || target < 0 || (uint64_t) target >= job->length) {
+    r->error = 1;
+    return;
+  }
+
+  if (job->kind == COMPACT_KIND_NARROW) {
+    if (output_length > (uint64_t) (r->end - r->p)) {
+      r->error = 1;
+      return;
+    }
+    const unsigned char *output = r->p;
+    r->p += output_length;
+    if (output_length > 1 || target > 65535) {
+      r->error = 1;
+      return;
+    }
+    FstStateEntry *fse = (FstStateEntry *) out;
+    fse->components.flags = (char) flags;
+    fse->components.outchar = output_length ? (char) *output : 0;
+    fse->components.out_state = (unsigned short) target;
+  } else {
+    uint64_t offset = output_length ? compact_get_varint(r) : 0;
+    if (r->error || output_length > job->pool_length ||
+        offset > job->pool_length - output_length ||
+        output_length > FWE_MAX_OUTPUT_LENGTH || (flags & ~7u)) {
+      r->error = 1;
+      return;
+    }
+    FstWideEntry *fwe = (FstWideEntry *) out;
+    fwe->out_state = (unsigned int) target;
+    fwe->flags = flags;
+    fwe->out_offset = (unsigned int) offset;
+    fwe->out_length = output_length;
+  }
+}
+
+static int compact_decode_block(CompactJob *job, size_t block) {
+  size_t start = compact_get_u64(job->index + block * 8);
+  size_t end = job->data_length;
+  if (block + 1 < job->blocks) {
+    end = compact_get_u64(job->index + (block + 1) * 8);
+  }
+  if (start > end || end > job->data_length) {
+    return -1;
+  }
+
+  CompactReader r = {job->data + start, job->data + end, 0};
+  size_t first = block * job->block_states;
+  size_t last = MIN(first + job->block_states, job->length);
+  size_t entry_size = job->kind == COMPACT_KIND_NARROW ? sizeof(FstStateEntry)
+                                                       : sizeof(FstWideEntry);
+
+  for (size_t state = first; state < last && !r.error; state++) {
+    unsigned char *row = (unsigned char *) job->rows + state * 256 * entry_size;
+
+    compact_get_entry(job, &r, state, 1, 0, row);
+    if (r.error) {
+      break;
+    }
+    unsigned int flags;
+    if (job->kind == COMPACT_KIND_NARROW) {
+      FstStateEntry *fse = (FstStateEntry *) row;
+      for (int i = 1; i < 256; i++) {
+        fse[i] = fse[0];
+      }
+      flags = (unsigned char) fse->components.flags;
+    } else {
+      FstWideEntry *fwe = (FstWideEntry *) row;
+      for (int i = 1; i < 256; i++) {
+        fwe[i] = fwe[0];
+      }
+      flags = fwe->flags;
+    }
+
+    uint64_t exceptions = compact_get_varint(&r);
+    if (exceptions > 256) {
+      r.error = 1;
+    }
+    uint64_t next = 0;
+    for (uint64_t i = 0; i < exceptions && !r.error; i++) {
+      uint64_t header = compact_get_varint(&r);
+      uint64_t b = next + (header >> 1);
+      if (b > 255) {
+        r.error = 1;
+        break;
+      }
+      compact_get_entry(job, &r, state, header & 1, flags,
+                        row + b * entry_size);
+      next = b + 1;
+    }
+  }
+
+  if (r.error || r.p != r.end) {
+    return -1;
+  }
+  return 0;
+}
+
+static void *compact_decode_job(void *arg) {
+  CompactJob *job = (CompactJob *) arg;
+  for (size_t block = job->first_block; block < job->last_block; block++) {
+    if (compact_decode_block(job, block) != 0) {
+      job->error = 1;
+      break;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Decode into rows, split over up to threads threads
+ * @return 0 on success, -1 if data is not a valid compact tape of kind
+ */
+static int compact_decode_into(const unsigned char *data, size_t length,
+                               int kind, int threads, void *rows) {
+  CompactJob job;
+  job.kind = kind;
+  job.length = compact_get_u64(data + 8);
+  job.block_states = compact_get_u64(data + 16);
+  job.pool_length = compact_get_u64(data + 24);
+  job.blocks = compact_get_u64(data + 32);
+  job.index = data + COMPACT_HEADER_SIZE;
+  job.data = job.index + job.blocks * 8 + job.pool_length;
+  job.data_length = length - (job.data - data);
+  job.rows = rows;
+  job.error = 0;
+
+  threads = (int) MIN((size_t) MAX(threads, 1), MAX(job.blocks, 1));
+  CompactJob *jobs = (CompactJob *) malloc(threads * sizeof(CompactJob));
+  pthread_t *workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+  int *started = (int *) calloc(threads, sizeof(int));
+  if (!jobs || !workers || !started) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+
+  for (int i = 0; i < threads; i++) {
+    jobs[i] = job;
+    jobs[i].first_block = job.blocks * i / threads;
+    jobs[i].last_block = job.blocks * (i + 1) / threads;
+  }
+  for (int i = 1; i < threads; i++) {
+    started[i] =
+        pthread_create(workers + i, NULL, compact_decode_job, jobs + i) == 0;
+  }
+
+  /* This thread takes the first run, and any run whose thread failed */
+  int error = 0;
+  for (int i = 0; i < threads; i++) {
+    if (!started[i]) {
+      compact_decode_job(jobs + i);
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    if (started[i]) {
+      pthread_join(workers[i], NULL);
+    }
+    error |= jobs[i].error;
+  }
+
+  free(started);
+  free(jobs);
+  free(workers);
+  return error ? -1 : 0;
+}
+
+/**
+ * Check the header, and that the block index and pool fit
+ * @return the state count, or -1 if data is not a compact tape of kind
+ */
+static long long compact_check_header(const unsigned char *data,
+                                      size_t length, int kind,
+                                      size_t *pool_length) {
+  if (length < COMPACT_HEADER_SIZE || memcmp(data, compact_magic, 4) != 0 ||
+      data[4] != kind || data[5] != COMPACT_VERSION) {
+    return -1;
+  }
+  uint64_t states = compact_get_u64(data + 8);
+  uint64_t block_states = compact_get_u64(data + 16);
+  uint64_t pool = compact_get_u64(data + 24);
+  uint64_t blocks = compact_get_u64(data + 32);
+  if (block_states == 0 ||
+      blocks != (states + block_states - 1) / block_states ||
+      blocks > (length - COMPACT_HEADER_SIZE) / 8 ||
+      pool > length - COMPACT_HEADER_SIZE - blocks * 8 ||
+      states > length / 4 ||
+      (kind == COMPACT_KIND_NARROW && (states > 65536 || pool))) {
+    return -1;
+  }
+  *pool_length = pool;
+  return (long long) states;
+}
+
+/**
+ * Decode a compact narrow tape held in memory
+ * @return the tape, or NULL if data is not one
+ */
+InstructionTape *compact_decode(const unsigned char *data, size_t length,
+                                int threads) {
+  size_t pool_length = 0;
+  long long states =
+      compact_check_header(data, length, COMPACT_KIND_NARROW, &pool_length);
+  if (states < 0) {
+    return NULL;
+  }
+
+  InstructionTape *it = (InstructionTape *) malloc(sizeof(InstructionTape));
+  fse_initialize_tape(it);
+  fse_grow(it, states);
+  it->length = states;
+
+  if (compact_decode_into(data, length, COMPACT_KIND_NARROW, threads,
+                          it->beginning) != 0) {
+    instruction_tape_destroy(it);
+    free(it);
+    return NULL;
+  }
+  return it;
+}
+
+/**
+ * Decode a compact wide tape held in memory
+ * @return the tape, or NULL if data is not one
+ */
+WideInstructionTape *wide_compact_decode(const unsigned char *data,
+                                         size_t length, int threads) {
+  size_t pool_length = 0;
+  long long states =
+      compact_check_header(data, length, COMPACT_KIND_WIDE, &pool_length);
+  if (states < 0 || pool_length > FWE_MAX_POOL_OFFSET) {
+    return NULL;
+  }
+
+  WideInstructionTape *it =
+      (WideInstructionTape *) malloc(sizeof(WideInstructionTape));
+  fwe_initialize_tape(it);
+  fwe_grow(it, states);
+  fwe_grow_pool(it, pool_length);
+  it->length = states;
+  it->pool_length = pool_length;
+  it->current = it->beginning + states * 256;
+  memcpy(it->output_pool,
+         data + COMPACT_HEADER_SIZE + compact_get_u64(data + 32) * 8,
+         pool_length);
+
+  if (compact_decode_into(data, length, COMPACT_KIND_WIDE, threads,
+                          it->beginning) != 0) {
+    wide_instruction_tape_destroy(it);
+    free(it);
+    return NULL;
+  }
+  return it;
+}
+
+/**
+ * Read all of f
+ */
+static unsigned char *compact_slurp(FILE *f, size_t *length) {
+  size_t capacity = 1 << 16;
+  unsigned char *data = (unsigned char *) malloc(capacity);
+  *length = 0;
+  for (;;) {
+    if (!data) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+    *length += fread(data + *length, 1, capacity - *length, f);
+    if (*length < capacity) {
+      return data;
+    }
+    capacity *= 2;
+    data = (unsigned char *) realloc(data, capacity);
+  }
+}
+
+InstructionTape *compact_loadfile(FILE *f, int threads) {
+  size_t length = 0;
+  unsigned char *data = compact_slurp(f, &length);
+  InstructionTape *it = compact_decode(data, length, threads);
+  free(data);
+  return it;
+}
+
+WideInstructionTape *wide_compact_loadfile(FILE *f, int threads) {
+  size_t length = 0;
+  unsigned char *data = compact_slurp(f, &length);
+  WideInstructionTape *it = wide_compact_decode(data, length, threads);
+  free(data);
+  return it;
+}
@@ -0,0 +1,56 @@
+#ifndef FST_COMPACT_H
+#define FST_COMPACT_H
+
+#include "fst_fast.h"
+#include "fst_wide.h"
+#include <stdio.h>
+
+/*
+ * Compact serialized tapes.
+ *
+ * Most rows are one default transition plus a few exceptions, so each
+ * state is stored as its most common entry followed by the entries
+ * that differ from it, instead of 256 raw entries.
+ *
+ * Layout (all fixed width fields are little endian uint64):
+ * "FSTC", kind (0 narrow, 1 wide), version, 2 reserved bytes
+ * state count, states per block, output pool length, block count
+ * block index: data offset per block
+ * output pool, as in a wide tape (empty for a narrow one)
+ * data: the states, block after block
+ *
+ * Each state is
+ * default entry
+ * varint exception count
+ * exceptions, by increasing input byte
+ *
+ * and each entry is
+ * [exceptions only] varint (input byte gap << 1 | flags differ)
+ * [default, or flags differ] flags byte
+ * zigzag varint (out state - this state)
+ * varint output length, then the output byte for a narrow tape, or
+ *   for a wide one (unless the length is 0) varint offset in the pool
+ *
+ * Outputs shared by many entries are stored once, as in memory. The
+ * block index lets blocks be decoded independently, and in
+ * parallel.
+ */
+
+#define COMPACT_KIND_NARROW 0
+#define COMPACT_KIND_WIDE 1
+
+int compact_dumpfile(FILE *f, InstructionTape *it);
+
+int wide_compact_dumpfile(FILE *f, WideInstructionTape *it);
+
+InstructionTape *compact_decode(const unsigned char *data, size_t length,
+                                int threads);
+
+WideInstructionTape *wide_compact_decode(const unsigned char *data,
+                                         size_t length, int threads);
+
+InstructionTape *compact_loadfile(FILE *f, int threads);
+
+WideInstructionTape *wide_compact_loadfile(FILE *f, int threads);
+
+#endif /* FST_COMPACT_H */
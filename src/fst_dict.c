@@ -0,0 +1,373 @@
+/**
+ * Minimal acyclic transducers from sorted dictionaries
+ * @file fst_dict.c
+ */
+#include "fst_dict.h"
+#include "fst_arena.h"
+#include "fst_fast.h"
+#include "fst_wide.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static void *dict_realloc(void *ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (!ptr) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  return ptr;
+}
+
+static void dict_bytes_reserve(DictBytes *bytes, size_t targetlen) {
+  if (bytes->capacity < targetlen) {
+    bytes->capacity = MAX(bytes->capacity * 2, MAX(targetlen, 16));
+    bytes->data = (char *) dict_realloc(bytes->data, bytes->capacity);
+  }
+}
+
+static void dict_bytes_append(DictBytes *bytes, const void *data,
+                              size_t length) {
+  dict_bytes_reserve(bytes, bytes->length + length);
+  memcpy(bytes->data + bytes->length, data, length);
+  bytes->length += length;
+}
+
+static void dict_bytes_prepend(DictBytes *bytes, const char *data,
+                               size_t length) {
+  dict_bytes_reserve(bytes, bytes->length + length);
+  memmove(bytes->data + length, bytes->data, bytes->length);
+  memcpy(bytes->data, data, length);
+  bytes->length += length;
+}
+
+static size_t dict_common_prefix(const char *a, size_t a_length,
+                                 const char *b, size_t b_length) {
+  size_t shorter = MIN(a_length, b_length);
+  size_t i = 0;
+  while (i < shorter && a[i] == b[i]) {
+    i++;
+  }
+  return i;
+}
+
+/**
+ * Make sure frontier[0..length] exist
+ */
+static void dict_grow_frontier(DictBuilder *db, size_t length) {
+  if (db->frontier_capacity <= length) {
+    size_t old_capacity = db->frontier_capacity;
+    db->frontier_capacity = MAX(db->frontier_capacity * 2, length + 1);
+    db->frontier = (DictNode *) dict_realloc(
+        db->frontier, db->frontier_capacity * sizeof(DictNode));
+    memset(db->frontier + old_capacity, 0,
+           (db->frontier_capacity - old_capacity) * sizeof(DictNode));
+  }
+}
+
+static DictArc *dict_node_add_arc(DictNode *node, unsigned char label) {
+  if (node->arc_capacity <= node->arc_count) {
+    size_t old_capacity = node->arc_capacity;
+    node->arc_capacity = MAX(node->arc_capacity * 2, 4);
+    node->arcs = (DictArc *) dict_realloc(node->arcs,
+                                          node->arc_capacity * sizeof(DictArc));
+    memset(node->arcs + old_capacity, 0,
+           (node->arc_capacity - old_capacity) * sizeof(DictArc));
+  }
+  DictArc *arc = node->arcs + node->arc_count;
+  node->arc_count += 1;
+  arc->label = label;
+  arc->target = DICT_STATE_ERROR;
+  arc->output.length = 0;
+  return arc;
+}
+
+/**
+ * Keeps the allocations of node around for the next key
+ */
+static void dict_node_reset(DictNode *node) {
+  node->arc_count = 0;
+  node->final = 0;
+  node->final_output.length = 0;
+}
+
+static void dict_node_free(DictNode *node) {
+  for (size_t i = 0; i < node->arc_capacity; i++) {
+    free(node->arcs[i].output.data);
+  }
+  free(node->arcs);
+  free(node->final_output.data);
+}
+
+/**
+ * Fill row (already cleared to the error state) with node's edges
+ */
+static void dict_fill_row(DictBuilder *db, FstWideEntry *row, DictNode *node) {
+  for (size_t i = 0; i < node->arc_count; i++) {
+    DictArc *arc = node->arcs + i;
+    fwe_set_outstate(row + arc->label, arc->target);
+    fwe_set_output(db->tape, row + arc->label, arc->output.data,
+                   arc->output.length);
+  }
+  if (node->final) {
+    FstWideEntry *fwe = row + (unsigned char) db->terminator;
+    fwe_set_outstate(fwe, DICT_STATE_ACCEPT);
+    fwe_set_output(db->tape, fwe, node->final_output.data,
+                   node->final_output.length);
+  }
+}
+
+static void dict_append_u32(DictBytes *bytes, unsigned int n) {
+  dict_bytes_append(bytes, &n, sizeof(n));
+}
+
+/**
+ * Two frozen states are equivalent iff their signatures are equal
+ */
+static void dict_signature(DictNode *node, DictBytes *out) {
+  out->length = 0;
+  dict_append_u32(out, node->final);
+  if (node->final) {
+    dict_append_u32(out, node->final_output.length);
+    dict_bytes_append(out, node->final_output.data, node->final_output.length);
+  }
+  dict_append_u32(out, node->arc_count);
+  for (size_t i = 0; i < node->arc_count; i++) {
+    DictArc *arc = node->arcs + i;
+    dict_bytes_append(out, &arc->label, 1);
+    dict_append_u32(out, arc->target);
+    dict_append_u32(out, arc->output.length);
+    dict_bytes_append(out, arc->output.data, arc->output.length);
+  }
+}
+
+/**
+ * FNV-1a
+ */
+static size_t dict_hash(const char *data, size_t length) {
+  size_t hash = (size_t) 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char) data[i];
+    hash *= (size_t) 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void dict_register_insert(DictBuilder *db, DictRegisterEntry entry) {
+  size_t mask = db->states_capacity - 1;
+  size_t slot = entry.hash & mask;
+  while (db->states[slot].signature) {
+    slot = (slot + 1) & mask;
+  }
+  db->states[slot] = entry;
+  db->states_count += 1;
+}
+
+static void dict_register_grow(DictBuilder *db) {
+  if ((db->states_count + 1) * 2 <= db->states_capacity) {
+    return;
+  }
+  DictRegisterEntry *old = db->states;
+  size_t old_capacity = db->states_capacity;
+  db->states_capacity = MAX(old_capacity * 2, 1024);
+  db->states = (DictRegisterEntry *) calloc(db->states_capacity,
+                                            sizeof(DictRegisterEntry));
+  if (!db->states) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  db->states_count = 0;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].signature) {
+      dict_register_insert(db, old[i]);
+    }
+  }
+  free(old);
+}
+
+/**
+ * Freeze node: reuse an equivalent state or write a new one to the tape
+ * @return the state number
+ */
+static unsigned int dict_compile(DictBuilder *db, DictNode *node) {
+  dict_signature(node, &db->scratch);
+  size_t hash = dict_hash(db->scratch.data, db->scratch.length);
+
+  dict_register_grow(db);
+  size_t mask = db->states_capacity - 1;
+  for (size_t slot = hash & mask; db->states[slot].signature;
+       slot = (slot + 1) & mask) {
+    DictRegisterEntry *entry = db->states + slot;
+    if (entry->hash == hash && entry->signature_length == db->scratch.length &&
+        memcmp(entry->signature, db->scratch.data, db->scratch.length) == 0) {
+      dict_node_reset(node);
+      return entry->state;
+    }
+  }
+
+  unsigned int state = db->tape->length;
+  fwe_clear_instr(db->tape, DICT_STATE_ERROR);
+  dict_fill_row(db, db->tape->current, node);
+  fwe_finish(db->tape);
+
+  DictRegisterEntry entry;
+  entry.hash = hash;
+  entry.state = state;
+  entry.signature_length = db->scratch.length;
+  entry.signature = (char *) dict_realloc(NULL, db->scratch.length);
+  memcpy(entry.signature, db->scratch.data, db->scratch.length);
+  dict_register_insert(db, entry);
+
+  dict_node_reset(node);
+  return state;
+}
+
+/**
+ * Freeze the states of the previous key deeper than prefix
+ */
+static void dict_freeze_tail(DictBuilder *db, size_t prefix) {
+  for (size_t idx = db->previous.length; idx > prefix; idx--) {
+    unsigned int state = dict_compile(db, db->frontier + idx);
+    DictNode *parent = db->frontier + idx - 1;
+    parent->arcs[parent->arc_count - 1].target = state;
+  }
+}
+
+void dict_builder_initialize(DictBuilder *db, char terminator) {
+  memset(db, 0, sizeof(DictBuilder));
+  db->terminator = terminator;
+  dict_grow_frontier(db, 16);
+
+  db->tape = (WideInstructionTape *) malloc(sizeof(WideInstructionTape));
+  fwe_initialize_arena_tape(db->tape);
+
+  /* Start state, written for real by dict_builder_finish */
+  fwe_clear_instr(db->tape, DICT_STATE_ERROR);
+  fwe_set_initial_flags(db->tape);
+  fwe_finish(db->tape);
+
+  /* Error state */
+  fwe_clear_instr(db->tape, DICT_STATE_ERROR);
+  fwe_finish(db->tape);
+
+  /* Accept state */
+  fwe_clear_instr(db->tape, DICT_STATE_ERROR);
+  fwe_set_final_flags(db->tape);
+  fwe_finish(db->tape);
+}
+
+/**
+ * Add key -> value. Keys must come in strictly increasing byte order.
+ * @return DICT_OK, or why the key was rejected
+ */
+int dict_builder_add(DictBuilder *db, const char *key, size_t key_length,
+                     const char *value, size_t value_length) {
+  if (memchr(key, db->terminator, key_length)) {
+    return DICT_TERMINATOR_IN_KEY;
+  }
+
+  size_t prefix = 0;
+  if (db->key_count > 0) {
+    prefix = dict_common_prefix(db->previous.data, db->previous.length, key,
+                                key_length);
+    if (prefix == key_length ||
+        (prefix < db->previous.length &&
+         (unsigned char) key[prefix] <
+             (unsigned char) db->previous.data[prefix])) {
+      return DICT_UNSORTED;
+    }
+  }
+
+  dict_freeze_tail(db, prefix);
+
+  dict_grow_frontier(db, key_length);
+  for (size_t idx = prefix; idx < key_length; idx++) {
+    dict_node_add_arc(db->frontier + idx, (unsigned char) key[idx]);
+  }
+  db->frontier[key_length].final = 1;
+  db->frontier[key_length].final_output.length = 0;
+
+  /* Push the parts of earlier outputs that this value doesn't share */
+  for (size_t idx = 1; idx <= prefix; idx++) {
+    DictNode *parent = db->frontier + idx - 1;
+    DictArc *arc = parent->arcs + parent->arc_count - 1;
+    size_t common = dict_common_prefix(arc->output.data, arc->output.length,
+                                       value, value_length);
+    if (common < arc->output.length) {
+      const char *suffix = arc->output.data + common;
+      size_t suffix_length = arc->output.length - common;
+      DictNode *node = db->frontier + idx;
+      for (size_t i = 0; i < node->arc_count; i++) {
+        dict_bytes_prepend(&node->arcs[i].output, suffix, suffix_length);
+      }
+      if (node->final) {
+        dict_bytes_prepend(&node->final_output, suffix, suffix_length);
+      }
+      arc->output.length = common;
+    }
+    value += common;
+    value_length -= common;
+  }
+
+  /* The rest goes on the first arc private to this key */
+  if (key_length > prefix) {
+    DictNode *node = db->frontier + prefix;
+    DictArc *arc = node->arcs + node->arc_count - 1;
+    arc->output.length = 0;
+    dict_bytes_append(&arc->output, value, value_length);
+  } else {
+    dict_bytes_append(&db->frontier[0].final_output, value, value_length);
+  }
+
+  db->previous.length = 0;
+  dict_bytes_append(&db->previous, key, key_length);
+  db->key_count += 1;
+  return DICT_OK;
+}
+
+/**
+ * Freeze the remaining states and hand over the tape.
+ * db must still be destroyed afterwards.
+ */
+WideInstructionTape *dict_builder_finish(DictBuilder *db) {
+  dict_freeze_tail(db, 0);
+
+  FstWideEntry *row =
+      (FstWideEntry *) arena_row(db->tape->arena, DICT_STATE_START);
+  for (int i = 0; i < 256; i++) {
+    fwe_set_outstate(row + i, DICT_STATE_ERROR);
+    fwe_set_output(db->tape, row + i, NULL, 0);
+  }
+  dict_fill_row(db, row, db->frontier);
+  dict_node_reset(db->frontier);
+  fwe_freeze(db->tape);
+
+  WideInstructionTape *tape = db->tape;
+  db->tape = NULL;
+  return tape;
+}
+
+/**
+ * Free resources in db, including the tape if it wasn't finished
+ */
+void dict_builder_destroy(DictBuilder *db) {
+  if (db->tape) {
+    wide_instruction_tape_destroy(db->tape);
+    free(db->tape);
+    db->tape = NULL;
+  }
+  for (size_t i = 0; i < db->frontier_capacity; i++) {
+    dict_node_free(db->frontier + i);
+  }
+  free(db->frontier);
+  for (size_t i = 0; i < db->states_capacity; i++) {
+    free(db->states[i].signature);
+  }
+  free(db->states);
+  free(db->previous.data);
+  free(db->scratch.data);
+  memset(db, 0, sizeof(DictBuilder));
+}
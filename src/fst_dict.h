@@ -0,0 +1,118 @@
+#ifndef FST_DICT_H
+#define FST_DICT_H
+
+#include "fst_wide.h"
+#include <stdlib.h>
+
+/*
+ * Incremental construction of a minimal acyclic transducer from a
+ * sorted key/value list (Daciuk et al., with outputs pushed towards the
+ * start state as in Mihov & Maurel).
+ *
+ * Only the path of the last key added is kept open; every state left
+ * behind is frozen at once, merged with an equivalent state from the
+ * register when there is one, and written straight into a wide tape
+ * built in an arena.
+ * Memory therefore follows the size of the minimal transducer, not the
+ * size of the key list.
+ *
+ * Tapes can't emit output at end of input, so every key is compiled
+ * followed by a terminator byte, and the value is spread over the path
+ * of key .. terminator. Looking up key means matching key .. terminator:
+ * the output is the value and the match succeeds iff key was added.
+ *
+ * The tape layout is
+ * 0: start state
+ * 1: error state (non-final, loops to itself)
+ * 2: accept state (final, reached only on the terminator)
+ * 3...: the other states, in the order they were frozen
+ */
+
+#define DICT_STATE_START 0
+#define DICT_STATE_ERROR 1
+#define DICT_STATE_ACCEPT 2
+
+/**
+ * Results of dict_builder_add
+ */
+#define DICT_OK 0
+#define DICT_UNSORTED 1
+#define DICT_TERMINATOR_IN_KEY 2
+
+typedef struct DictBytes DictBytes;
+
+struct DictBytes {
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
+typedef struct DictArc DictArc;
+
+struct DictArc {
+  unsigned char label;
+  /**
+   * The frozen target, meaningless for the last arc of an open state
+   */
+  unsigned int target;
+  DictBytes output;
+};
+
+typedef struct DictNode DictNode;
+
+struct DictNode {
+  DictArc *arcs;
+  size_t arc_count;
+  size_t arc_capacity;
+  int final;
+  DictBytes final_output;
+};
+
+typedef struct DictRegisterEntry DictRegisterEntry;
+
+struct DictRegisterEntry {
+  size_t hash;
+  unsigned int state;
+  /**
+   * Serialized state, NULL for an empty slot
+   */
+  char *signature;
+  size_t signature_length;
+};
+
+typedef struct DictBuilder DictBuilder;
+
+struct DictBuilder {
+  WideInstructionTape *tape;
+  char terminator;
+
+  /**
+   * frontier[i] is the open state reached by the first i bytes of the
+   * previous key
+   */
+  DictNode *frontier;
+  size_t frontier_capacity;
+
+  DictBytes previous;
+  size_t key_count;
+
+  DictRegisterEntry *states;
+  size_t states_count;
+  size_t states_capacity;
+
+  /**
+   * Scratch buffer for signatures
+   */
+  DictBytes scratch;
+};
+
+void dict_builder_initialize(DictBuilder *db, char terminator);
+
+int dict_builder_add(DictBuilder *db, const char *key, size_t key_length,
+                     const char *value, size_t value_length);
+
+WideInstructionTape *dict_builder_finish(DictBuilder *db);
+
+void dict_builder_destroy(DictBuilder *db);
+
+#endif /* FST_DICT_H */
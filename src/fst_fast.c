@@ -4,13 +4,6 @@
  * @file fst_fast.c
  */
 #include "fst_fast.h"
-#include <assert.h>
-#include <lauxlib.h>
-#include <lua.h>
-#include <lualib.h>
-#include <memory.h>
-#include <stdbool.h>
-#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,22 +35,6 @@
 // This limits the largets possible FST to 0.5 GB
 // The state list will always begin with the initial states.
 
-/**
- * Whether the transition is valid.
- * Only matters for non-determinsitic fsts
- */
-#define FST_FLAG_VALID (1 << 0)
-
-/**
- * Whether the fst state is initial
- */
-#define FST_FLAG_INITIAL (1 << 1)
-
-/**
- * Whether the fst state is final
- */
-#define FST_FLAG_FINAL (1 << 2)
-
 // Compile the FST a:a
 // AKA:
 // -> (0) -a:a-> ((1))
@@ -282,18 +259,50 @@ void fse_initialize_tape(InstructionTape *instrtape) {
   }
   instrtape->current = instrtape->beginning;
   instrtape->length = 0;
+  instrtape->arena = NULL;
+  instrtape->mapped_size = 0;
+}
+
+/**
+ * Initialize FSE tape that builds its states in an arena.
+ * Nothing but the fse_* builders may read it before fse_freeze.
+ */
+void fse_initialize_arena_tape(InstructionTape *instrtape) {
+  instrtape->capacity = 0;
+  instrtape->beginning = NULL;
+  instrtape->current = NULL;
+  instrtape->length = 0;
+  instrtape->arena = arena_create(sizeof(FstStateEntry) * 256);
+  instrtape->mapped_size = 0;
 }
 
 /**
  * Grow instruction tape if neccessary
  */
 void fse_grow(InstructionTape *instrtape, int targetlen) {
-  if (instrtape->capacity <= targetlen) {
+  if (instrtape->arena) {
+    /* Arena chunks are added as states are cleared */
+    return;
+  }
+  if (instrtape->capacity < targetlen) {
     instrtape->capacity = MAX(instrtape->capacity * 2, targetlen);
     int offset = instrtape->current - instrtape->beginning;
-    instrtape->beginning = (unsigned char *) realloc(
-        (void *) instrtape->beginning,
-        instrtape->capacity * sizeof(FstStateEntry) * 256);
+    if (instrtape->mapped_size) {
+      /* Growing a frozen tape: back to the heap */
+      unsigned char *grown = (unsigned char *) malloc(
+          instrtape->capacity * sizeof(FstStateEntry) * 256);
+      if (grown) {
+        memcpy(grown, instrtape->beginning,
+               instrtape->length * sizeof(FstStateEntry) * 256);
+      }
+      arena_unmap(instrtape->beginning, instrtape->mapped_size);
+      instrtape->mapped_size = 0;
+      instrtape->beginning = grown;
+    } else {
+      instrtape->beginning = (unsigned char *) realloc(
+          (void *) instrtape->beginning,
+          instrtape->capacity * sizeof(FstStateEntry) * 256);
+    }
     instrtape->current = instrtape->beginning + offset;
     if (!(instrtape->beginning)) {
       perror("Memory allocation failure");
@@ -302,20 +311,78 @@ void fse_grow(InstructionTape *instrtape, int targetlen) {
   }
 }
 
+/**
+ * Move the states into one region, on huge pages when the tape is big
+ * enough to use them. Pointers from fse_get_outgoing are invalid after.
+ */
+void fse_freeze(InstructionTape *instrtape) {
+  size_t size = instrtape->length * sizeof(FstStateEntry) * 256;
+  if (instrtape->mapped_size ||
+      (!instrtape->arena && size < ARENA_HUGE_PAGE_SIZE)) {
+    return;
+  }
+
+  size_t mapped_size = 0;
+  unsigned char *region = NULL;
+  if (size >= ARENA_HUGE_PAGE_SIZE) {
+    region = (unsigned char *) arena_map(size, &mapped_size);
+  }
+  if (!region) {
+    if (!instrtape->arena) {
+      return;
+    }
+    mapped_size = 0;
+    region = (unsigned char *) malloc(MAX(size, 1));
+    if (!region) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+  }
+
+  if (instrtape->arena) {
+    arena_copy_out(instrtape->arena, region, instrtape->length);
+    arena_destroy(instrtape->arena);
+    instrtape->arena = NULL;
+  } else {
+    memcpy(region, instrtape->beginning, size);
+    free(instrtape->beginning);
+  }
+  instrtape->beginning = region;
+  instrtape->current = region + size;
+  instrtape->capacity = instrtape->length;
+  instrtape->mapped_size = mapped_size;
+}
+
+/**
+ * Freeze instrtape if its states are still in an arena, where
+ * beginning is NULL. Everything that reads beginning calls this first.
+ */
+void fse_freeze_arena(InstructionTape *instrtape) {
+  if (instrtape->arena) {
+    fse_freeze(instrtape);
+  }
+}
+
 /**
  * Clear an entire instruction
  */
 void fse_clear_instr(InstructionTape *instrtape, unsigned short errorstate) {
-  fse_grow(instrtape, instrtape->length + 1);
+  if (instrtape->arena) {
+    instrtape->current = arena_row(instrtape->arena, instrtape->length);
+  } else {
+    fse_grow(instrtape, instrtape->length + 1);
+  }
   instrtape->length += 1;
 
+  FstStateEntry cleared;
+  fse_clear_flag(&cleared);
+  fse_set_valid_flag(&cleared);
+  fse_set_outchar(&cleared, 0);
+  fse_set_outstate(&cleared, errorstate);
+
   FstStateEntry *fse = (FstStateEntry *) instrtape->current;
   for (int i = 0; i < 256; i++) {
-    fse_clear_flag(fse);
-    fse_set_valid_flag(fse);
-    fse_set_outchar(fse, 0);
-    fse_set_outstate(fse, errorstate);
-    fse += 1;
+    fse[i] = cleared;
   }
 }
 
@@ -323,7 +390,7 @@ void fse_clear_instr(InstructionTape *instrtape, unsigned short errorstate) {
  * Get the outgoing edge on the character
  */
 FstStateEntry *fse_get_outgoing(InstructionTape *instrtape, char c) {
-  return ((FstStateEntry *) instrtape->current) + c;
+  return ((FstStateEntry *) instrtape->current) + (unsigned char) c;
 }
 
 /**
@@ -337,7 +404,15 @@ void fse_finish(InstructionTape *instrtape) {
  * Free resources in instrbuff
  */
 void instruction_tape_destroy(InstructionTape *instrbuff) {
-  free(instrbuff->beginning);
+  if (instrbuff->arena) {
+    arena_destroy(instrbuff->arena);
+    instrbuff->arena = NULL;
+  }
+  if (instrbuff->mapped_size) {
+    arena_unmap(instrbuff->beginning, instrbuff->mapped_size);
+  } else {
+    free(instrbuff->beginning);
+  }
 }
 
 /*
@@ -541,11 +616,11 @@ void create_pegreg_bak(InstructionTape *it) {
 /*   *next_state = states + (*state_number) * 256; */
 /* } */
 
-void match_grow_char(MatchObject *match_object, int targetlen) {
+void match_grow_char(MatchObject *match_object, size_t targetlen) {
   if (match_object->char_capacity <= targetlen) {
     match_object->char_capacity =
         MAX(match_object->char_capacity * 2, targetlen);
-    int offset = match_object->char_end - match_object->char_output;
+    size_t offset = match_object->char_end - match_object->char_output;
     size_t newsize = match_object->char_capacity * sizeof(char);
     match_object->char_output =
         (char *) realloc((void *) match_object->char_output, newsize);
@@ -557,11 +632,11 @@ void match_grow_char(MatchObject *match_object, int targetlen) {
   }
 }
 
-void match_grow_states(MatchObject *match_object, int targetlen) {
+void match_grow_states(MatchObject *match_object, size_t targetlen) {
   if (match_object->state_capacity <= targetlen) {
     match_object->state_capacity =
         MAX(match_object->state_capacity * 2, targetlen);
-    int offset = match_object->state_end - match_object->state_output;
+    size_t offset = match_object->state_end - match_object->state_output;
     size_t newsize = match_object->state_capacity * sizeof(short);
     match_object->state_output = (unsigned short *) realloc(
         (void *) match_object->state_output, newsize);
@@ -575,6 +650,7 @@ void match_grow_states(MatchObject *match_object, int targetlen) {
 
 void match_initialize(MatchObject *match_object,
                       InstructionTape *instruction_tape) {
+  fse_freeze_arena(instruction_tape);
   match_object->state_capacity = 10;
   match_object->state_length = 0;
   match_object->char_capacity = 10;
@@ -627,19 +703,25 @@ void match_one_char(MatchObject *match_object, char input) {
 }
 
 /**
- * Using instrtape, match input into match object
- * @param instrtape the instruction tape
- * @param match object the match object to be filled in
- * @param input the input string
+ * Match length more bytes of input on from where match object stopped,
+ * so a long input can be matched a slice at a time between
+ * match_initialize and match_finish
  */
-void match_string(InstructionTape *instrtape, MatchObject *match_object,
-                  const char *input) {
-  match_initialize(match_object, instrtape);
-  while (*input) {
-    match_one_char(match_object, *input);
-    input += 1;
+void match_continue(MatchObject *match_object, const char *input,
+                    size_t length) {
+  match_grow_states(match_object, match_object->state_length + length + 1);
+  for (size_t i = 0; i < length; i++) {
+    match_one_char(match_object, input[i]);
   }
+}
 
+/**
+ * Set match_success once all input has been matched: the match
+ * succeeds iff it read something and ended in a final state
+ */
+void match_finish(InstructionTape *instrtape, MatchObject *match_object) {
+  fse_freeze_arena(instrtape);
+  match_object->match_success = 0;
   if (match_object->state_length > 0) {
     FstStateEntry *last_state =
         (FstStateEntry *) instrtape->beginning +
@@ -650,52 +732,39 @@ void match_string(InstructionTape *instrtape, MatchObject *match_object,
   }
 }
 
-static int c_swap(lua_State *L) {
-  double arg1 = luaL_checknumber(L, 1);
-  double arg2 = luaL_checknumber(L, 2);
-  lua_pushnumber(L, arg2);
-  lua_pushnumber(L, arg1);
-  return 2;
+/**
+ * Using instrtape, match length bytes of input, NUL included, into
+ * match object
+ * @param instrtape the instruction tape
+ * @param match object the match object to be filled in
+ * @param input the input bytes
+ * @param length the number of bytes
+ */
+void match_bytes(InstructionTape *instrtape, MatchObject *match_object,
+                 const char *input, size_t length) {
+  fse_freeze_arena(instrtape);
+  match_initialize(match_object, instrtape);
+  match_continue(match_object, input, length);
+  match_finish(instrtape, match_object);
 }
 
-/*
- * Instruction tape inspection library:
- * Contains building blocks for:
- *
- * fst_fast.inspector.get_length(it)
- *
- * which returns the # of states in the instruction tape
- *
- * fst_fast.inspector.is_valid(it, n)
- *
- * which returns whether Nth state is valid
- *
- * fst_fast.inspector.is_final(it, n)
- *
- * returns whether the Nth state is final
- *
- * fst_fast.inspector.is_initial(it, n)
- *
- * returns whether the Nth state is initial
- *
- * fst_fast.inspector.outgoings(it, n)
- *
- * Gets all of the outgoing transitions at N
- *
- * fst_fast.dump(it, filename)
- *
- * Dumps the FST at filename
- *
- * fst_fast.load(filename)
- *
- * Creates an FST based on the dump
+/**
+ * Using instrtape, match input into match object
+ * @param instrtape the instruction tape
+ * @param match object the match object to be filled in
+ * @param input the input string, up to its NUL
  */
+void match_string(InstructionTape *instrtape, MatchObject *match_object,
+                  const char *input) {
+  match_bytes(instrtape, match_object, input, strlen(input));
+}
 
 int inspector_get_length(InstructionTape *it) {
   return it->length;
 }
 
 static FstStateEntry inspector_getn(InstructionTape *it, int n) {
+  fse_freeze_arena(it);
   return ((FstStateEntry *) (it->beginning))[n * 256];
 }
 
@@ -711,26 +780,19 @@ int inspector_is_initial(InstructionTape *it, int n) {
   return inspector_getn(it, n).components.flags & FST_FLAG_INITIAL;
 }
 
-typedef struct Outgoings Outgoings;
-
-struct Outgoings {
-  char inputs[256];
-  char outputs[256];
-  unsigned short states[256];
-  int length;
-};
-
+/**
+ * All 256 transitions of state n, by input byte. An output of 0 means
+ * the transition has none.
+ */
 void inspector_outgoings(InstructionTape *it, int n, Outgoings *outgoings) {
+  fse_freeze_arena(it);
   FstStateEntry *the_state = (FstStateEntry *) (it->beginning) + (n * 256);
   outgoings->length = 0;
-  for (unsigned char i = 0; i < 255; i++) {
-    char oc = the_state[i].components.outchar;
-    if (oc) {
-      outgoings->inputs[outgoings->length] = i;
-      outgoings->outputs[outgoings->length] = oc;
-      outgoings->states[outgoings->length] = the_state[i].components.out_state;
-      outgoings->length += 1;
-    }
+  for (int i = 0; i < 256; i++) {
+    outgoings->inputs[outgoings->length] = (char) i;
+    outgoings->outputs[outgoings->length] = the_state[i].components.outchar;
+    outgoings->states[outgoings->length] = the_state[i].components.out_state;
+    outgoings->length += 1;
   }
 }
 
@@ -740,6 +802,7 @@ void inspector_dumpfile(FILE *f, InstructionTape *it) {
    * capacity=length; and length must be
    * written.
    */
+  fse_freeze_arena(it);
   fwrite((void *) &(it->length), sizeof(size_t), 1, f);
   for (int i = 0; i < it->length; i++) {
     void *state = (void *) (it->beginning + (i * 256) * sizeof(FstStateEntry));
@@ -763,217 +826,3 @@ InstructionTape *inspector_loadfile(FILE *f) {
 
   return it;
 }
-
-static int l_inspector_get_length(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
-  lua_pushinteger(L, inspector_get_length(it));
-  return 1;
-}
-
-static int l_inspector_is_valid(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
-  int n = luaL_checkint(L, 2);
-  lua_pushboolean(L, inspector_is_valid(it, n));
-  return 1;
-}
-
-static int l_inspector_is_final(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
-  int n = luaL_checkint(L, 2);
-  lua_pushboolean(L, inspector_is_final(it, n));
-  return 1;
-}
-
-static int l_inspector_is_initial(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
-  int n = luaL_checkint(L, 2);
-  lua_pushboolean(L, inspector_is_final(it, n));
-  return 1;
-}
-
-static int l_inspector_outgoings(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
-  int n = luaL_checkint(L, 2);
-  Outgoings outgoings;
-  inspector_outgoings(it, n, &outgoings);
-  lua_newtable(L);
-  for (int i = 0; i < outgoings.length; i++) {
-    lua_pushinteger(L, i + 1);
-
-    lua_newtable(L);
-    lua_pushstring(L, "input");
-    lua_pushlstring(L, outgoings.inputs + i, 1);
-    lua_settable(L, -3);
-    lua_pushstring(L, "output");
-    lua_pushlstring(L, outgoings.outputs + i, 1);
-    lua_settable(L, -3);
-    lua_pushstring(L, "state");
-    lua_pushinteger(L, outgoings.states[i]);
-    lua_settable(L, -3);
-
-    lua_settable(L, -3);
-  }
-
-  return 1;
-}
-
-static int l_inspector_dumpfile(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
-  const char *filename = luaL_checkstring(L, 2);
-  FILE *f = fopen(filename, "wb");
-  if (!f) {
-    lua_error(L);
-    return 0;
-  }
-  inspector_dumpfile(f, it);
-  fclose(f);
-  return 0;
-}
-
-static int l_inspector_loadfile(lua_State *L) {
-  /* Get file */
-  const char *filename = luaL_checkstring(L, 1);
-  FILE *f = fopen(filename, "rb");
-  if (!f) {
-    lua_error(L);
-    return 0;
-  }
-
-  /* Load file into tape */
-  InstructionTape *it = inspector_loadfile(f);
-
-  /* Done with file */
-  fclose(f);
-
-  /* Return tape */
-  lua_pushlightuserdata(L, it);
-  return 1;
-}
-
-static int l_get_instruction_tape(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) malloc(sizeof(InstructionTape));
-  fse_initialize_tape(it);
-  lua_pushlightuserdata(L, (void *) it);
-  return 1;
-}
-
-static int l_create_pegreg_diffmatch(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
-  create_pegreg_diffmatch(it);
-  return 0;
-}
-
-static int l_match_string(lua_State *L) {
-  const char *input = luaL_checkstring(L, 1);
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 2);
-
-  MatchObject mo;
-  match_initialize(&mo, it);
-
-  match_string(it, &mo, input);
-
-  lua_pushlstring(L, mo.char_output, mo.char_length);
-
-  lua_pushboolean(L, mo.match_success);
-
-  lua_newtable(L);
-
-  for (int i = 0; i < mo.state_length; i++) {
-    lua_pushnumber(L, i + 1);
-    lua_pushnumber(L, mo.state_output[i]);
-    lua_settable(L, -3);
-  }
-
-  match_destroy(&mo);
-
-  return 3;
-}
-
-static int l_instruction_tape_destroy(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
-  instruction_tape_destroy(it);
-  free(it);
-  return 0;
-}
-
-static int l_fse_clear_instr(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
-  int error_state = luaL_checkint(L, 2);
-  fse_clear_instr(it, error_state);
-  return 0;
-}
-
-static int l_fse_set_initial_flags(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
-  fse_set_initial_flags(it);
-  return 0;
-}
-
-static int l_fse_get_outgoing(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
-  const char *c = luaL_checkstring(L, 2);
-  if (strlen(c) != 1) {
-    luaL_error(L, "Size of c parameter must be 1");
-    return 0;
-  }
-  FstStateEntry *fse = fse_get_outgoing(it, *c);
-  lua_pushlightuserdata(L, (void *) fse);
-  return 1;
-}
-
-static int l_fse_set_outstate(lua_State *L) {
-  FstStateEntry *fse = (FstStateEntry *) lua_touserdata(L, 1);
-  int outstate = luaL_checkint(L, 2);
-  fse_set_outstate(fse, outstate);
-  return 0;
-}
-
-static int l_fse_set_outchar(lua_State *L) {
-  FstStateEntry *fse = (FstStateEntry *) lua_touserdata(L, 1);
-  const char *c = luaL_checkstring(L, 2);
-  if (strlen(c) != 1) {
-    luaL_error(L, "Size of c parameter must be 1");
-    return 0;
-  }
-  fse_set_outchar(fse, *c);
-  return 0;
-}
-
-static int l_fse_finish(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
-  fse_finish(it);
-  return 0;
-}
-
-static int l_fse_set_final_flags(lua_State *L) {
-  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
-  fse_set_final_flags(it);
-  return 0;
-}
-
-static const struct luaL_Reg fst_fast_system[] = {
-    {"c_swap", c_swap},
-    {"get_instruction_tape", l_get_instruction_tape},
-    {"create_pegreg_diffmatch", l_create_pegreg_diffmatch},
-    {"match_string", l_match_string},
-    {"instruction_tape_destroy", l_instruction_tape_destroy},
-    {"fse_clear_instr", l_fse_clear_instr},
-    {"fse_set_initial_flags", l_fse_set_initial_flags},
-    {"fse_get_outgoing", l_fse_get_outgoing},
-    {"fse_set_outstate", l_fse_set_outstate},
-    {"fse_set_outchar", l_fse_set_outchar},
-    {"fse_finish", l_fse_finish},
-    {"fse_set_final_flags", l_fse_set_final_flags},
-    {"inspector_dumpfile", l_inspector_dumpfile},
-    {"inspector_is_final", l_inspector_is_final},
-    {"inspector_is_valid", l_inspector_is_valid},
-    {"inspector_loadfile", l_inspector_loadfile},
-    {"inspector_outgoings", l_inspector_outgoings},
-    {"inspector_get_length", l_inspector_get_length},
-    {"inspector_is_initial", l_inspector_is_initial},
-    {NULL, NULL}};
-
-int luaopen_fst_fast_system(lua_State *L) {
-  luaL_newlib(L, fst_fast_system);
-  return 1;
-}
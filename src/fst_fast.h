@@ -1,8 +1,26 @@
 #ifndef FST_FAST_H
 #define FST_FAST_H
 
+#include "fst_arena.h"
+#include <stdio.h>
 #include <stdlib.h>
 
+/**
+ * Whether the transition is valid.
+ * Only matters for non-determinsitic fsts
+ */
+#define FST_FLAG_VALID (1 << 0)
+
+/**
+ * Whether the fst state is initial
+ */
+#define FST_FLAG_INITIAL (1 << 1)
+
+/**
+ * Whether the fst state is final
+ */
+#define FST_FLAG_FINAL (1 << 2)
+
 typedef union FstStateEntry FstStateEntry;
 
 struct FstStateEntryComponents {
@@ -23,6 +41,16 @@ struct InstructionTape {
   unsigned char *current;
   size_t length;
   size_t capacity;
+
+  /**
+   * Chunks the states are built in, NULL once frozen (see fst_arena.h)
+   */
+  TapeArena *arena;
+
+  /**
+   * Size of the mapping holding beginning, 0 if it was malloc'd
+   */
+  size_t mapped_size;
 };
 
 void fst_clear_flag(FstStateEntry *fse);
@@ -41,8 +69,14 @@ void fse_set_outstate(FstStateEntry *fse, unsigned short outstate);
 
 void fse_initialize_tape(InstructionTape *instrtape);
 
+void fse_initialize_arena_tape(InstructionTape *instrtape);
+
 void fse_grow(InstructionTape *instrtape, int targetlen);
 
+void fse_freeze(InstructionTape *instrtape);
+
+void fse_freeze_arena(InstructionTape *instrtape);
+
 void fse_clear_instr(InstructionTape *instrtape, unsigned short errorstate);
 
 FstStateEntry *fse_get_outgoing(InstructionTape *instrtape, char c);
@@ -115,14 +149,54 @@ struct MatchObject {
   unsigned char *current;
 };
 
+void match_grow_char(MatchObject *match_object, size_t targetlen);
+
+void match_grow_states(MatchObject *match_object, size_t targetlen);
+
+void match_initialize(MatchObject *match_object,
+                      InstructionTape *instruction_tape);
+
+void match_destroy(MatchObject *match_object);
+
 void match_one_char(MatchObject *match_object, char input);
 
+void match_continue(MatchObject *match_object, const char *input,
+                    size_t length);
+
+void match_finish(InstructionTape *instrtape, MatchObject *match_object);
+
 /* void match_one_char(char input, char *output, int *state_number, */
 /*                     FstStateEntry *states, FstStateEntry
  * *current_state_start, */
 /*                     FstStateEntry **next_state); */
 
+void match_bytes(InstructionTape *instrtape, MatchObject *match_object,
+                 const char *input, size_t length);
+
 void match_string(InstructionTape *instrtape, MatchObject *match_object,
                   char const *input);
 
+int inspector_get_length(InstructionTape *it);
+
+int inspector_is_valid(InstructionTape *it, int n);
+
+int inspector_is_final(InstructionTape *it, int n);
+
+int inspector_is_initial(InstructionTape *it, int n);
+
+typedef struct Outgoings Outgoings;
+
+struct Outgoings {
+  char inputs[256];
+  char outputs[256];
+  unsigned short states[256];
+  int length;
+};
+
+void inspector_outgoings(InstructionTape *it, int n, Outgoings *outgoings);
+
+void inspector_dumpfile(FILE *f, InstructionTape *it);
+
+InstructionTape *inspector_loadfile(FILE *f);
+
 #endif /* FST_FAST_H */
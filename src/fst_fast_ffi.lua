@@ -0,0 +1,94 @@
+-- LuaJIT FFI bindings to the plain C ABI of fst_fast_system (fst_abi.h).
+--
+-- Matching through here skips the Lua C API: no result tables, no
+-- string copies, nothing that aborts a trace. The caller owns the
+-- output and state buffers and reuses them between calls.
+--
+--    local fst_ffi = require("fst_fast_ffi")
+--    local tape = fst_ffi.load("rules.fstc")
+--    local out = fst_ffi.output_buffer(4096)
+--    local res = fst_ffi.result()
+--    fst_ffi.C.fst_match(tape, s, #s, out, 4096, nil, 0, res)
+--    -- ffi.string(out, res.output_length), res.accepted ~= 0
+
+local ffi = require("ffi")
+
+ffi.cdef[[
+typedef struct FrozenTape FrozenTape;
+
+typedef struct FstMatchResult {
+  size_t output_length;
+  size_t state_length;
+  int accepted;
+} FstMatchResult;
+
+int fst_abi_version(void);
+
+FrozenTape *fst_tape_load(const char *path);
+
+FrozenTape *fst_tape_import(void *token);
+
+void fst_tape_retain(FrozenTape *tape);
+
+void fst_tape_release(FrozenTape *tape);
+
+size_t fst_tape_length(const FrozenTape *tape);
+
+int fst_tape_is_wide(const FrozenTape *tape);
+
+int fst_match_continue(const FrozenTape *tape, unsigned int *state,
+                       const char *input, size_t length, char *output,
+                       size_t output_capacity, unsigned int *states,
+                       size_t states_capacity, FstMatchResult *result);
+
+int fst_match(const FrozenTape *tape, const char *input, size_t length,
+              char *output, size_t output_capacity, unsigned int *states,
+              size_t states_capacity, FstMatchResult *result);
+]]
+
+local fst_ffi = {}
+
+fst_ffi.ABI_VERSION = 3
+
+local C = ffi.load(assert(package.searchpath("fst_fast_system", package.cpath),
+                          "fst_fast_system not found on package.cpath"))
+fst_ffi.C = C
+
+assert(C.fst_abi_version() == fst_ffi.ABI_VERSION,
+       "fst_fast_system has a different ABI version")
+
+-- A tape handle from a dump file of any format, or nil
+function fst_ffi.load(path)
+   local tape = C.fst_tape_load(path)
+   if tape == nil then
+      return nil, "could not load " .. path
+   end
+   return ffi.gc(tape, C.fst_tape_release)
+end
+
+-- A tape handle sharing a frozen tape from the Lua API
+function fst_ffi.from_frozen(frozen)
+   return ffi.gc(C.fst_tape_import(frozen:export()), C.fst_tape_release)
+end
+
+function fst_ffi.output_buffer(n)
+   return ffi.new("char[?]", n)
+end
+
+function fst_ffi.state_buffer(n)
+   return ffi.new("unsigned int[?]", n)
+end
+
+function fst_ffi.result()
+   return ffi.new("FstMatchResult")
+end
+
+-- C.fst_match with the arguments in the same order, returning true if
+-- everything fit
+function fst_ffi.match(tape, input, length, output, output_capacity,
+                       states, states_capacity, result)
+   return C.fst_match(tape, input, length, output, output_capacity,
+                      states, states_capacity, result) == 0
+end
+
+return fst_ffi
@@ -0,0 +1,205 @@
+/**
+ * Matching files through mmap or chunked reads
+ * @file fst_file.c
+ */
+#include "fst_file.h"
+#include "fst_parallel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct FileView FileView;
+
+struct FileView {
+  int fd;
+  /**
+   * The mapped file, NULL if it has to be read in chunks
+   */
+  const char *data;
+  size_t length;
+};
+
+/**
+ * Open path, mapping it if it's a regular file
+ * @return 0, or -1 with errno set
+ */
+static int file_open(FileView *fv, const char *path) {
+  fv->data = NULL;
+  fv->length = 0;
+  fv->fd = open(path, O_RDONLY);
+  if (fv->fd < 0) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fv->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *data =
+        mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fv->fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL);
+      fv->data = (const char *) data;
+      fv->length = (size_t) st.st_size;
+      return 0;
+    }
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fv->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  return 0;
+}
+
+static void file_close(FileView *fv) {
+  if (fv->data) {
+    munmap((void *) fv->data, fv->length);
+  }
+  close(fv->fd);
+}
+
+/**
+ * Fill buffer as far as the file allows
+ * @return the number of bytes read, 0 at end of file, -1 on error
+ */
+static ssize_t file_read_chunk(FileView *fv, char *buffer, size_t capacity) {
+  size_t filled = 0;
+  while (filled < capacity) {
+    ssize_t got = read(fv->fd, buffer + filled, capacity - filled);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (got == 0) {
+      break;
+    }
+    filled += got;
+  }
+  return filled;
+}
+
+static char *file_chunk_buffer(void) {
+  char *buffer = (char *) malloc(FILE_CHUNK_SIZE);
+  if (!buffer) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  return buffer;
+}
+
+/**
+ * Match every byte of the file at path
+ * @param instrtape the instruction tape
+ * @param match object the match object to be filled in, only on success
+ * @param path the file
+ * @param threads more than 1 to match a mapped file with
+ * match_string_parallel
+ * @return 0, or -1 with errno set if the file couldn't be read
+ */
+int match_file(InstructionTape *instrtape, MatchObject *match_object,
+               const char *path, int threads) {
+  fse_freeze_arena(instrtape);
+  FileView fv;
+  if (file_open(&fv, path) < 0) {
+    return -1;
+  }
+
+  if (fv.data) {
+    match_string_parallel(instrtape, match_object, fv.data, fv.length,
+                          threads);
+    file_close(&fv);
+    return 0;
+  }
+
+  match_initialize(match_object, instrtape);
+  char *buffer = file_chunk_buffer();
+  ssize_t got;
+  while ((got = file_read_chunk(&fv, buffer, FILE_CHUNK_SIZE)) > 0) {
+    match_continue(match_object, buffer, got);
+  }
+  free(buffer);
+  if (got < 0) {
+    int saved = errno;
+    match_destroy(match_object);
+    file_close(&fv);
+    errno = saved;
+    return -1;
+  }
+  match_finish(instrtape, match_object);
+  file_close(&fv);
+  return 0;
+}
+
+/**
+ * Match every byte of the file at path on a wide tape, as match_file
+ */
+int wide_match_file(WideInstructionTape *instrtape,
+                    WideMatchObject *match_object, const char *path) {
+  fwe_freeze_arena(instrtape);
+  FileView fv;
+  if (file_open(&fv, path) < 0) {
+    return -1;
+  }
+
+  if (fv.data) {
+    wide_match_bytes(instrtape, match_object, fv.data, fv.length);
+    file_close(&fv);
+    return 0;
+  }
+
+  wide_match_initialize(match_object, instrtape);
+  char *buffer = file_chunk_buffer();
+  ssize_t got;
+  while ((got = file_read_chunk(&fv, buffer, FILE_CHUNK_SIZE)) > 0) {
+    wide_match_continue(match_object, buffer, got);
+  }
+  free(buffer);
+  if (got < 0) {
+    int saved = errno;
+    wide_match_destroy(match_object);
+    file_close(&fv);
+    errno = saved;
+    return -1;
+  }
+  wide_match_finish(instrtape, match_object);
+  file_close(&fv);
+  return 0;
+}
+
+/**
+ * Match every byte of the file at path on a hybrid tape, as match_file
+ */
+int hybrid_match_file(HybridTape *ht, MatchObject *match_object,
+                      const char *path) {
+  FileView fv;
+  if (file_open(&fv, path) < 0) {
+    return -1;
+  }
+
+  if (fv.data) {
+    hybrid_match_bytes(ht, match_object, fv.data, fv.length);
+    file_close(&fv);
+    return 0;
+  }
+
+  hybrid_match_initialize(match_object, ht);
+  char *buffer = file_chunk_buffer();
+  ssize_t got;
+  while ((got = file_read_chunk(&fv, buffer, FILE_CHUNK_SIZE)) > 0) {
+    hybrid_match_continue(match_object, buffer, got);
+  }
+  free(buffer);
+  if (got < 0) {
+    int saved = errno;
+    match_destroy(match_object);
+    file_close(&fv);
+    errno = saved;
+    return -1;
+  }
+  hybrid_match_finish(ht, match_object);
+  file_close(&fv);
+  return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef FST_FILE_H
+#define FST_FILE_H
+
+#include "fst_fast.h"
+#include "fst_hybrid.h"
+#include "fst_wide.h"
+#include <stdlib.h>
+
+/*
+ * Matching a whole file without reading it into a string first.
+ *
+ * Regular files are mapped read only and advised MADV_SEQUENTIAL, so
+ * the kernel reads ahead and drops pages behind the match. Anything
+ * that can't be mapped (pipes, devices, /proc files) is read in
+ * FILE_CHUNK_SIZE chunks after a POSIX_FADV_SEQUENTIAL hint.
+ *
+ * Every byte of the file is matched, NUL included, and the match
+ * object ends up as match_string / wide_match_string /
+ * hybrid_match_bytes would leave it for the same bytes.
+ */
+
+#define FILE_CHUNK_SIZE ((size_t) 4 * 1024 * 1024)
+
+int match_file(InstructionTape *instrtape, MatchObject *match_object,
+               const char *path, int threads);
+
+int wide_match_file(WideInstructionTape *instrtape,
+                    WideMatchObject *match_object, const char *path);
+
+int hybrid_match_file(HybridTape *ht, MatchObject *match_object,
+                      const char *path);
+
+#endif /* FST_FILE_H */
@@ -0,0 +1,239 @@
+/**
+ * Refcounted read-only tapes
+ * @file fst_frozen.c
+ */
+#include "fst_frozen.h"
+#include "fst_arena.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/**
+ * A region for size bytes of states, on huge pages if it's big enough
+ */
+static unsigned char *frozen_region(size_t size, size_t *mapped_size) {
+  unsigned char *region = NULL;
+  *mapped_size = 0;
+  if (size >= ARENA_HUGE_PAGE_SIZE) {
+    region = (unsigned char *) arena_map(size, mapped_size);
+  }
+  if (!region) {
+    *mapped_size = 0;
+    region = (unsigned char *) malloc(MAX(size, 1));
+    if (!region) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+  }
+  return region;
+}
+
+/**
+ * Last serial handed out, only touched atomically
+ */
+static unsigned long frozen_serial = 0;
+
+static FrozenTape *frozen_allocate(int kind) {
+  FrozenTape *ft = (FrozenTape *) calloc(1, sizeof(FrozenTape));
+  if (!ft) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  ft->magic = FROZEN_TAPE_MAGIC;
+  ft->kind = kind;
+  ft->serial = __atomic_add_fetch(&frozen_serial, 1, __ATOMIC_RELAXED);
+  ft->refcount = 1;
+  return ft;
+}
+
+/**
+ * Copy the finished states of it into a new frozen tape
+ * @return the tape, holding one reference
+ */
+FrozenTape *frozen_tape_from_narrow(InstructionTape *it) {
+  FrozenTape *ft = frozen_allocate(FROZEN_NARROW);
+  size_t size = it->length * sizeof(FstStateEntry) * 256;
+  unsigned char *region = frozen_region(size, &ft->narrow.mapped_size);
+
+  if (it->arena) {
+    arena_copy_out(it->arena, region, it->length);
+  } else if (size) {
+    memcpy(region, it->beginning, size);
+  }
+  ft->narrow.beginning = region;
+  ft->narrow.current = region + size;
+  ft->narrow.length = it->length;
+  ft->narrow.capacity = it->length;
+  ft->narrow.arena = NULL;
+  return ft;
+}
+
+/**
+ * Copy the finished states and the output pool of it into a new frozen
+ * tape
+ * @return the tape, holding one reference
+ */
+FrozenTape *frozen_tape_from_wide(WideInstructionTape *it) {
+  FrozenTape *ft = frozen_allocate(FROZEN_WIDE);
+  size_t size = it->length * sizeof(FstWideEntry) * 256;
+  FstWideEntry *region =
+      (FstWideEntry *) frozen_region(size, &ft->wide.mapped_size);
+
+  if (it->arena) {
+    arena_copy_out(it->arena, (unsigned char *) region, it->length);
+  } else if (size) {
+    memcpy(region, it->beginning, size);
+  }
+  ft->wide.beginning = region;
+  ft->wide.current = region + it->length * 256;
+  ft->wide.length = it->length;
+  ft->wide.capacity = it->length;
+  ft->wide.arena = NULL;
+
+  ft->wide.output_pool = (char *) malloc(MAX(it->pool_length, 1));
+  if (!ft->wide.output_pool) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  if (it->pool_length) {
+    memcpy(ft->wide.output_pool, it->output_pool, it->pool_length);
+  }
+  ft->wide.pool_length = it->pool_length;
+  ft->wide.pool_capacity = MAX(it->pool_length, 1);
+  return ft;
+}
+
+/**
+ * Build a hybrid tape from the finished states of it into a new frozen
+ * tape
+ * @return the tape, holding one reference
+ */
+FrozenTape *frozen_tape_hybrid_from_narrow(InstructionTape *it) {
+  FrozenTape *ft = frozen_allocate(FROZEN_HYBRID);
+  hybrid_tape_build(&ft->hybrid, it);
+  return ft;
+}
+
+/**
+ * Move it into a new frozen tape without copying the states. it is left
+ * empty, only the struct itself is still the caller's to free.
+ * @return the tape, holding one reference
+ */
+FrozenTape *frozen_tape_adopt_narrow(InstructionTape *it) {
+  fse_freeze_arena(it);
+  FrozenTape *ft = frozen_allocate(FROZEN_NARROW);
+  ft->narrow = *it;
+  memset(it, 0, sizeof(InstructionTape));
+  return ft;
+}
+
+/**
+ * Move it into a new frozen tape, as frozen_tape_adopt_narrow
+ */
+FrozenTape *frozen_tape_adopt_wide(WideInstructionTape *it) {
+  fwe_freeze_arena(it);
+  FrozenTape *ft = frozen_allocate(FROZEN_WIDE);
+  ft->wide = *it;
+  memset(it, 0, sizeof(WideInstructionTape));
+  return ft;
+}
+
+void frozen_tape_retain(FrozenTape *ft) {
+  __atomic_fetch_add(&ft->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drop a reference, freeing the tape with the last one
+ */
+void frozen_tape_release(FrozenTape *ft) {
+  if (__atomic_sub_fetch(&ft->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  if (ft->kind == FROZEN_WIDE) {
+    wide_instruction_tape_destroy(&ft->wide);
+  } else if (ft->kind == FROZEN_HYBRID) {
+    hybrid_tape_destroy(&ft->hybrid);
+  } else {
+    instruction_tape_destroy(&ft->narrow);
+  }
+  ft->magic = 0;
+  free(ft);
+}
+
+size_t frozen_tape_length(FrozenTape *ft) {
+  if (ft->kind == FROZEN_HYBRID) {
+    return ft->hybrid.length;
+  }
+  return ft->kind == FROZEN_WIDE ? ft->wide.length : ft->narrow.length;
+}
+
+/**
+ * Exports not yet imported, guarded by frozen_exports_lock
+ */
+static FrozenTape **frozen_exports = NULL;
+static size_t frozen_exports_length = 0;
+static size_t frozen_exports_capacity = 0;
+static pthread_mutex_t frozen_exports_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Make a new reference to ft for another thread or Lua state to take
+ * over with frozen_tape_import
+ * @return the export's token
+ */
+void *frozen_tape_export(FrozenTape *ft) {
+  frozen_tape_retain(ft);
+  pthread_mutex_lock(&frozen_exports_lock);
+  if (frozen_exports_length == frozen_exports_capacity) {
+    size_t capacity = MAX(frozen_exports_capacity * 2, 8);
+    FrozenTape **exports = (FrozenTape **) realloc(
+        frozen_exports, capacity * sizeof(FrozenTape *));
+    if (!exports) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+    frozen_exports = exports;
+    frozen_exports_capacity = capacity;
+  }
+  frozen_exports[frozen_exports_length++] = ft;
+  pthread_mutex_unlock(&frozen_exports_lock);
+  return ft;
+}
+
+/**
+ * Take over the reference of a pending export. token is only compared,
+ * never read through, until it is found among the pending exports.
+ * @return the tape, or NULL if token is not a pending export
+ */
+FrozenTape *frozen_tape_import(void *token) {
+  FrozenTape *ft = NULL;
+  pthread_mutex_lock(&frozen_exports_lock);
+  for (size_t i = 0; i < frozen_exports_length; i++) {
+    if (frozen_exports[i] == token) {
+      ft = frozen_exports[i];
+      frozen_exports[i] = frozen_exports[--frozen_exports_length];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&frozen_exports_lock);
+  if (ft && ft->magic != FROZEN_TAPE_MAGIC) {
+    fprintf(stderr, "Frozen tape export is corrupt\n");
+    exit(1);
+  }
+  return ft;
+}
+
+/**
+ * Drop the reference of an export that will never be imported
+ * @return 1 if token was a pending export, 0 otherwise
+ */
+int frozen_tape_discard_export(void *token) {
+  FrozenTape *ft = frozen_tape_import(token);
+  if (!ft) {
+    return 0;
+  }
+  frozen_tape_release(ft);
+  return 1;
+}
@@ -0,0 +1,90 @@
+#ifndef FST_FROZEN_H
+#define FST_FROZEN_H
+
+#include "fst_fast.h"
+#include "fst_hybrid.h"
+#include "fst_wide.h"
+#include <stdlib.h>
+
+/*
+ * Frozen tapes.
+ *
+ * A frozen tape is a private, read-only copy of a narrow or wide tape
+ * with a reference count. Nothing writes to it after it is made, so
+ * any number of threads may match on it at once, and it is freed by
+ * whoever drops the last reference.
+ *
+ * This lets several Lua states in one process share a single copy of a
+ * large tape: each state holds its own reference through a full
+ * userdata whose __gc drops it.
+ *
+ * A narrow tape may also be frozen into a hybrid tape (fst_hybrid.h),
+ * which matches the same but keeps sparse rows compact.
+ *
+ * A reference crosses to another thread or Lua state as an export: a
+ * token that frozen_tape_import takes over exactly once. Exports still
+ * pending are tracked, so an unknown or already imported token is
+ * refused rather than released twice, and one that will never be
+ * imported can be dropped with frozen_tape_discard_export.
+ */
+
+#define FROZEN_NARROW 0
+#define FROZEN_WIDE 1
+#define FROZEN_HYBRID 2
+
+/**
+ * "FSTF", in every live frozen tape
+ */
+#define FROZEN_TAPE_MAGIC 0x46535446u
+
+typedef struct FrozenTape FrozenTape;
+
+struct FrozenTape {
+  /**
+   * FROZEN_TAPE_MAGIC, cleared when the tape is freed
+   */
+  unsigned int magic;
+  /**
+   * FROZEN_NARROW, FROZEN_WIDE or FROZEN_HYBRID, which of the tapes
+   * below is used
+   */
+  int kind;
+  InstructionTape narrow;
+  WideInstructionTape wide;
+  HybridTape hybrid;
+
+  /**
+   * Unique for the life of the process, never reused even after the
+   * tape is freed, so it can stand for the tape's contents in cache keys
+   */
+  unsigned long serial;
+
+  /**
+   * Only touched atomically
+   */
+  int refcount;
+};
+
+FrozenTape *frozen_tape_from_narrow(InstructionTape *it);
+
+FrozenTape *frozen_tape_from_wide(WideInstructionTape *it);
+
+FrozenTape *frozen_tape_hybrid_from_narrow(InstructionTape *it);
+
+FrozenTape *frozen_tape_adopt_narrow(InstructionTape *it);
+
+FrozenTape *frozen_tape_adopt_wide(WideInstructionTape *it);
+
+void frozen_tape_retain(FrozenTape *ft);
+
+void frozen_tape_release(FrozenTape *ft);
+
+size_t frozen_tape_length(FrozenTape *ft);
+
+void *frozen_tape_export(FrozenTape *ft);
+
+FrozenTape *frozen_tape_import(void *token);
+
+int frozen_tape_discard_export(void *token);
+
+#endif /* FST_FROZEN_H */
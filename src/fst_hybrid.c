@@ -0,0 +1,186 @@
+/**
+ * Narrow tapes with default, sparse and dense rows
+ * @file fst_hybrid.c
+ */
+#include "fst_hybrid.h"
+#include "fst_analysis.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define HYBRID_DENSE_SIZE (256 * sizeof(FstStateEntry))
+#define HYBRID_ALIGN 64
+
+/**
+ * Bytes of pool a sparse row with count exceptions takes, rounded up so
+ * every key block starts 16 byte aligned
+ */
+static size_t hybrid_sparse_size(size_t count) {
+  size_t size = HYBRID_KEY_BLOCK + count * sizeof(FstStateEntry);
+  return (size + 15) & ~(size_t) 15;
+}
+
+static size_t hybrid_exceptions(const FstStateEntry *row, FstStateEntry def) {
+  size_t count = 0;
+  for (int b = 0; b < 256; b++) {
+    count += row[b].entry != def.entry;
+  }
+  return count;
+}
+
+/**
+ * Build ht from the finished states of it, which is left as it is
+ */
+void hybrid_tape_build(HybridTape *ht, InstructionTape *it) {
+  fse_freeze_arena(it);
+  size_t length = it->length;
+  const FstStateEntry *states = (const FstStateEntry *) it->beginning;
+
+  memset(ht, 0, sizeof(HybridTape));
+  ht->length = length;
+  /* One row even for an empty tape, so a match on it just rejects */
+  ht->rows = (HybridRow *) calloc(MAX(length, 1), sizeof(HybridRow));
+  size_t *offsets = (size_t *) calloc(MAX(length, 1), sizeof(size_t));
+  if (!ht->rows || !offsets) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+
+  /* Pick each row's kind and lay out the pool, dense rows first */
+  size_t dense_size = 0;
+  size_t sparse_size = 0;
+  for (size_t s = 0; s < length; s++) {
+    const FstStateEntry *row = states + s * 256;
+    HybridRow *hr = ht->rows + s;
+    hr->def = tape_row_default(row);
+    size_t count = hybrid_exceptions(row, hr->def);
+    if (count == 0) {
+      hr->kind = HYBRID_DEFAULT;
+    } else if (count <= HYBRID_SPARSE_MAX) {
+      hr->kind = HYBRID_SPARSE;
+      hr->count = (unsigned char) count;
+      offsets[s] = sparse_size;
+      sparse_size += hybrid_sparse_size(count);
+    } else {
+      hr->kind = HYBRID_DENSE;
+      offsets[s] = dense_size;
+      dense_size += HYBRID_DENSE_SIZE;
+    }
+    ht->kind_counts[hr->kind] += 1;
+  }
+
+  ht->pool_length = dense_size + sparse_size;
+  void *pool;
+  if (posix_memalign(&pool, HYBRID_ALIGN, MAX(ht->pool_length, 1))) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  ht->pool = (unsigned char *) pool;
+
+  for (size_t s = 0; s < length; s++) {
+    const FstStateEntry *row = states + s * 256;
+    HybridRow *hr = ht->rows + s;
+    if (hr->kind == HYBRID_DENSE) {
+      unsigned char *data = ht->pool + offsets[s];
+      memcpy(data, row, HYBRID_DENSE_SIZE);
+      hr->data = data;
+    } else if (hr->kind == HYBRID_SPARSE) {
+      unsigned char *keys = ht->pool + dense_size + offsets[s];
+      FstStateEntry *entries = (FstStateEntry *) (keys + HYBRID_KEY_BLOCK);
+      int k = 0;
+      for (int b = 0; b < 256; b++) {
+        if (row[b].entry != hr->def.entry) {
+          keys[k] = (unsigned char) b;
+          entries[k] = row[b];
+          k++;
+        }
+      }
+      for (; k < HYBRID_KEY_BLOCK; k++) {
+        keys[k] = keys[hr->count - 1];
+      }
+      hr->data = keys;
+    }
+  }
+  free(offsets);
+}
+
+void hybrid_tape_destroy(HybridTape *ht) {
+  free(ht->rows);
+  free(ht->pool);
+  memset(ht, 0, sizeof(HybridTape));
+}
+
+/**
+ * Bytes the rows and the pool take
+ */
+size_t hybrid_tape_size(const HybridTape *ht) {
+  return ht->length * sizeof(HybridRow) + ht->pool_length;
+}
+
+/**
+ * As match_initialize, starting from state 0 of ht
+ */
+void hybrid_match_initialize(MatchObject *match_object, HybridTape *ht) {
+  /* match_initialize only reads beginning */
+  InstructionTape rows;
+  memset(&rows, 0, sizeof(InstructionTape));
+  rows.beginning = (unsigned char *) ht->rows;
+  match_initialize(match_object, &rows);
+}
+
+/**
+ * As match_continue, on the hybrid tape match object was initialized
+ * with
+ */
+void hybrid_match_continue(MatchObject *match_object, const char *input,
+                           size_t length) {
+  match_grow_states(match_object, match_object->state_length + length + 1);
+  const HybridRow *rows = (const HybridRow *) match_object->beginning;
+  const HybridRow *row = (const HybridRow *) match_object->current;
+  unsigned short *state_end = match_object->state_end;
+
+  for (size_t i = 0; i < length; i++) {
+    FstStateEntry fse = hybrid_lookup(row, (unsigned char) input[i]);
+    unsigned short out_state = fse.components.out_state;
+    row = rows + out_state;
+
+    if (fse.components.outchar) {
+      match_grow_char(match_object, match_object->char_length + 1);
+      *(match_object->char_end) = fse.components.outchar;
+      match_object->char_end += 1;
+      match_object->char_length += 1;
+    }
+    *state_end++ = out_state;
+  }
+
+  match_object->state_end = state_end;
+  match_object->state_length += length;
+  match_object->current = (unsigned char *) row;
+}
+
+/**
+ * As match_finish, for a match on ht
+ */
+void hybrid_match_finish(HybridTape *ht, MatchObject *match_object) {
+  match_object->match_success = 0;
+  if (match_object->state_length > 0) {
+    const HybridRow *last =
+        ht->rows + match_object->state_output[match_object->state_length - 1];
+    /* The flags of byte 0's entry, as match_finish reads them */
+    if (hybrid_lookup(last, 0).components.flags & FST_FLAG_FINAL) {
+      match_object->match_success = 1;
+    }
+  }
+}
+
+/**
+ * As match_bytes, on ht
+ */
+void hybrid_match_bytes(HybridTape *ht, MatchObject *match_object,
+                        const char *input, size_t length) {
+  hybrid_match_initialize(match_object, ht);
+  hybrid_match_continue(match_object, input, length);
+  hybrid_match_finish(ht, match_object);
+}
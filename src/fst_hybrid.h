@@ -0,0 +1,133 @@
+#ifndef FST_HYBRID_H
+#define FST_HYBRID_H
+
+#include "fst_fast.h"
+#include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Hybrid narrow tapes.
+ *
+ * Most rows of a narrow tape are one default entry plus a few bytes
+ * that differ from it (see fst_analysis.h), yet every row takes 1 KiB.
+ * A hybrid tape keeps each state in whichever of three forms fits it,
+ * chosen once when the tape is built:
+ *
+ * default: every byte gives the row's default entry, no lookup at all
+ * sparse: up to HYBRID_SPARSE_MAX exceptions, their bytes sorted in a
+ * 16 byte key block that one SSE2 compare searches, followed by their
+ * entries; any other byte gives the default
+ * dense: the full 256 entry row, for states with more exceptions
+ *
+ * Matching gives exactly what match_bytes gives on the narrow tape, in
+ * a MatchObject, while a sparse tape takes a fraction of the memory.
+ * Hybrid tapes are read-only once built. test/bench_hybrid.lua measures
+ * both against the narrow tape.
+ */
+
+#define HYBRID_DEFAULT 0
+#define HYBRID_SPARSE 1
+#define HYBRID_DENSE 2
+
+#define HYBRID_SPARSE_MAX 16
+
+/**
+ * Bytes of keys at the start of a sparse row's data
+ */
+#define HYBRID_KEY_BLOCK 16
+
+typedef struct HybridRow HybridRow;
+
+struct HybridRow {
+  /**
+   * The entry most bytes give
+   */
+  FstStateEntry def;
+  unsigned char kind;
+  /**
+   * Exceptions, for a sparse row
+   */
+  unsigned char count;
+  /**
+   * The key block and entries of a sparse row, the entries of a dense
+   * one, in the tape's pool
+   */
+  const unsigned char *data;
+};
+
+typedef struct HybridTape HybridTape;
+
+struct HybridTape {
+  HybridRow *rows;
+  size_t length;
+
+  /**
+   * Dense rows first, cache line aligned, then the sparse rows' data
+   */
+  unsigned char *pool;
+  size_t pool_length;
+
+  /**
+   * States of each kind, indexed by HYBRID_*
+   */
+  size_t kind_counts[3];
+};
+
+/**
+ * Index of byte among the count sorted keys, or -1. Keys past count
+ * repeat the last one, so the first equal key is the one wanted.
+ */
+static inline int hybrid_find(const unsigned char *keys, unsigned int count,
+                              unsigned char byte) {
+#ifdef __SSE2__
+  (void) count;
+  __m128i block = _mm_loadu_si128((const __m128i *) keys);
+  int mask = _mm_movemask_epi8(
+      _mm_cmpeq_epi8(block, _mm_set1_epi8((char) byte)));
+  return mask ? __builtin_ctz(mask) : -1;
+#else
+  for (unsigned int i = 0; i < count && keys[i] <= byte; i++) {
+    if (keys[i] == byte) {
+      return (int) i;
+    }
+  }
+  return -1;
+#endif
+}
+
+/**
+ * The entry row gives for byte
+ */
+static inline FstStateEntry hybrid_lookup(const HybridRow *row,
+                                          unsigned char byte) {
+  if (row->kind == HYBRID_DENSE) {
+    return ((const FstStateEntry *) row->data)[byte];
+  }
+  if (row->kind == HYBRID_SPARSE) {
+    int i = hybrid_find(row->data, row->count, byte);
+    if (i >= 0) {
+      return ((const FstStateEntry *) (row->data + HYBRID_KEY_BLOCK))[i];
+    }
+  }
+  return row->def;
+}
+
+void hybrid_tape_build(HybridTape *ht, InstructionTape *it);
+
+void hybrid_tape_destroy(HybridTape *ht);
+
+size_t hybrid_tape_size(const HybridTape *ht);
+
+void hybrid_match_initialize(MatchObject *match_object, HybridTape *ht);
+
+void hybrid_match_continue(MatchObject *match_object, const char *input,
+                           size_t length);
+
+void hybrid_match_finish(HybridTape *ht, MatchObject *match_object);
+
+void hybrid_match_bytes(HybridTape *ht, MatchObject *match_object,
+                        const char *input, size_t length);
+
+#endif /* FST_HYBRID_H */
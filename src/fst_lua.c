@@ -0,0 +1,2163 @@
+/**
+ * Lua bindings for the fst_fast_system module
+ * @file fst_lua.c
+ */
+#include "fst_analysis.h"
+#include "fst_cache.h"
+#include "fst_fast.h"
+#include "fst_file.h"
+#include "fst_frozen.h"
+#include "fst_hybrid.h"
+#include "fst_parallel.h"
+#include "fst_product.h"
+#include "fst_registry.h"
+#include "fst_utf8.h"
+#include "fst_compact.h"
+#include "fst_dict.h"
+#include "fst_wide.h"
+#include <assert.h>
+#include <errno.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#include <memory.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* LuaJIT (OpenResty) only has the Lua 5.1 API plus a few 5.2 extras */
+#if LUA_VERSION_NUM < 502
+#define lua_rawlen lua_objlen
+#define luaL_newlib(L, l) (lua_newtable(L), luaL_setfuncs(L, l, 0))
+#endif
+
+static int c_swap(lua_State *L) {
+  double arg1 = luaL_checknumber(L, 1);
+  double arg2 = luaL_checknumber(L, 2);
+  lua_pushnumber(L, arg2);
+  lua_pushnumber(L, arg1);
+  return 2;
+}
+
+
+/*
+ * Instruction tape inspection library:
+ * Contains building blocks for:
+ *
+ * fst_fast.inspector.get_length(it)
+ *
+ * which returns the # of states in the instruction tape
+ *
+ * fst_fast.inspector.is_valid(it, n)
+ *
+ * which returns whether Nth state is valid
+ *
+ * fst_fast.inspector.is_final(it, n)
+ *
+ * returns whether the Nth state is final
+ *
+ * fst_fast.inspector.is_initial(it, n)
+ *
+ * returns whether the Nth state is initial
+ *
+ * fst_fast.inspector.outgoings(it, n)
+ *
+ * Gets all of the outgoing transitions at N
+ *
+ * fst_fast.dump(it, filename)
+ *
+ * Dumps the FST at filename
+ *
+ * fst_fast.load(filename)
+ *
+ * Creates an FST based on the dump
+ */
+
+
+static int l_inspector_get_length(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  lua_pushinteger(L, inspector_get_length(it));
+  return 1;
+}
+
+static int l_inspector_is_valid(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  int n = luaL_checkint(L, 2);
+  lua_pushboolean(L, inspector_is_valid(it, n));
+  return 1;
+}
+
+static int l_inspector_is_final(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  int n = luaL_checkint(L, 2);
+  lua_pushboolean(L, inspector_is_final(it, n));
+  return 1;
+}
+
+static int l_inspector_is_initial(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  int n = luaL_checkint(L, 2);
+  lua_pushboolean(L, inspector_is_initial(it, n));
+  return 1;
+}
+
+static int l_inspector_outgoings(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  int n = luaL_checkint(L, 2);
+  Outgoings outgoings;
+  inspector_outgoings(it, n, &outgoings);
+  lua_newtable(L);
+  for (int i = 0; i < outgoings.length; i++) {
+    lua_pushinteger(L, i + 1);
+
+    lua_newtable(L);
+    lua_pushstring(L, "input");
+    lua_pushlstring(L, outgoings.inputs + i, 1);
+    lua_settable(L, -3);
+    lua_pushstring(L, "output");
+    lua_pushlstring(L, outgoings.outputs + i, outgoings.outputs[i] ? 1 : 0);
+    lua_settable(L, -3);
+    lua_pushstring(L, "state");
+    lua_pushinteger(L, outgoings.states[i]);
+    lua_settable(L, -3);
+
+    lua_settable(L, -3);
+  }
+
+  return 1;
+}
+
+/**
+ * Push the states marked in flags as an array
+ */
+static void push_state_set(lua_State *L, const unsigned char *flags,
+                           size_t length, size_t count) {
+  lua_createtable(L, count, 0);
+  int i = 1;
+  for (size_t s = 0; s < length; s++) {
+    if (flags[s]) {
+      lua_pushinteger(L, s);
+      lua_rawseti(L, -2, i++);
+    }
+  }
+}
+
+/*
+ * fst_fast.inspector_analyze(tape)
+ *
+ * Everything about a narrow tape in one call (see fst_analysis.h):
+ *
+ * {
+ *   states = 7, edge_count = 12,
+ *   defaults = "...",  -- packed defaults, 3 bytes per state
+ *   edges = "...",     -- packed edges, 6 bytes each
+ *   fan_out = {...}, distinct_targets = {...},  -- per state, from 1
+ *   density = 0.0067,  -- edges per transition
+ *   self_loop_ratio = 0.5,  -- transitions that stay put
+ *   reachable = {0, 1, ...}, dead = {6},  -- state numbers
+ * }
+ */
+static int l_inspector_analyze(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  luaL_argcheck(L, it != NULL, 1, "tape expected");
+  TapeAnalysis ta;
+  tape_analyze(it, &ta);
+  double transitions = (double) ta.length * 256;
+
+  lua_createtable(L, 0, 10);
+  lua_pushinteger(L, ta.length);
+  lua_setfield(L, -2, "states");
+  lua_pushinteger(L, ta.edge_count);
+  lua_setfield(L, -2, "edge_count");
+  lua_pushnumber(L, transitions ? ta.edge_count / transitions : 0);
+  lua_setfield(L, -2, "density");
+  lua_pushnumber(L, transitions ? ta.self_loops / transitions : 0);
+  lua_setfield(L, -2, "self_loop_ratio");
+
+  size_t size = MAX(ta.length * ANALYSIS_DEFAULT_SIZE,
+                    ta.edge_count * ANALYSIS_EDGE_SIZE);
+  unsigned char *packed = (unsigned char *) malloc(MAX(size, 1));
+  if (!packed) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  tape_analysis_pack_defaults(&ta, packed);
+  lua_pushlstring(L, (const char *) packed,
+                  ta.length * ANALYSIS_DEFAULT_SIZE);
+  lua_setfield(L, -2, "defaults");
+  tape_analysis_pack_edges(it, &ta, packed);
+  lua_pushlstring(L, (const char *) packed,
+                  ta.edge_count * ANALYSIS_EDGE_SIZE);
+  lua_setfield(L, -2, "edges");
+  free(packed);
+
+  lua_createtable(L, ta.length, 0);
+  for (size_t s = 0; s < ta.length; s++) {
+    lua_pushinteger(L, ta.fan_out[s]);
+    lua_rawseti(L, -2, s + 1);
+  }
+  lua_setfield(L, -2, "fan_out");
+  lua_createtable(L, ta.length, 0);
+  for (size_t s = 0; s < ta.length; s++) {
+    lua_pushinteger(L, ta.distinct_targets[s]);
+    lua_rawseti(L, -2, s + 1);
+  }
+  lua_setfield(L, -2, "distinct_targets");
+
+  push_state_set(L, ta.reachable, ta.length, ta.reachable_count);
+  lua_setfield(L, -2, "reachable");
+  push_state_set(L, ta.dead, ta.length, ta.dead_count);
+  lua_setfield(L, -2, "dead");
+
+  tape_analysis_destroy(&ta);
+  return 1;
+}
+
+static int l_inspector_dumpfile(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  const char *filename = luaL_checkstring(L, 2);
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    lua_error(L);
+    return 0;
+  }
+  inspector_dumpfile(f, it);
+  fclose(f);
+  return 0;
+}
+
+static int l_inspector_loadfile(lua_State *L) {
+  /* Get file */
+  const char *filename = luaL_checkstring(L, 1);
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    lua_error(L);
+    return 0;
+  }
+
+  /* Load file into tape */
+  InstructionTape *it = inspector_loadfile(f);
+
+  /* Done with file */
+  fclose(f);
+
+  /* Return tape */
+  lua_pushlightuserdata(L, it);
+  return 1;
+}
+
+/**
+ * Whether the optional opts table at idx asks for an arena tape
+ */
+static int opts_arena(lua_State *L, int idx) {
+  int arena = 0;
+  if (lua_istable(L, idx)) {
+    lua_getfield(L, idx, "arena");
+    arena = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  return arena;
+}
+
+static int l_get_instruction_tape(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) malloc(sizeof(InstructionTape));
+  if (opts_arena(L, 1)) {
+    fse_initialize_arena_tape(it);
+  } else {
+    fse_initialize_tape(it);
+  }
+  lua_pushlightuserdata(L, (void *) it);
+  return 1;
+}
+
+static int l_fse_freeze(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  fse_freeze(it);
+  return 0;
+}
+
+static int l_create_pegreg_diffmatch(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  create_pegreg_diffmatch(it);
+  return 0;
+}
+
+/**
+ * The string at arg, or the slice of it given by the optional offset
+ * (bytes to skip) and length at offset_arg and offset_arg + 1. NUL
+ * bytes are kept and nothing is copied.
+ */
+static const char *check_input_slice(lua_State *L, int arg, int offset_arg,
+                                     size_t *length) {
+  size_t total;
+  const char *input = luaL_checklstring(L, arg, &total);
+  lua_Integer offset = luaL_optinteger(L, offset_arg, 0);
+  luaL_argcheck(L, offset >= 0 && (size_t) offset <= total, offset_arg,
+                "offset out of range");
+  lua_Integer slice =
+      luaL_optinteger(L, offset_arg + 1, (lua_Integer) (total - offset));
+  luaL_argcheck(L, slice >= 0 && (size_t) slice <= total - offset,
+                offset_arg + 1, "length out of range");
+  *length = (size_t) slice;
+  return input + offset;
+}
+
+/*
+ * fst_fast.match_string(input, tape, offset, length)
+ *
+ * Matches all of input, or length bytes of it after the first offset
+ */
+static int l_match_string(lua_State *L) {
+  size_t length;
+  const char *input = check_input_slice(L, 1, 3, &length);
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 2);
+
+  MatchObject mo;
+  match_bytes(it, &mo, input, length);
+
+  lua_pushlstring(L, mo.char_output, mo.char_length);
+
+  lua_pushboolean(L, mo.match_success);
+
+  lua_newtable(L);
+
+  for (int i = 0; i < mo.state_length; i++) {
+    lua_pushnumber(L, i + 1);
+    lua_pushnumber(L, mo.state_output[i]);
+    lua_settable(L, -3);
+  }
+
+  match_destroy(&mo);
+
+  return 3;
+}
+
+/*
+ * fst_fast.match_string_parallel(input, tape, threads, offset, length)
+ *
+ * Returns what match_string returns, then the number of chunks the
+ * input was matched in, 1 if it was matched sequentially
+ */
+static int l_match_string_parallel(lua_State *L) {
+  size_t length;
+  const char *input = check_input_slice(L, 1, 4, &length);
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 2);
+  int threads = luaL_optint(L, 3, 4);
+
+  MatchObject mo;
+  int chunks = match_string_parallel(it, &mo, input, length, threads);
+
+  lua_pushlstring(L, mo.char_output, mo.char_length);
+
+  lua_pushboolean(L, mo.match_success);
+
+  lua_newtable(L);
+
+  for (int i = 0; i < mo.state_length; i++) {
+    lua_pushnumber(L, i + 1);
+    lua_pushnumber(L, mo.state_output[i]);
+    lua_settable(L, -3);
+  }
+
+  match_destroy(&mo);
+
+  lua_pushinteger(L, chunks);
+
+  return 4;
+}
+
+static int l_instruction_tape_destroy(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  instruction_tape_destroy(it);
+  free(it);
+  return 0;
+}
+
+static int l_fse_clear_instr(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  int error_state = luaL_checkint(L, 2);
+  fse_clear_instr(it, error_state);
+  return 0;
+}
+
+static int l_fse_set_initial_flags(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  fse_set_initial_flags(it);
+  return 0;
+}
+
+static int l_fse_get_outgoing(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  const char *c = luaL_checkstring(L, 2);
+  if (strlen(c) != 1) {
+    luaL_error(L, "Size of c parameter must be 1");
+    return 0;
+  }
+  FstStateEntry *fse = fse_get_outgoing(it, *c);
+  lua_pushlightuserdata(L, (void *) fse);
+  return 1;
+}
+
+static int l_fse_set_outstate(lua_State *L) {
+  FstStateEntry *fse = (FstStateEntry *) lua_touserdata(L, 1);
+  int outstate = luaL_checkint(L, 2);
+  fse_set_outstate(fse, outstate);
+  return 0;
+}
+
+static int l_fse_set_outchar(lua_State *L) {
+  FstStateEntry *fse = (FstStateEntry *) lua_touserdata(L, 1);
+  const char *c = luaL_checkstring(L, 2);
+  if (strlen(c) != 1) {
+    luaL_error(L, "Size of c parameter must be 1");
+    return 0;
+  }
+  fse_set_outchar(fse, *c);
+  return 0;
+}
+
+static int l_fse_finish(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  fse_finish(it);
+  return 0;
+}
+
+static int l_fse_set_final_flags(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  fse_set_final_flags(it);
+  return 0;
+}
+
+static int l_get_wide_instruction_tape(lua_State *L) {
+  WideInstructionTape *it =
+      (WideInstructionTape *) malloc(sizeof(WideInstructionTape));
+  if (opts_arena(L, 1)) {
+    fwe_initialize_arena_tape(it);
+  } else {
+    fwe_initialize_tape(it);
+  }
+  lua_pushlightuserdata(L, (void *) it);
+  return 1;
+}
+
+static int l_fwe_freeze(lua_State *L) {
+  WideInstructionTape *it = (WideInstructionTape *) lua_touserdata(L, 1);
+  fwe_freeze(it);
+  return 0;
+}
+
+static int l_wide_instruction_tape_destroy(lua_State *L) {
+  WideInstructionTape *it = (WideInstructionTape *) lua_touserdata(L, 1);
+  wide_instruction_tape_destroy(it);
+  free(it);
+  return 0;
+}
+
+static int l_fwe_clear_instr(lua_State *L) {
+  WideInstructionTape *it = (WideInstructionTape *) lua_touserdata(L, 1);
+  unsigned int error_state = (unsigned int) luaL_checkinteger(L, 2);
+  fwe_clear_instr(it, error_state);
+  return 0;
+}
+
+static int l_fwe_set_initial_flags(lua_State *L) {
+  WideInstructionTape *it = (WideInstructionTape *) lua_touserdata(L, 1);
+  fwe_set_initial_flags(it);
+  return 0;
+}
+
+static int l_fwe_set_final_flags(lua_State *L) {
+  WideInstructionTape *it = (WideInstructionTape *) lua_touserdata(L, 1);
+  fwe_set_final_flags(it);
+  return 0;
+}
+
+static int l_fwe_get_outgoing(lua_State *L) {
+  WideInstructionTape *it = (WideInstructionTape *) lua_touserdata(L, 1);
+  size_t len = 0;
+  const char *c = luaL_checklstring(L, 2, &len);
+  if (len != 1) {
+    luaL_error(L, "Size of c parameter must be 1");
+    return 0;
+  }
+  FstWideEntry *fwe = fwe_get_outgoing(it, *c);
+  lua_pushlightuserdata(L, (void *) fwe);
+  return 1;
+}
+
+static int l_fwe_set_outstate(lua_State *L) {
+  FstWideEntry *fwe = (FstWideEntry *) lua_touserdata(L, 1);
+  unsigned int outstate = (unsigned int) luaL_checkinteger(L, 2);
+  fwe_set_outstate(fwe, outstate);
+  return 0;
+}
+
+static int l_fwe_set_output(lua_State *L) {
+  WideInstructionTape *it = (WideInstructionTape *) lua_touserdata(L, 1);
+  FstWideEntry *fwe = (FstWideEntry *) lua_touserdata(L, 2);
+  size_t len = 0;
+  const char *output = luaL_checklstring(L, 3, &len);
+  luaL_argcheck(L, len <= FWE_MAX_OUTPUT_LENGTH, 3, "output too long");
+  fwe_set_output(it, fwe, output, len);
+  return 0;
+}
+
+static int l_fwe_finish(lua_State *L) {
+  WideInstructionTape *it = (WideInstructionTape *) lua_touserdata(L, 1);
+  fwe_finish(it);
+  return 0;
+}
+
+/*
+ * fst_fast.wide_match_string(input, tape, offset, length)
+ */
+static int l_wide_match_string(lua_State *L) {
+  size_t length;
+  const char *input = check_input_slice(L, 1, 3, &length);
+  WideInstructionTape *it = (WideInstructionTape *) lua_touserdata(L, 2);
+
+  WideMatchObject mo;
+  wide_match_bytes(it, &mo, input, length);
+
+  lua_pushlstring(L, mo.char_output, mo.char_length);
+
+  lua_pushboolean(L, mo.match_success);
+
+  lua_createtable(L, mo.state_length, 0);
+
+  for (size_t i = 0; i < mo.state_length; i++) {
+    lua_pushnumber(L, mo.state_output[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+
+  wide_match_destroy(&mo);
+
+  return 3;
+}
+
+static int l_wide_inspector_get_length(lua_State *L) {
+  WideInstructionTape *it = (WideInstructionTape *) lua_touserdata(L, 1);
+  lua_pushinteger(L, it->length);
+  return 1;
+}
+
+static int l_wide_inspector_dumpfile(lua_State *L) {
+  WideInstructionTape *it = (WideInstructionTape *) lua_touserdata(L, 1);
+  const char *filename = luaL_checkstring(L, 2);
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    return luaL_error(L, "Could not open %s for writing", filename);
+  }
+  wide_inspector_dumpfile(f, it);
+  fclose(f);
+  return 0;
+}
+
+static int l_wide_inspector_loadfile(lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    return luaL_error(L, "Could not open %s for reading", filename);
+  }
+
+  WideInstructionTape *it = wide_inspector_loadfile(f);
+  fclose(f);
+  if (!it) {
+    return luaL_error(L, "%s is not a wide tape dump", filename);
+  }
+
+  lua_pushlightuserdata(L, it);
+  return 1;
+}
+
+/*
+ * fst_fast.build_tape(spec)
+ *
+ * Builds a whole tape in one call instead of one Lua round trip per
+ * edge. spec is
+ *
+ * {
+ *   wide = false,  -- build a wide tape instead of a narrow one
+ *   default = 0,   -- error target of states that don't name one
+ *   states = {
+ *     {default = 6, initial = true, final = false,
+ *      edges = {{lo, hi, state, output}, ...}},
+ *     ...
+ *   }
+ * }
+ *
+ * States are numbered from 0 in array order. An edge covers every byte
+ * from lo to hi, given as numbers or one character strings. output is
+ * a string (at most one byte on narrow tapes), true to echo the input
+ * byte, or nil for no output.
+ */
+
+static int build_read_byte(lua_State *L, int idx, int *byte) {
+  if (lua_type(L, idx) == LUA_TNUMBER) {
+    lua_Integer b = lua_tointeger(L, idx);
+    if (b < 0 || b > 255) {
+      return 0;
+    }
+    *byte = (int) b;
+    return 1;
+  }
+  if (lua_type(L, idx) == LUA_TSTRING) {
+    size_t len = 0;
+    const char *s = lua_tolstring(L, idx, &len);
+    if (len != 1) {
+      return 0;
+    }
+    *byte = (unsigned char) *s;
+    return 1;
+  }
+  return 0;
+}
+
+static int build_read_state(lua_State *L, int idx, size_t n,
+                            unsigned int *state) {
+  int isnum = 0;
+  lua_Integer s = lua_tointegerx(L, idx, &isnum);
+  if (!isnum || s < 0 || (size_t) s >= n) {
+    return 0;
+  }
+  *state = (unsigned int) s;
+  return 1;
+}
+
+static int l_build_tape(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_getfield(L, 1, "wide");
+  int wide = lua_toboolean(L, -1);
+  lua_getfield(L, 1, "states");
+  luaL_argcheck(L, lua_istable(L, 3), 1, "spec.states must be a table");
+  size_t n = lua_rawlen(L, 3);
+  luaL_argcheck(L, wide || n <= 65536, 1,
+                "narrow tapes hold at most 65536 states");
+
+  unsigned int default_state = 0;
+  lua_getfield(L, 1, "default");
+  if (!lua_isnil(L, 4) && !build_read_state(L, 4, n, &default_state)) {
+    return luaL_argerror(L, 1, "spec.default is not a state");
+  }
+  lua_settop(L, 3);
+
+  InstructionTape *it = NULL;
+  WideInstructionTape *wt = NULL;
+  /* Pool offset of the bytes 0 to 255, for echoing edges */
+  size_t byte_table = (size_t) -1;
+  if (wide) {
+    wt = (WideInstructionTape *) malloc(sizeof(WideInstructionTape));
+    fwe_initialize_tape(wt);
+    fwe_grow(wt, n);
+  } else {
+    it = (InstructionTape *) malloc(sizeof(InstructionTape));
+    fse_initialize_tape(it);
+    fse_grow(it, n);
+  }
+
+  /* Stack: spec, wide, states, state, default, initial, final, edges */
+  const char *error = NULL;
+  size_t i = 0;
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 3, i + 1);
+    if (!lua_istable(L, 4)) {
+      error = "is not a table";
+      break;
+    }
+    lua_getfield(L, 4, "default");
+    lua_getfield(L, 4, "initial");
+    lua_getfield(L, 4, "final");
+    lua_getfield(L, 4, "edges");
+
+    unsigned int errorstate = default_state;
+    if (!lua_isnil(L, 5) && !build_read_state(L, 5, n, &errorstate)) {
+      error = "has a default that is not a state";
+      break;
+    }
+
+    if (wide) {
+      fwe_clear_instr(wt, errorstate);
+      if (lua_toboolean(L, 6)) {
+        fwe_set_initial_flags(wt);
+      }
+      if (lua_toboolean(L, 7)) {
+        fwe_set_final_flags(wt);
+      }
+    } else {
+      fse_clear_instr(it, errorstate);
+      if (lua_toboolean(L, 6)) {
+        fse_set_initial_flags(it);
+      }
+      if (lua_toboolean(L, 7)) {
+        fse_set_final_flags(it);
+      }
+    }
+
+    size_t edges = lua_istable(L, 8) ? lua_rawlen(L, 8) : 0;
+    for (size_t j = 0; j < edges; j++) {
+      lua_rawgeti(L, 8, j + 1);
+      if (!lua_istable(L, 9)) {
+        error = "has an edge that is not a table";
+        break;
+      }
+      lua_rawgeti(L, 9, 1);
+      lua_rawgeti(L, 9, 2);
+      lua_rawgeti(L, 9, 3);
+      lua_rawgeti(L, 9, 4);
+
+      int lo = 0;
+      int hi = 0;
+      unsigned int to = 0;
+      if (!build_read_byte(L, 10, &lo) || !build_read_byte(L, 11, &hi) ||
+          lo > hi) {
+        error = "has an edge with a bad byte range";
+        break;
+      }
+      if (!build_read_state(L, 12, n, &to)) {
+        error = "has an edge to a state that does not exist";
+        break;
+      }
+      int echo = lua_type(L, 13) == LUA_TBOOLEAN && lua_toboolean(L, 13);
+      size_t outlen = 0;
+      const char *output = NULL;
+      if (lua_type(L, 13) == LUA_TSTRING) {
+        output = lua_tolstring(L, 13, &outlen);
+      } else if (!lua_isnil(L, 13) && !echo) {
+        error = "has an edge with a bad output";
+        break;
+      }
+      if (!wide && outlen > 1) {
+        error = "has an edge with more than one output byte";
+        break;
+      }
+      if (outlen > FWE_MAX_OUTPUT_LENGTH) {
+        error = "has an edge with too long an output";
+        break;
+      }
+
+      /* The whole range shares one copy of the output */
+      size_t offset = 0;
+      if (wide && echo) {
+        if (byte_table == (size_t) -1) {
+          byte_table = fwe_add_byte_table(wt);
+        }
+      } else if (wide && outlen) {
+        offset = fwe_add_output(wt, output, outlen);
+      }
+      for (int b = lo; b <= hi; b++) {
+        char c = (char) b;
+        if (wide) {
+          FstWideEntry *fwe = fwe_get_outgoing(wt, c);
+          fwe_set_outstate(fwe, to);
+          if (echo) {
+            fwe_set_pooled_output(wt, fwe, byte_table + b, 1);
+          } else {
+            fwe_set_pooled_output(wt, fwe, offset, outlen);
+          }
+        } else {
+          FstStateEntry *fse = (FstStateEntry *) it->current + b;
+          fse_set_outstate(fse, to);
+          fse_set_outchar(fse, echo ? c : (outlen ? *output : 0));
+        }
+      }
+      lua_settop(L, 8);
+    }
+    if (error) {
+      break;
+    }
+
+    if (wide) {
+      fwe_finish(wt);
+    } else {
+      fse_finish(it);
+    }
+    lua_settop(L, 3);
+  }
+
+  if (error) {
+    if (wide) {
+      wide_instruction_tape_destroy(wt);
+      free(wt);
+    } else {
+      instruction_tape_destroy(it);
+      free(it);
+    }
+    return luaL_error(L, "build_tape: state %d %s", (int) i, error);
+  }
+
+  lua_pushlightuserdata(L, wide ? (void *) wt : (void *) it);
+  return 1;
+}
+
+/*
+ * fst_fast.build_dictionary(source, opts)
+ *
+ * Builds a minimal wide tape mapping each key to its value. source is
+ * either a file name, with one "key<separator>value" per line, or an
+ * iterator function returning key, value until key is nil. Keys must be
+ * in strictly increasing byte order (LC_ALL=C sort).
+ *
+ * opts.terminator (default "\n") ends every key: look key up with
+ * fst_fast.wide_match_string(key .. terminator, tape).
+ * opts.separator (default "\t") splits the lines of a file.
+ */
+
+static char build_dictionary_opt_char(lua_State *L, const char *name,
+                                      char def) {
+  char c = def;
+  lua_getfield(L, 2, name);
+  if (!lua_isnil(L, -1)) {
+    size_t len = 0;
+    const char *s = lua_tolstring(L, -1, &len);
+    if (!s || len != 1) {
+      luaL_error(L, "build_dictionary: opts.%s must be one character", name);
+    }
+    c = *s;
+  }
+  lua_pop(L, 1);
+  return c;
+}
+
+static int build_dictionary_add(lua_State *L, DictBuilder *db,
+                                const char *key, size_t key_length,
+                                const char *value, size_t value_length) {
+  int result = dict_builder_add(db, key, key_length, value, value_length);
+  if (result == DICT_OK) {
+    return 0;
+  }
+  lua_pushfstring(L, "build_dictionary: key %s %s", key,
+                  result == DICT_UNSORTED ? "is out of order or repeated"
+                                          : "contains the terminator");
+  return 1;
+}
+
+static int l_build_dictionary(lua_State *L) {
+  int is_file = lua_type(L, 1) == LUA_TSTRING;
+  luaL_argcheck(L, is_file || lua_isfunction(L, 1), 1,
+                "expected a file name or an iterator");
+  char terminator = '\n';
+  char separator = '\t';
+  if (lua_istable(L, 2)) {
+    terminator = build_dictionary_opt_char(L, "terminator", terminator);
+    separator = build_dictionary_opt_char(L, "separator", separator);
+  }
+
+  FILE *f = NULL;
+  if (is_file) {
+    f = fopen(lua_tostring(L, 1), "rb");
+    if (!f) {
+      return luaL_error(L, "Could not open %s for reading",
+                        lua_tostring(L, 1));
+    }
+  }
+
+  DictBuilder db;
+  dict_builder_initialize(&db, terminator);
+  int failed = 0;
+
+  if (is_file) {
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+    while (!failed && (line_length = getline(&line, &line_capacity, f)) >= 0) {
+      if (line_length > 0 && line[line_length - 1] == '\n') {
+        line_length -= 1;
+      }
+      char *sep = (char *) memchr(line, separator, line_length);
+      size_t key_length = sep ? (size_t) (sep - line) : (size_t) line_length;
+      const char *value = sep ? sep + 1 : line + line_length;
+      size_t value_length = line + line_length - value;
+      line[key_length] = '\0';
+      failed = build_dictionary_add(L, &db, line, key_length, value,
+                                    value_length);
+    }
+    free(line);
+    fclose(f);
+  } else {
+    while (!failed) {
+      lua_settop(L, 2);
+      lua_pushvalue(L, 1);
+      if (lua_pcall(L, 0, 2, 0) != LUA_OK) {
+        failed = 1;
+        break;
+      }
+      if (lua_isnil(L, 3)) {
+        break;
+      }
+      size_t key_length = 0;
+      size_t value_length = 0;
+      const char *key = lua_tolstring(L, 3, &key_length);
+      const char *value = lua_tolstring(L, 4, &value_length);
+      if (!key) {
+        lua_pushstring(L, "build_dictionary: keys must be strings");
+        failed = 1;
+        break;
+      }
+      failed = build_dictionary_add(L, &db, key, key_length,
+                                    value ? value : "", value_length);
+    }
+  }
+
+  if (failed) {
+    dict_builder_destroy(&db);
+    return lua_error(L);
+  }
+
+  WideInstructionTape *it = dict_builder_finish(&db);
+  dict_builder_destroy(&db);
+  lua_pushlightuserdata(L, it);
+  return 1;
+}
+
+/*
+ * fst_fast.build_utf8_tape(spec)
+ *
+ * Builds a tape over codepoints instead of bytes (see fst_utf8.h).
+ * spec is as for build_tape, except that an edge's lo and hi are
+ * codepoints, given as numbers or as strings holding one UTF-8
+ * character. A string output is written once the whole codepoint has
+ * been read, and true echoes its bytes. The tape goes on after the
+ * given states with the states inside multibyte characters.
+ */
+
+static int build_read_codepoint(lua_State *L, int idx,
+                                unsigned long *codepoint) {
+  if (lua_type(L, idx) == LUA_TNUMBER) {
+    lua_Integer c = lua_tointeger(L, idx);
+    if (c < 0 || c > UTF8_MAX_CODEPOINT) {
+      return 0;
+    }
+    *codepoint = (unsigned long) c;
+    return 1;
+  }
+  if (lua_type(L, idx) == LUA_TSTRING) {
+    size_t len = 0;
+    const char *s = lua_tolstring(L, idx, &len);
+    return len > 0 && utf8_decode(s, len, codepoint) == len;
+  }
+  return 0;
+}
+
+static int l_build_utf8_tape(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_getfield(L, 1, "wide");
+  int wide = lua_toboolean(L, -1);
+  lua_getfield(L, 1, "states");
+  luaL_argcheck(L, lua_istable(L, 3), 1, "spec.states must be a table");
+  size_t n = lua_rawlen(L, 3);
+
+  unsigned int default_state = 0;
+  lua_getfield(L, 1, "default");
+  if (!lua_isnil(L, 4) && !build_read_state(L, 4, n, &default_state)) {
+    return luaL_argerror(L, 1, "spec.default is not a state");
+  }
+  lua_settop(L, 3);
+
+  Utf8Builder ub;
+  utf8_builder_initialize(&ub, n);
+
+  /* Stack: spec, wide, states, state, default, initial, final, edges */
+  const char *error = NULL;
+  size_t i = 0;
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 3, i + 1);
+    if (!lua_istable(L, 4)) {
+      error = "is not a table";
+      break;
+    }
+    lua_getfield(L, 4, "default");
+    lua_getfield(L, 4, "initial");
+    lua_getfield(L, 4, "final");
+    lua_getfield(L, 4, "edges");
+
+    unsigned int errorstate = default_state;
+    if (!lua_isnil(L, 5) && !build_read_state(L, 5, n, &errorstate)) {
+      error = "has a default that is not a state";
+      break;
+    }
+    int flags = (lua_toboolean(L, 6) ? FST_FLAG_INITIAL : 0) |
+                (lua_toboolean(L, 7) ? FST_FLAG_FINAL : 0);
+    utf8_builder_set_state(&ub, i, errorstate, flags);
+
+    size_t edges = lua_istable(L, 8) ? lua_rawlen(L, 8) : 0;
+    for (size_t j = 0; j < edges; j++) {
+      lua_rawgeti(L, 8, j + 1);
+      if (!lua_istable(L, 9)) {
+        error = "has an edge that is not a table";
+        break;
+      }
+      lua_rawgeti(L, 9, 1);
+      lua_rawgeti(L, 9, 2);
+      lua_rawgeti(L, 9, 3);
+      lua_rawgeti(L, 9, 4);
+
+      unsigned long lo = 0;
+      unsigned long hi = 0;
+      unsigned int to = 0;
+      if (!build_read_codepoint(L, 10, &lo) ||
+          !build_read_codepoint(L, 11, &hi) || lo > hi) {
+        error = "has an edge with a bad codepoint range";
+        break;
+      }
+      if (!build_read_state(L, 12, n, &to)) {
+        error = "has an edge to a state that does not exist";
+        break;
+      }
+      int echo = lua_type(L, 13) == LUA_TBOOLEAN && lua_toboolean(L, 13);
+      size_t outlen = 0;
+      const char *output = NULL;
+      if (lua_type(L, 13) == LUA_TSTRING) {
+        output = lua_tolstring(L, 13, &outlen);
+      } else if (!lua_isnil(L, 13) && !echo) {
+        error = "has an edge with a bad output";
+        break;
+      }
+      if (!wide && outlen > 1) {
+        error = "has an edge with more than one output byte";
+        break;
+      }
+      if (outlen > FWE_MAX_OUTPUT_LENGTH) {
+        error = "has an edge with too long an output";
+        break;
+      }
+
+      utf8_builder_add(&ub, i, lo, hi, to, output, outlen, echo);
+      lua_settop(L, 8);
+    }
+    if (error) {
+      break;
+    }
+    lua_settop(L, 3);
+  }
+
+  void *tape = NULL;
+  if (!error) {
+    tape = wide ? (void *) utf8_builder_wide(&ub)
+                : (void *) utf8_builder_narrow(&ub);
+  }
+  utf8_builder_destroy(&ub);
+  if (error) {
+    return luaL_error(L, "build_utf8_tape: state %d %s", (int) i, error);
+  }
+  if (!tape) {
+    return luaL_error(L, "build_utf8_tape: more than 65536 states, "
+                         "build a wide tape");
+  }
+
+  lua_pushlightuserdata(L, tape);
+  return 1;
+}
+
+static int l_compact_dumpfile(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  const char *filename = luaL_checkstring(L, 2);
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    return luaL_error(L, "Could not open %s for writing", filename);
+  }
+  int result = compact_dumpfile(f, it);
+  if (fclose(f) != 0 || result != 0) {
+    return luaL_error(L, "Could not write %s", filename);
+  }
+  return 0;
+}
+
+static int l_compact_loadfile(lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  int threads = luaL_optint(L, 2, 1);
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    return luaL_error(L, "Could not open %s for reading", filename);
+  }
+
+  InstructionTape *it = compact_loadfile(f, threads);
+  fclose(f);
+  if (!it) {
+    return luaL_error(L, "%s is not a compact tape", filename);
+  }
+
+  lua_pushlightuserdata(L, it);
+  return 1;
+}
+
+static int l_wide_compact_dumpfile(lua_State *L) {
+  WideInstructionTape *it = (WideInstructionTape *) lua_touserdata(L, 1);
+  const char *filename = luaL_checkstring(L, 2);
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    return luaL_error(L, "Could not open %s for writing", filename);
+  }
+  int result = wide_compact_dumpfile(f, it);
+  if (fclose(f) != 0 || result != 0) {
+    return luaL_error(L, "Could not write %s", filename);
+  }
+  return 0;
+}
+
+static int l_wide_compact_loadfile(lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  int threads = luaL_optint(L, 2, 1);
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    return luaL_error(L, "Could not open %s for reading", filename);
+  }
+
+  WideInstructionTape *it = wide_compact_loadfile(f, threads);
+  fclose(f);
+  if (!it) {
+    return luaL_error(L, "%s is not a compact wide tape", filename);
+  }
+
+  lua_pushlightuserdata(L, it);
+  return 1;
+}
+
+static int l_wide_from_narrow(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  lua_pushlightuserdata(L, wide_from_narrow(it));
+  return 1;
+}
+
+static int l_narrow_from_wide(lua_State *L) {
+  WideInstructionTape *wt = (WideInstructionTape *) lua_touserdata(L, 1);
+  InstructionTape *it = narrow_from_wide(wt);
+  if (!it) {
+    return luaL_error(L, "tape does not fit a narrow tape");
+  }
+  lua_pushlightuserdata(L, it);
+  return 1;
+}
+
+/*
+ * fst_fast.compose(a, b), fst_fast.intersect(a, b), fst_fast.union(a, b)
+ *
+ * Product tapes, see fst_product.h. The narrow versions go through wide
+ * tapes and fail if the result does not fit a narrow one.
+ */
+
+static int product_narrow(lua_State *L,
+                          WideInstructionTape *(*op)(WideInstructionTape *,
+                                                     WideInstructionTape *)) {
+  InstructionTape *a = (InstructionTape *) lua_touserdata(L, 1);
+  InstructionTape *b = (InstructionTape *) lua_touserdata(L, 2);
+  WideInstructionTape *wa = wide_from_narrow(a);
+  WideInstructionTape *wb = wide_from_narrow(b);
+  WideInstructionTape *wr = op(wa, wb);
+  InstructionTape *result = wr ? narrow_from_wide(wr) : NULL;
+  wide_instruction_tape_destroy(wa);
+  free(wa);
+  wide_instruction_tape_destroy(wb);
+  free(wb);
+  if (wr) {
+    wide_instruction_tape_destroy(wr);
+    free(wr);
+  }
+  if (!result) {
+    return luaL_error(L, "product does not fit a narrow tape");
+  }
+  lua_pushlightuserdata(L, result);
+  return 1;
+}
+
+static int product_wide(lua_State *L,
+                        WideInstructionTape *(*op)(WideInstructionTape *,
+                                                   WideInstructionTape *)) {
+  WideInstructionTape *a = (WideInstructionTape *) lua_touserdata(L, 1);
+  WideInstructionTape *b = (WideInstructionTape *) lua_touserdata(L, 2);
+  WideInstructionTape *result = op(a, b);
+  if (!result) {
+    return luaL_error(L, "product of these tapes can't be built");
+  }
+  lua_pushlightuserdata(L, result);
+  return 1;
+}
+
+static int l_compose(lua_State *L) {
+  return product_narrow(L, wide_compose);
+}
+
+static int l_intersect(lua_State *L) {
+  return product_narrow(L, wide_intersect);
+}
+
+static int l_union(lua_State *L) {
+  return product_narrow(L, wide_union);
+}
+
+static int l_wide_compose(lua_State *L) {
+  return product_wide(L, wide_compose);
+}
+
+static int l_wide_intersect(lua_State *L) {
+  return product_wide(L, wide_intersect);
+}
+
+static int l_wide_union(lua_State *L) {
+  return product_wide(L, wide_union);
+}
+
+#define FROZEN_TAPE_METATABLE "fst_fast.FrozenTape"
+
+/**
+ * Wrap a reference to ft, which the userdata takes over, in a full
+ * userdata that drops it on __gc
+ */
+static void push_frozen_tape(lua_State *L, FrozenTape *ft) {
+  FrozenTape **box = (FrozenTape **) lua_newuserdata(L, sizeof(FrozenTape *));
+  *box = ft;
+  luaL_setmetatable(L, FROZEN_TAPE_METATABLE);
+}
+
+static FrozenTape *check_frozen_tape(lua_State *L, int arg) {
+  FrozenTape **box = (FrozenTape **) luaL_checkudata(L, arg,
+                                                     FROZEN_TAPE_METATABLE);
+  if (!*box) {
+    luaL_error(L, "frozen tape already released");
+  }
+  return *box;
+}
+
+static int l_freeze_tape(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  if (!it) {
+    return luaL_error(L, "freeze_tape: expected a tape");
+  }
+  push_frozen_tape(L, frozen_tape_from_narrow(it));
+  return 1;
+}
+
+static int l_freeze_wide_tape(lua_State *L) {
+  WideInstructionTape *it = (WideInstructionTape *) lua_touserdata(L, 1);
+  if (!it) {
+    return luaL_error(L, "freeze_wide_tape: expected a wide tape");
+  }
+  push_frozen_tape(L, frozen_tape_from_wide(it));
+  return 1;
+}
+
+/*
+ * fst_fast.freeze_hybrid_tape(tape)
+ *
+ * Freeze a narrow tape into a hybrid tape, which matches the same but
+ * keeps each state as a default-only, sparse or dense row, whichever
+ * fits it (see fst_hybrid.h)
+ */
+static int l_freeze_hybrid_tape(lua_State *L) {
+  InstructionTape *it = (InstructionTape *) lua_touserdata(L, 1);
+  if (!it) {
+    return luaL_error(L, "freeze_hybrid_tape: expected a tape");
+  }
+  push_frozen_tape(L, frozen_tape_hybrid_from_narrow(it));
+  return 1;
+}
+
+/**
+ * Take over a reference made by export in this or another Lua state.
+ * Each export can be imported once; anything else raises an error.
+ */
+static int l_import_tape(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+  FrozenTape *ft = frozen_tape_import(lua_touserdata(L, 1));
+  if (!ft) {
+    return luaL_error(L, "import_tape: not a pending tape export");
+  }
+  push_frozen_tape(L, ft);
+  return 1;
+}
+
+/**
+ * Make a new reference to the tape as a light userdata, for handing to
+ * another thread or Lua state. It is passed to import_tape once, or to
+ * discard_export if it will never be imported, else the tape is never
+ * freed.
+ */
+static int l_frozen_export(lua_State *L) {
+  FrozenTape *ft = check_frozen_tape(L, 1);
+  lua_pushlightuserdata(L, frozen_tape_export(ft));
+  return 1;
+}
+
+static int l_frozen_gc(lua_State *L) {
+  FrozenTape **box = (FrozenTape **) luaL_checkudata(L, 1,
+                                                     FROZEN_TAPE_METATABLE);
+  if (*box) {
+    frozen_tape_release(*box);
+    *box = NULL;
+  }
+  return 0;
+}
+
+static int l_frozen_length(lua_State *L) {
+  FrozenTape *ft = check_frozen_tape(L, 1);
+  lua_pushinteger(L, frozen_tape_length(ft));
+  return 1;
+}
+
+/**
+ * References the tape has, from any Lua state, registry or export
+ */
+static int l_frozen_references(lua_State *L) {
+  FrozenTape *ft = check_frozen_tape(L, 1);
+  lua_pushinteger(L, __atomic_load_n(&ft->refcount, __ATOMIC_RELAXED));
+  return 1;
+}
+
+static int l_frozen_is_wide(lua_State *L) {
+  FrozenTape *ft = check_frozen_tape(L, 1);
+  lua_pushboolean(L, ft->kind == FROZEN_WIDE);
+  return 1;
+}
+
+/**
+ * For a hybrid tape, a table of how many rows are of each kind and the
+ * bytes they take, nil for any other
+ */
+static int l_frozen_row_kinds(lua_State *L) {
+  FrozenTape *ft = check_frozen_tape(L, 1);
+  if (ft->kind != FROZEN_HYBRID) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L, 0, 4);
+  lua_pushnumber(L, ft->hybrid.kind_counts[HYBRID_DEFAULT]);
+  lua_setfield(L, -2, "default");
+  lua_pushnumber(L, ft->hybrid.kind_counts[HYBRID_SPARSE]);
+  lua_setfield(L, -2, "sparse");
+  lua_pushnumber(L, ft->hybrid.kind_counts[HYBRID_DENSE]);
+  lua_setfield(L, -2, "dense");
+  lua_pushnumber(L, hybrid_tape_size(&ft->hybrid));
+  lua_setfield(L, -2, "bytes");
+  return 1;
+}
+
+/**
+ * Match on a frozen tape, into mo or wmo depending on its kind
+ */
+static void frozen_match(FrozenTape *ft, const char *input, size_t length,
+                         MatchObject *mo, WideMatchObject *wmo) {
+  if (ft->kind == FROZEN_WIDE) {
+    wide_match_bytes(&ft->wide, wmo, input, length);
+  } else if (ft->kind == FROZEN_HYBRID) {
+    hybrid_match_bytes(&ft->hybrid, mo, input, length);
+  } else {
+    match_bytes(&ft->narrow, mo, input, length);
+  }
+}
+
+/**
+ * Push the results of frozen_match like match_string does, and free
+ * them
+ */
+static void push_frozen_match(lua_State *L, int kind, MatchObject *mo,
+                              WideMatchObject *wmo) {
+  if (kind == FROZEN_WIDE) {
+    lua_pushlstring(L, wmo->char_output, wmo->char_length);
+    lua_pushboolean(L, wmo->match_success);
+    lua_createtable(L, wmo->state_length, 0);
+    for (size_t i = 0; i < wmo->state_length; i++) {
+      lua_pushnumber(L, wmo->state_output[i]);
+      lua_rawseti(L, -2, i + 1);
+    }
+    wide_match_destroy(wmo);
+  } else {
+    lua_pushlstring(L, mo->char_output, mo->char_length);
+    lua_pushboolean(L, mo->match_success);
+    lua_createtable(L, mo->state_length, 0);
+    for (size_t i = 0; i < mo->state_length; i++) {
+      lua_pushnumber(L, mo->state_output[i]);
+      lua_rawseti(L, -2, i + 1);
+    }
+    match_destroy(mo);
+  }
+}
+
+static int l_frozen_match_string(lua_State *L) {
+  FrozenTape *ft = check_frozen_tape(L, 1);
+  size_t length;
+  const char *input = check_input_slice(L, 2, 3, &length);
+
+  MatchObject mo;
+  WideMatchObject wmo;
+  frozen_match(ft, input, length, &mo, &wmo);
+  push_frozen_match(L, ft->kind, &mo, &wmo);
+  return 3;
+}
+
+static const struct luaL_Reg frozen_tape_methods[] = {
+    {"match_string", l_frozen_match_string},
+    {"length", l_frozen_length},
+    {"references", l_frozen_references},
+    {"is_wide", l_frozen_is_wide},
+    {"row_kinds", l_frozen_row_kinds},
+    {"export", l_frozen_export},
+    {NULL, NULL}};
+
+#define TAPE_REGISTRY_METATABLE "fst_fast.TapeRegistry"
+
+typedef struct LuaRegistry LuaRegistry;
+
+/**
+ * What a registry userdata holds: a reference, and the reader slot it
+ * matches through, claimed on first use
+ */
+struct LuaRegistry {
+  TapeRegistry *reg;
+  /**
+   * -1 while unclaimed, -2 if no slot was free
+   */
+  int slot;
+  /**
+   * Depth of registry:enter, the slot stays in while above 0
+   */
+  int entered;
+};
+
+static void push_registry(lua_State *L, TapeRegistry *reg) {
+  LuaRegistry *lr = (LuaRegistry *) lua_newuserdata(L, sizeof(LuaRegistry));
+  lr->reg = reg;
+  lr->slot = -1;
+  lr->entered = 0;
+  luaL_setmetatable(L, TAPE_REGISTRY_METATABLE);
+}
+
+static LuaRegistry *check_registry(lua_State *L, int arg) {
+  LuaRegistry *lr =
+      (LuaRegistry *) luaL_checkudata(L, arg, TAPE_REGISTRY_METATABLE);
+  if (!lr->reg) {
+    luaL_error(L, "tape registry already released");
+  }
+  return lr;
+}
+
+static int l_tape_registry(lua_State *L) {
+  push_registry(L, registry_create());
+  return 1;
+}
+
+/**
+ * Take over a reference made by export in this or another Lua state,
+ * once, as import_tape
+ */
+static int l_import_registry(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+  TapeRegistry *reg = registry_import(lua_touserdata(L, 1));
+  if (!reg) {
+    return luaL_error(L, "import_registry: not a pending registry export");
+  }
+  push_registry(L, reg);
+  return 1;
+}
+
+/**
+ * A new reference to the registry as a light userdata, as a frozen
+ * tape's export
+ */
+static int l_registry_export(lua_State *L) {
+  LuaRegistry *lr = check_registry(L, 1);
+  lua_pushlightuserdata(L, registry_export(lr->reg));
+  return 1;
+}
+
+/*
+ * fst_fast.discard_export(token)
+ *
+ * Drop the reference of a tape or registry export that will never be
+ * imported. Returns whether token was still pending.
+ */
+static int l_discard_export(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+  void *token = lua_touserdata(L, 1);
+  lua_pushboolean(L, frozen_tape_discard_export(token) ||
+                         registry_discard_export(token));
+  return 1;
+}
+
+static int l_registry_gc(lua_State *L) {
+  LuaRegistry *lr =
+      (LuaRegistry *) luaL_checkudata(L, 1, TAPE_REGISTRY_METATABLE);
+  if (lr->reg) {
+    if (lr->slot >= 0) {
+      registry_reader_unregister(lr->reg, lr->slot);
+    }
+    registry_release(lr->reg);
+    lr->reg = NULL;
+  }
+  return 0;
+}
+
+static int l_registry_publish(lua_State *L) {
+  LuaRegistry *lr = check_registry(L, 1);
+  FrozenTape *ft = check_frozen_tape(L, 2);
+  frozen_tape_retain(ft);
+  lua_pushnumber(L, registry_publish(lr->reg, ft));
+  return 1;
+}
+
+static int l_registry_version(lua_State *L) {
+  LuaRegistry *lr = check_registry(L, 1);
+  lua_pushnumber(L, registry_current_version(lr->reg));
+  return 1;
+}
+
+static int l_registry_acquire(lua_State *L) {
+  LuaRegistry *lr = check_registry(L, 1);
+  unsigned long version;
+  FrozenTape *ft = registry_acquire(lr->reg, &version);
+  if (!ft) {
+    lua_pushnil(L);
+    return 1;
+  }
+  push_frozen_tape(L, ft);
+  lua_pushnumber(L, version);
+  return 2;
+}
+
+/**
+ * Claim the userdata's reader slot on first use
+ * @return whether it has one
+ */
+static int registry_claim_slot(LuaRegistry *lr) {
+  if (lr->slot == -1) {
+    lr->slot = registry_reader_register(lr->reg);
+    if (lr->slot < 0) {
+      lr->slot = -2;
+    }
+  }
+  return lr->slot >= 0;
+}
+
+/**
+ * Enter the registry through the userdata's reader slot, or take a
+ * reference if none are free. Inside registry:enter the slot is in
+ * already and only the current tape is read.
+ * @return the current tape, to be handed to registry_match_leave
+ */
+static FrozenTape *registry_match_enter(lua_State *L, LuaRegistry *lr,
+                                        unsigned long *version) {
+  FrozenTape *ft;
+  if (lr->entered) {
+    ft = registry_current(lr->reg, version);
+  } else if (registry_claim_slot(lr)) {
+    ft = registry_enter(lr->reg, lr->slot, version);
+  } else {
+    ft = registry_acquire(lr->reg, version);
+  }
+  if (!ft) {
+    if (lr->slot >= 0 && !lr->entered) {
+      registry_leave(lr->reg, lr->slot);
+    }
+    luaL_error(L, "registry_match_string: nothing published");
+  }
+  return ft;
+}
+
+static void registry_match_leave(LuaRegistry *lr, FrozenTape *ft) {
+  if (lr->entered) {
+    return;
+  }
+  if (lr->slot >= 0) {
+    registry_leave(lr->reg, lr->slot);
+  } else {
+    frozen_tape_release(ft);
+  }
+}
+
+/*
+ * registry:enter()
+ *
+ * Keep the current tape, and every one published after it, alive until
+ * the matching registry:leave(), so a batch of matches pays for one
+ * enter. Calls nest. Returns the current version.
+ */
+static int l_registry_enter(lua_State *L) {
+  LuaRegistry *lr = check_registry(L, 1);
+  unsigned long version;
+  if (lr->entered) {
+    registry_current(lr->reg, &version);
+  } else if (registry_claim_slot(lr)) {
+    registry_enter(lr->reg, lr->slot, &version);
+  } else {
+    return luaL_error(L, "registry:enter: no reader slot free");
+  }
+  lr->entered += 1;
+  lua_pushnumber(L, version);
+  return 1;
+}
+
+static int l_registry_leave(lua_State *L) {
+  LuaRegistry *lr = check_registry(L, 1);
+  if (!lr->entered) {
+    return luaL_error(L, "registry:leave: not entered");
+  }
+  lr->entered -= 1;
+  if (!lr->entered) {
+    registry_leave(lr->reg, lr->slot);
+  }
+  return 0;
+}
+
+/**
+ * Release the retired tapes no reader is on any more, as publish and
+ * leave do
+ */
+static int l_registry_reclaim(lua_State *L) {
+  LuaRegistry *lr = check_registry(L, 1);
+  registry_reclaim(lr->reg);
+  return 0;
+}
+
+/**
+ * Match on the current tape, also returning its version
+ */
+static int l_registry_match_string(lua_State *L) {
+  LuaRegistry *lr = check_registry(L, 1);
+  size_t length;
+  const char *input = check_input_slice(L, 2, 3, &length);
+
+  unsigned long version;
+  FrozenTape *ft = registry_match_enter(L, lr, &version);
+
+  MatchObject mo;
+  WideMatchObject wmo;
+  frozen_match(ft, input, length, &mo, &wmo);
+  int kind = ft->kind;
+  registry_match_leave(lr, ft);
+
+  /* The tape may be gone by now, only the results are left */
+  push_frozen_match(L, kind, &mo, &wmo);
+  lua_pushnumber(L, version);
+  return 4;
+}
+
+static const struct luaL_Reg tape_registry_methods[] = {
+    {"publish", l_registry_publish},
+    {"version", l_registry_version},
+    {"acquire", l_registry_acquire},
+    {"match_string", l_registry_match_string},
+    {"enter", l_registry_enter},
+    {"leave", l_registry_leave},
+    {"reclaim", l_registry_reclaim},
+    {"export", l_registry_export},
+    {NULL, NULL}};
+
+#define MATCH_CACHE_METATABLE "fst_fast.MatchCache"
+
+/**
+ * Budget of a match cache made without one, in bytes
+ */
+#define MATCH_CACHE_DEFAULT_BUDGET ((size_t) 16 * 1024 * 1024)
+
+static MatchCache *check_match_cache(lua_State *L, int arg) {
+  MatchCache **mcp =
+      (MatchCache **) luaL_checkudata(L, arg, MATCH_CACHE_METATABLE);
+  if (!*mcp) {
+    luaL_error(L, "match cache already destroyed");
+  }
+  return *mcp;
+}
+
+/*
+ * fst_fast.match_cache(budget, opts)
+ *
+ * A cache of match results holding at most budget bytes. opts.states =
+ * false keeps only the output and whether the input was accepted, and
+ * its match_string returns nil for the states.
+ */
+static int l_match_cache(lua_State *L) {
+  lua_Integer budget =
+      luaL_optinteger(L, 1, (lua_Integer) MATCH_CACHE_DEFAULT_BUDGET);
+  luaL_argcheck(L, budget > 0, 1, "budget must be positive");
+  int keep_states = 1;
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "states");
+    if (!lua_isnil(L, -1)) {
+      keep_states = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+
+  MatchCache **mcp = (MatchCache **) lua_newuserdata(L, sizeof(MatchCache *));
+  *mcp = NULL;
+  luaL_setmetatable(L, MATCH_CACHE_METATABLE);
+  *mcp = match_cache_create((size_t) budget, keep_states);
+  return 1;
+}
+
+static int l_match_cache_gc(lua_State *L) {
+  MatchCache **mcp =
+      (MatchCache **) luaL_checkudata(L, 1, MATCH_CACHE_METATABLE);
+  if (*mcp) {
+    match_cache_destroy(*mcp);
+    *mcp = NULL;
+  }
+  return 0;
+}
+
+/**
+ * Push a cached result like match_string does
+ */
+static void push_cache_entry(lua_State *L, MatchCache *mc,
+                             MatchCacheEntry *entry) {
+  lua_pushlstring(L, match_cache_output(entry), entry->output_length);
+  lua_pushboolean(L, entry->accepted);
+  if (!mc->keep_states) {
+    lua_pushnil(L);
+    return;
+  }
+  unsigned int *states = match_cache_states(entry);
+  lua_createtable(L, entry->state_length, 0);
+  for (size_t i = 0; i < entry->state_length; i++) {
+    lua_pushnumber(L, states[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+}
+
+/**
+ * Copy the results of frozen_match into a new entry, if it fits, and
+ * push them either way, freeing them
+ */
+static void cache_frozen_match(lua_State *L, MatchCache *mc,
+                               unsigned long serial, const char *input,
+                               size_t length, int kind, MatchObject *mo,
+                               WideMatchObject *wmo) {
+  MatchCacheEntry *entry;
+  if (kind == FROZEN_WIDE) {
+    entry = match_cache_insert(mc, serial, input, length, wmo->char_output,
+                               wmo->char_length, wmo->match_success,
+                               wmo->state_length);
+    if (entry) {
+      memcpy(match_cache_states(entry), wmo->state_output,
+             entry->state_length * sizeof(unsigned int));
+    }
+  } else {
+    entry = match_cache_insert(mc, serial, input, length, mo->char_output,
+                               mo->char_length, mo->match_success,
+                               mo->state_length);
+    if (entry) {
+      unsigned int *states = match_cache_states(entry);
+      for (size_t i = 0; i < entry->state_length; i++) {
+        states[i] = mo->state_output[i];
+      }
+    }
+  }
+
+  if (entry) {
+    push_cache_entry(L, mc, entry);
+  } else if (mc->keep_states) {
+    push_frozen_match(L, kind, mo, wmo);
+    return;
+  } else if (kind == FROZEN_WIDE) {
+    lua_pushlstring(L, wmo->char_output, wmo->char_length);
+    lua_pushboolean(L, wmo->match_success);
+    lua_pushnil(L);
+  } else {
+    lua_pushlstring(L, mo->char_output, mo->char_length);
+    lua_pushboolean(L, mo->match_success);
+    lua_pushnil(L);
+  }
+  if (kind == FROZEN_WIDE) {
+    wide_match_destroy(wmo);
+  } else {
+    match_destroy(mo);
+  }
+}
+
+/*
+ * cache:match_string(tape, input, offset, length)
+ *
+ * match_string on a frozen tape or on the current tape of a registry
+ * (also returning its version), answered from the cache when the same
+ * input was matched on the same tape before
+ */
+static int l_match_cache_match_string(lua_State *L) {
+  MatchCache *mc = check_match_cache(L, 1);
+  LuaRegistry *lr =
+      (LuaRegistry *) luaL_testudata(L, 2, TAPE_REGISTRY_METATABLE);
+  FrozenTape *ft = NULL;
+  if (!lr) {
+    ft = check_frozen_tape(L, 2);
+  } else if (!lr->reg) {
+    return luaL_error(L, "tape registry already released");
+  }
+  size_t length;
+  const char *input = check_input_slice(L, 3, 4, &length);
+
+  unsigned long version = 0;
+  if (lr) {
+    ft = registry_match_enter(L, lr, &version);
+  }
+
+  MatchCacheEntry *entry = match_cache_lookup(mc, ft->serial, input, length);
+  if (entry) {
+    if (lr) {
+      registry_match_leave(lr, ft);
+    }
+    push_cache_entry(L, mc, entry);
+  } else {
+    MatchObject mo;
+    WideMatchObject wmo;
+    frozen_match(ft, input, length, &mo, &wmo);
+    int kind = ft->kind;
+    unsigned long serial = ft->serial;
+    if (lr) {
+      registry_match_leave(lr, ft);
+    }
+    cache_frozen_match(L, mc, serial, input, length, kind, &mo, &wmo);
+  }
+
+  if (lr) {
+    lua_pushnumber(L, version);
+    return 4;
+  }
+  return 3;
+}
+
+/**
+ * Counters and sizes, in a table
+ */
+static int l_match_cache_stats(lua_State *L) {
+  MatchCache *mc = check_match_cache(L, 1);
+  lua_createtable(L, 0, 6);
+  lua_pushnumber(L, (lua_Number) mc->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, (lua_Number) mc->misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, (lua_Number) mc->evictions);
+  lua_setfield(L, -2, "evictions");
+  lua_pushnumber(L, (lua_Number) mc->clock_length);
+  lua_setfield(L, -2, "entries");
+  lua_pushnumber(L, (lua_Number) mc->bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, (lua_Number) mc->budget);
+  lua_setfield(L, -2, "budget");
+  return 1;
+}
+
+static int l_match_cache_clear(lua_State *L) {
+  match_cache_clear(check_match_cache(L, 1));
+  return 0;
+}
+
+static const struct luaL_Reg match_cache_methods[] = {
+    {"match_string", l_match_cache_match_string},
+    {"stats", l_match_cache_stats},
+    {"clear", l_match_cache_clear},
+    {NULL, NULL}};
+
+#define MATCHER_METATABLE "fst_fast.Matcher"
+
+/**
+ * Bytes a matcher step takes without a budget
+ */
+#define MATCHER_DEFAULT_STEP ((size_t) 64 * 1024)
+
+typedef struct LuaMatcher LuaMatcher;
+
+/**
+ * A match in progress, matched a slice at a time by step
+ */
+struct LuaMatcher {
+  /**
+   * The frozen tape matched on, holding a reference, so it outlives
+   * every Lua value between steps
+   */
+  FrozenTape *frozen;
+  int kind;
+  MatchObject mo;
+  WideMatchObject wmo;
+  /**
+   * Whether mo or wmo holds a match not yet handed to Lua
+   */
+  int live;
+
+  /**
+   * The input, kept alive by a reference to its string
+   */
+  const char *input;
+  size_t length;
+  size_t position;
+  int input_ref;
+};
+
+static LuaMatcher *check_matcher(lua_State *L, int arg) {
+  return (LuaMatcher *) luaL_checkudata(L, arg, MATCHER_METATABLE);
+}
+
+/*
+ * fst_fast.matcher(tape, input, offset, length)
+ *
+ * A match of input on a frozen tape that step() carries out a slice at
+ * a time, so a long input doesn't hold up everything else. Only frozen
+ * tapes are taken: a narrow tape could be destroyed while the match
+ * waits between steps, so freeze it first. From a coroutine run by an
+ * event loop:
+ *
+ *    local m = fst_fast.matcher(fst_fast.freeze_tape(tape), input)
+ *    local outstr, match_success, matched_states = m:step()
+ *    while not outstr do
+ *       coroutine.yield()
+ *       outstr, match_success, matched_states = m:step()
+ *    end
+ */
+static int l_matcher(lua_State *L) {
+  FrozenTape *ft = check_frozen_tape(L, 1);
+  size_t length;
+  const char *input = check_input_slice(L, 2, 3, &length);
+
+  LuaMatcher *m = (LuaMatcher *) lua_newuserdata(L, sizeof(LuaMatcher));
+  memset(m, 0, sizeof(LuaMatcher));
+  m->input_ref = LUA_NOREF;
+  luaL_setmetatable(L, MATCHER_METATABLE);
+
+  lua_pushvalue(L, 2);
+  m->input_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  m->input = input;
+  m->length = length;
+
+  frozen_tape_retain(ft);
+  m->frozen = ft;
+  m->kind = ft->kind;
+
+  if (m->kind == FROZEN_WIDE) {
+    wide_match_initialize(&m->wmo, &ft->wide);
+  } else if (m->kind == FROZEN_HYBRID) {
+    hybrid_match_initialize(&m->mo, &ft->hybrid);
+  } else {
+    match_initialize(&m->mo, &ft->narrow);
+  }
+  m->live = 1;
+  return 1;
+}
+
+/*
+ * matcher:step(budget)
+ *
+ * Match up to budget more bytes. Returns nothing while input is left,
+ * and what match_string returns once it has all been matched.
+ */
+static int l_matcher_step(lua_State *L) {
+  LuaMatcher *m = check_matcher(L, 1);
+  lua_Integer budget =
+      luaL_optinteger(L, 2, (lua_Integer) MATCHER_DEFAULT_STEP);
+  luaL_argcheck(L, budget > 0, 2, "budget must be positive");
+  if (!m->live) {
+    return luaL_error(L, "matcher already finished");
+  }
+
+  size_t slice = m->length - m->position;
+  if ((size_t) budget < slice) {
+    slice = (size_t) budget;
+  }
+  if (m->kind == FROZEN_WIDE) {
+    wide_match_continue(&m->wmo, m->input + m->position, slice);
+  } else if (m->kind == FROZEN_HYBRID) {
+    hybrid_match_continue(&m->mo, m->input + m->position, slice);
+  } else {
+    match_continue(&m->mo, m->input + m->position, slice);
+  }
+  m->position += slice;
+  if (m->position < m->length) {
+    return 0;
+  }
+
+  if (m->kind == FROZEN_WIDE) {
+    wide_match_finish(&m->frozen->wide, &m->wmo);
+  } else if (m->kind == FROZEN_HYBRID) {
+    hybrid_match_finish(&m->frozen->hybrid, &m->mo);
+  } else {
+    match_finish(&m->frozen->narrow, &m->mo);
+  }
+  m->live = 0;
+  push_frozen_match(L, m->kind, &m->mo, &m->wmo);
+  return 3;
+}
+
+/**
+ * Bytes matched so far, and the input's length
+ */
+static int l_matcher_position(lua_State *L) {
+  LuaMatcher *m = check_matcher(L, 1);
+  lua_pushnumber(L, m->position);
+  lua_pushnumber(L, m->length);
+  return 2;
+}
+
+static int l_matcher_gc(lua_State *L) {
+  LuaMatcher *m = check_matcher(L, 1);
+  if (m->live) {
+    if (m->kind == FROZEN_WIDE) {
+      wide_match_destroy(&m->wmo);
+    } else {
+      match_destroy(&m->mo);
+    }
+    m->live = 0;
+  }
+  if (m->frozen) {
+    frozen_tape_release(m->frozen);
+    m->frozen = NULL;
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, m->input_ref);
+  m->input_ref = LUA_NOREF;
+  return 0;
+}
+
+static const struct luaL_Reg matcher_methods[] = {
+    {"step", l_matcher_step},
+    {"position", l_matcher_position},
+    {NULL, NULL}};
+
+/*
+ * fst_fast.match_file(tape, path, opts)
+ *
+ * Matches every byte of the file at path, returning what match_string
+ * returns. tape is a frozen tape or a narrow tape; opts.wide says it is
+ * a wide tape instead, and opts.threads > 1 matches a narrow tape with
+ * match_string_parallel.
+ */
+static int l_match_file(lua_State *L) {
+  int frozen = luaL_testudata(L, 1, FROZEN_TAPE_METATABLE) != NULL;
+  const char *path = luaL_checkstring(L, 2);
+  int wide = 0;
+  int threads = 1;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "wide");
+    wide = lua_toboolean(L, -1);
+    lua_getfield(L, 3, "threads");
+    threads = luaL_optint(L, -1, 1);
+    lua_pop(L, 2);
+  }
+
+  InstructionTape *it;
+  WideInstructionTape *wit;
+  HybridTape *ht = NULL;
+  if (frozen) {
+    FrozenTape *ft = check_frozen_tape(L, 1);
+    wide = ft->kind == FROZEN_WIDE;
+    it = &ft->narrow;
+    wit = &ft->wide;
+    if (ft->kind == FROZEN_HYBRID) {
+      ht = &ft->hybrid;
+    }
+  } else {
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+    it = (InstructionTape *) lua_touserdata(L, 1);
+    wit = (WideInstructionTape *) lua_touserdata(L, 1);
+  }
+
+  MatchObject mo;
+  WideMatchObject wmo;
+  int status;
+  if (ht) {
+    status = hybrid_match_file(ht, &mo, path);
+  } else if (wide) {
+    status = wide_match_file(wit, &wmo, path);
+  } else {
+    status = match_file(it, &mo, path, threads);
+  }
+  if (status < 0) {
+    return luaL_error(L, "Could not read %s: %s", path, strerror(errno));
+  }
+  push_frozen_match(L, wide ? FROZEN_WIDE : FROZEN_NARROW, &mo, &wmo);
+  return 3;
+}
+
+static const struct luaL_Reg fst_fast_system[] = {
+    {"c_swap", c_swap},
+    {"get_instruction_tape", l_get_instruction_tape},
+    {"create_pegreg_diffmatch", l_create_pegreg_diffmatch},
+    {"match_string", l_match_string},
+    {"match_string_parallel", l_match_string_parallel},
+    {"match_file", l_match_file},
+    {"instruction_tape_destroy", l_instruction_tape_destroy},
+    {"fse_clear_instr", l_fse_clear_instr},
+    {"fse_set_initial_flags", l_fse_set_initial_flags},
+    {"fse_get_outgoing", l_fse_get_outgoing},
+    {"fse_set_outstate", l_fse_set_outstate},
+    {"fse_set_outchar", l_fse_set_outchar},
+    {"fse_finish", l_fse_finish},
+    {"fse_set_final_flags", l_fse_set_final_flags},
+    {"inspector_dumpfile", l_inspector_dumpfile},
+    {"inspector_is_final", l_inspector_is_final},
+    {"inspector_is_valid", l_inspector_is_valid},
+    {"inspector_loadfile", l_inspector_loadfile},
+    {"inspector_outgoings", l_inspector_outgoings},
+    {"inspector_analyze", l_inspector_analyze},
+    {"inspector_get_length", l_inspector_get_length},
+    {"inspector_is_initial", l_inspector_is_initial},
+    {"get_wide_instruction_tape", l_get_wide_instruction_tape},
+    {"wide_instruction_tape_destroy", l_wide_instruction_tape_destroy},
+    {"fwe_clear_instr", l_fwe_clear_instr},
+    {"fwe_set_initial_flags", l_fwe_set_initial_flags},
+    {"fwe_set_final_flags", l_fwe_set_final_flags},
+    {"fwe_get_outgoing", l_fwe_get_outgoing},
+    {"fwe_set_outstate", l_fwe_set_outstate},
+    {"fwe_set_output", l_fwe_set_output},
+    {"fwe_finish", l_fwe_finish},
+    {"wide_match_string", l_wide_match_string},
+    {"wide_inspector_get_length", l_wide_inspector_get_length},
+    {"wide_inspector_dumpfile", l_wide_inspector_dumpfile},
+    {"wide_inspector_loadfile", l_wide_inspector_loadfile},
+    {"build_tape", l_build_tape},
+    {"build_dictionary", l_build_dictionary},
+    {"build_utf8_tape", l_build_utf8_tape},
+    {"compact_dumpfile", l_compact_dumpfile},
+    {"compact_loadfile", l_compact_loadfile},
+    {"wide_compact_dumpfile", l_wide_compact_dumpfile},
+    {"wide_compact_loadfile", l_wide_compact_loadfile},
+    {"wide_from_narrow", l_wide_from_narrow},
+    {"narrow_from_wide", l_narrow_from_wide},
+    {"compose", l_compose},
+    {"intersect", l_intersect},
+    {"union", l_union},
+    {"wide_compose", l_wide_compose},
+    {"wide_intersect", l_wide_intersect},
+    {"wide_union", l_wide_union},
+    {"fse_freeze", l_fse_freeze},
+    {"fwe_freeze", l_fwe_freeze},
+    {"freeze_tape", l_freeze_tape},
+    {"freeze_wide_tape", l_freeze_wide_tape},
+    {"freeze_hybrid_tape", l_freeze_hybrid_tape},
+    {"import_tape", l_import_tape},
+    {"tape_registry", l_tape_registry},
+    {"import_registry", l_import_registry},
+    {"discard_export", l_discard_export},
+    {"match_cache", l_match_cache},
+    {"matcher", l_matcher},
+    {NULL, NULL}};
+
+int luaopen_fst_fast_system(lua_State *L) {
+  if (luaL_newmetatable(L, FROZEN_TAPE_METATABLE)) {
+    luaL_newlib(L, frozen_tape_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_frozen_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_pop(L, 1);
+  if (luaL_newmetatable(L, TAPE_REGISTRY_METATABLE)) {
+    luaL_newlib(L, tape_registry_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_registry_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_pop(L, 1);
+  if (luaL_newmetatable(L, MATCH_CACHE_METATABLE)) {
+    luaL_newlib(L, match_cache_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_match_cache_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_pop(L, 1);
+  if (luaL_newmetatable(L, MATCHER_METATABLE)) {
+    luaL_newlib(L, matcher_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_matcher_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_pop(L, 1);
+  luaL_newlib(L, fst_fast_system);
+  return 1;
+}
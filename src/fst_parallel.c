@@ -0,0 +1,278 @@
+/**
+ * Speculative parallel matching of a single input
+ * @file fst_parallel.c
+ */
+#include "fst_parallel.h"
+#include "fst_fast.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+typedef struct ParallelChunk ParallelChunk;
+
+struct ParallelChunk {
+  InstructionTape *instrtape;
+  const unsigned char *input;
+  size_t length;
+
+  /**
+   * Chunk 0 only: match for real straight away
+   */
+  int known_start;
+
+  /**
+   * end_state[s] is where the chunk ends when started in s
+   */
+  unsigned short *end_state;
+
+  /**
+   * Whether the chunk gave up speculating
+   */
+  int too_live;
+
+  unsigned short start;
+  MatchObject match_object;
+};
+
+static void *xmalloc(size_t size) {
+  void *p = malloc(MAX(size, 1));
+  if (!p) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  return p;
+}
+
+static size_t parallel_find(unsigned int *parent, size_t run) {
+  while (parent[run] != run) {
+    parent[run] = parent[parent[run]];
+    run = parent[run];
+  }
+  return run;
+}
+
+/**
+ * Run the chunk from every state at once. Run s starts in state s;
+ * runs that reach the same state are merged and move on as one.
+ */
+static void parallel_transfer(ParallelChunk *chunk) {
+  size_t n = chunk->instrtape->length;
+  FstStateEntry *states = (FstStateEntry *) chunk->instrtape->beginning;
+
+  unsigned int *parent = (unsigned int *) xmalloc(n * sizeof(unsigned int));
+  unsigned short *current =
+      (unsigned short *) xmalloc(n * sizeof(unsigned short));
+  unsigned int *live = (unsigned int *) xmalloc(n * sizeof(unsigned int));
+  /* Which live run holds a state in the current step */
+  size_t *seen = (size_t *) calloc(MAX(n, 1), sizeof(size_t));
+  unsigned int *holder = (unsigned int *) xmalloc(n * sizeof(unsigned int));
+  if (!seen) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+
+  for (size_t s = 0; s < n; s++) {
+    parent[s] = s;
+    current[s] = s;
+    live[s] = s;
+  }
+  size_t live_count = n;
+  size_t budget = chunk->length * PARALLEL_WORK_FACTOR;
+  size_t work = 0;
+
+  for (size_t i = 0; i < chunk->length; i++) {
+    work += live_count;
+    if (work > budget ||
+        (i >= PARALLEL_LIVE_WINDOW && live_count > PARALLEL_LIVE_LIMIT)) {
+      chunk->too_live = 1;
+      break;
+    }
+    unsigned char c = chunk->input[i];
+    size_t step = i + 1;
+    size_t kept = 0;
+    for (size_t k = 0; k < live_count; k++) {
+      unsigned int run = live[k];
+      unsigned short next = states[(size_t) current[run] * 256 + c]
+                                .components.out_state;
+      if (seen[next] == step) {
+        parent[run] = holder[next];
+      } else {
+        seen[next] = step;
+        holder[next] = run;
+        current[run] = next;
+        live[kept] = run;
+        kept += 1;
+      }
+    }
+    live_count = kept;
+  }
+
+  if (!chunk->too_live) {
+    for (size_t s = 0; s < n; s++) {
+      chunk->end_state[s] = current[parallel_find(parent, s)];
+    }
+  }
+
+  free(parent);
+  free(current);
+  free(live);
+  free(seen);
+  free(holder);
+}
+
+static void parallel_match_chunk(ParallelChunk *chunk) {
+  MatchObject *mo = &chunk->match_object;
+  match_initialize(mo, chunk->instrtape);
+  mo->current = mo->beginning + (size_t) chunk->start * sizeof(FstStateEntry) *
+                                    256;
+  match_grow_states(mo, chunk->length + 1);
+  for (size_t i = 0; i < chunk->length; i++) {
+    match_one_char(mo, (char) chunk->input[i]);
+  }
+}
+
+static void *parallel_speculate(void *arg) {
+  ParallelChunk *chunk = (ParallelChunk *) arg;
+  if (chunk->known_start) {
+    parallel_match_chunk(chunk);
+  } else {
+    parallel_transfer(chunk);
+  }
+  return NULL;
+}
+
+static void *parallel_finish(void *arg) {
+  ParallelChunk *chunk = (ParallelChunk *) arg;
+  if (!chunk->known_start) {
+    parallel_match_chunk(chunk);
+  }
+  return NULL;
+}
+
+/**
+ * Run fn over every chunk, chunk 0 on this thread
+ */
+static void parallel_run(ParallelChunk *chunks, int count,
+                         void *(*fn)(void *)) {
+  pthread_t *workers = (pthread_t *) xmalloc(count * sizeof(pthread_t));
+  int *started = (int *) calloc(count, sizeof(int));
+  if (!started) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  for (int i = 1; i < count; i++) {
+    started[i] = pthread_create(workers + i, NULL, fn, chunks + i) == 0;
+  }
+  for (int i = 0; i < count; i++) {
+    if (!started[i]) {
+      fn(chunks + i);
+    }
+  }
+  for (int i = 1; i < count; i++) {
+    if (started[i]) {
+      pthread_join(workers[i], NULL);
+    }
+  }
+  free(started);
+  free(workers);
+}
+
+/**
+ * Match length bytes of input on up to threads threads
+ * @param instrtape the instruction tape
+ * @param match object the match object to be filled in
+ * @param input the input, NUL bytes included
+ * @param length the number of bytes to match
+ * @param threads how many threads to use
+ * @return the number of chunks matched in parallel, 1 if the input was
+ * matched sequentially
+ */
+int match_string_parallel(InstructionTape *instrtape,
+                          MatchObject *match_object, const char *input,
+                          size_t length, int threads) {
+  fse_freeze_arena(instrtape);
+  size_t n = instrtape->length;
+  if (threads < 2 || n == 0 ||
+      length < (size_t) threads * PARALLEL_MIN_CHUNK) {
+    match_bytes(instrtape, match_object, input, length);
+    return 1;
+  }
+
+  ParallelChunk *chunks =
+      (ParallelChunk *) calloc(threads, sizeof(ParallelChunk));
+  if (!chunks) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  for (int i = 0; i < threads; i++) {
+    size_t begin = length * i / threads;
+    size_t end = length * (i + 1) / threads;
+    chunks[i].instrtape = instrtape;
+    chunks[i].input = (const unsigned char *) input + begin;
+    chunks[i].length = end - begin;
+    chunks[i].known_start = i == 0;
+    chunks[i].start = 0;
+    if (i > 0) {
+      chunks[i].end_state =
+          (unsigned short *) xmalloc(n * sizeof(unsigned short));
+    }
+  }
+
+  parallel_run(chunks, threads, parallel_speculate);
+
+  int too_live = 0;
+  for (int i = 1; i < threads; i++) {
+    too_live |= chunks[i].too_live;
+  }
+
+  if (!too_live) {
+    /* Chunk i starts where chunk i - 1 ends */
+    unsigned short state = 0;
+    if (chunks[0].match_object.state_length > 0) {
+      state = chunks[0].match_object.state_output
+                  [chunks[0].match_object.state_length - 1];
+    }
+    for (int i = 1; i < threads; i++) {
+      chunks[i].start = state;
+      state = chunks[i].end_state[state];
+    }
+    parallel_run(chunks, threads, parallel_finish);
+
+    size_t char_length = 0;
+    size_t state_length = 0;
+    for (int i = 0; i < threads; i++) {
+      char_length += chunks[i].match_object.char_length;
+      state_length += chunks[i].match_object.state_length;
+    }
+
+    /* Chunk 0's buffers become the result */
+    *match_object = chunks[0].match_object;
+    match_grow_char(match_object, char_length + 1);
+    match_grow_states(match_object, state_length + 1);
+    for (int i = 1; i < threads; i++) {
+      MatchObject *part = &chunks[i].match_object;
+      memcpy(match_object->char_end, part->char_output, part->char_length);
+      match_object->char_end += part->char_length;
+      match_object->char_length += part->char_length;
+      memcpy(match_object->state_end, part->state_output,
+             part->state_length * sizeof(unsigned short));
+      match_object->state_end += part->state_length;
+      match_object->state_length += part->state_length;
+      match_object->current = part->current;
+      match_destroy(part);
+    }
+    match_finish(instrtape, match_object);
+  } else {
+    match_destroy(&chunks[0].match_object);
+    match_bytes(instrtape, match_object, input, length);
+  }
+
+  for (int i = 1; i < threads; i++) {
+    free(chunks[i].end_state);
+  }
+  free(chunks);
+  return too_live ? 1 : threads;
+}
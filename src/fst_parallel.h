@@ -0,0 +1,48 @@
+#ifndef FST_PARALLEL_H
+#define FST_PARALLEL_H
+
+#include "fst_fast.h"
+
+/*
+ * Speculative data parallel matching of one long input.
+ *
+ * The input is cut into one chunk per thread. Chunk 0 is matched from
+ * the start state right away. Every other chunk is first run from all
+ * states at once, merging runs that meet in the same state, which
+ * gives the state the chunk ends in for each state it might start in.
+ * Stitching those in order gives each chunk's real start state, and
+ * the chunks are then matched for real in parallel and their outputs
+ * and traces joined.
+ *
+ * The match object ends up exactly as match_string would leave it. If
+ * the tape keeps more than PARALLEL_LIVE_LIMIT runs apart for long, or
+ * the input is short, matching is plain sequential.
+ *
+ * Speculating costs a step per live run per byte, so a chunk gives up
+ * as soon as its steps pass PARALLEL_WORK_FACTOR times its length. A
+ * tape whose runs never meet then costs that much on top of the
+ * sequential match, however many states it has.
+ */
+
+/**
+ * Runs still apart after PARALLEL_LIVE_WINDOW bytes of a chunk that make
+ * the chunk not worth speculating on
+ */
+#define PARALLEL_LIVE_LIMIT 64
+#define PARALLEL_LIVE_WINDOW 4096
+
+/**
+ * Steps speculating on a chunk may take, as a multiple of its length
+ */
+#define PARALLEL_WORK_FACTOR 16
+
+/**
+ * Inputs shorter than this per thread are matched sequentially
+ */
+#define PARALLEL_MIN_CHUNK 65536
+
+int match_string_parallel(InstructionTape *instrtape,
+                          MatchObject *match_object, const char *input,
+                          size_t length, int threads);
+
+#endif /* FST_PARALLEL_H */
@@ -0,0 +1,302 @@
+/**
+ * Composition, intersection and union of tapes
+ * @file fst_product.c
+ */
+#include "fst_product.h"
+#include "fst_fast.h"
+#include "fst_wide.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define PRODUCT_COMPOSE 0
+#define PRODUCT_INTERSECT 1
+#define PRODUCT_UNION 2
+
+/**
+ * A pair of operand states, plus whether b has read anything yet
+ * (composition only), packed as a | b << 32 | started << 63
+ */
+typedef uint64_t ProductKey;
+
+#define PRODUCT_STARTED ((uint64_t) 1 << 63)
+
+typedef struct ProductMap ProductMap;
+
+struct ProductMap {
+  /**
+   * Open addressing, key + 1 so that 0 marks an empty slot
+   */
+  uint64_t *keys;
+  unsigned int *states;
+  size_t capacity;
+
+  /**
+   * keys in the order they were numbered, i.e. the work list
+   */
+  ProductKey *order;
+  size_t length;
+  size_t order_capacity;
+};
+
+static void product_map_initialize(ProductMap *map) {
+  map->capacity = 1024;
+  map->keys = (uint64_t *) calloc(map->capacity, sizeof(uint64_t));
+  map->states = (unsigned int *) malloc(map->capacity * sizeof(unsigned int));
+  map->order_capacity = 1024;
+  map->order = (ProductKey *) malloc(map->order_capacity * sizeof(ProductKey));
+  map->length = 0;
+  if (!map->keys || !map->states || !map->order) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+}
+
+static void product_map_destroy(ProductMap *map) {
+  free(map->keys);
+  free(map->states);
+  free(map->order);
+}
+
+static size_t product_hash(ProductKey key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (size_t) key;
+}
+
+static void product_map_put(ProductMap *map, ProductKey key,
+                            unsigned int state) {
+  size_t mask = map->capacity - 1;
+  size_t slot = product_hash(key) & mask;
+  while (map->keys[slot]) {
+    slot = (slot + 1) & mask;
+  }
+  map->keys[slot] = key + 1;
+  map->states[slot] = state;
+}
+
+/**
+ * Number key, giving it the next state if it hasn't got one
+ * @return the state, or -1 if the result would exceed 2^32 states
+ */
+static long long product_state(ProductMap *map, ProductKey key) {
+  size_t mask = map->capacity - 1;
+  for (size_t slot = product_hash(key) & mask; map->keys[slot];
+       slot = (slot + 1) & mask) {
+    if (map->keys[slot] == key + 1) {
+      return map->states[slot];
+    }
+  }
+
+  if (map->length >= 0xffffffffULL) {
+    return -1;
+  }
+
+  if ((map->length + 1) * 2 > map->capacity) {
+    uint64_t *old_keys = map->keys;
+    unsigned int *old_states = map->states;
+    size_t old_capacity = map->capacity;
+    map->capacity *= 2;
+    map->keys = (uint64_t *) calloc(map->capacity, sizeof(uint64_t));
+    map->states =
+        (unsigned int *) malloc(map->capacity * sizeof(unsigned int));
+    if (!map->keys || !map->states) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old_keys[i]) {
+        product_map_put(map, old_keys[i] - 1, old_states[i]);
+      }
+    }
+    free(old_keys);
+    free(old_states);
+  }
+
+  if (map->length >= map->order_capacity) {
+    map->order_capacity *= 2;
+    map->order = (ProductKey *) realloc(
+        map->order, map->order_capacity * sizeof(ProductKey));
+    if (!map->order) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+  }
+
+  unsigned int state = (unsigned int) map->length;
+  map->order[map->length] = key;
+  map->length += 1;
+  product_map_put(map, key, state);
+  return state;
+}
+
+static int product_is_final(WideInstructionTape *it, unsigned int state) {
+  return it->beginning[(size_t) state * 256].flags & FST_FLAG_FINAL;
+}
+
+/**
+ * Output of one result transition, built up from the operands' outputs
+ */
+typedef struct ProductOutput ProductOutput;
+
+struct ProductOutput {
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
+static void product_output_append(ProductOutput *out, const char *data,
+                                  size_t length) {
+  if (out->capacity < out->length + length) {
+    out->capacity = MAX(out->capacity * 2, out->length + length);
+    out->data = (char *) realloc(out->data, out->capacity);
+    if (!out->data) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+  }
+  memcpy(out->data + out->length, data, length);
+  out->length += length;
+}
+
+static WideInstructionTape *product_build(WideInstructionTape *a,
+                                          WideInstructionTape *b, int mode) {
+  if (a->length == 0 || b->length == 0) {
+    return NULL;
+  }
+  fwe_freeze_arena(a);
+  fwe_freeze_arena(b);
+
+  WideInstructionTape *result =
+      (WideInstructionTape *) malloc(sizeof(WideInstructionTape));
+  fwe_initialize_arena_tape(result);
+
+  ProductMap map;
+  product_map_initialize(&map);
+  product_state(&map, 0);
+
+  ProductOutput out = {NULL, 0, 0};
+  int failed = 0;
+
+  for (size_t state = 0; state < map.length && !failed; state++) {
+    ProductKey key = map.order[state];
+    unsigned int qa = (unsigned int) (key & 0xffffffffULL);
+    unsigned int qb = (unsigned int) ((key >> 32) & 0x7fffffffULL);
+    int started = (key & PRODUCT_STARTED) != 0;
+
+    fwe_clear_instr(result, 0);
+    if (state == 0) {
+      fwe_set_initial_flags(result);
+    }
+    int final_a = product_is_final(a, qa);
+    int final_b = product_is_final(b, qb);
+    if ((mode == PRODUCT_COMPOSE && final_a && started && final_b) ||
+        (mode == PRODUCT_INTERSECT && final_a && final_b) ||
+        (mode == PRODUCT_UNION && (final_a || final_b))) {
+      fwe_set_final_flags(result);
+    }
+
+    FstWideEntry *row = result->current;
+    FstWideEntry *row_a = a->beginning + (size_t) qa * 256;
+    FstWideEntry *row_b = b->beginning + (size_t) qb * 256;
+    /* Rows mostly repeat one output, so reuse the previous copy */
+    size_t last_offset = 0;
+    size_t last_length = 0;
+
+    for (int c = 0; c < 256; c++) {
+      FstWideEntry *ea = row_a + c;
+      unsigned int next_a = ea->out_state;
+      unsigned int next_b;
+      int next_started = started;
+      const char *output = a->output_pool + ea->out_offset;
+      size_t output_length = ea->out_length;
+
+      if (mode == PRODUCT_COMPOSE) {
+        /* Run a's output through b */
+        next_b = qb;
+        out.length = 0;
+        for (size_t i = 0; i < ea->out_length; i++) {
+          FstWideEntry *eb = b->beginning + (size_t) next_b * 256 +
+                             (unsigned char) output[i];
+          product_output_append(&out, b->output_pool + eb->out_offset,
+                                eb->out_length);
+          next_b = eb->out_state;
+          next_started = 1;
+          if (next_b >= b->length) {
+            break;
+          }
+        }
+        output = out.data;
+        output_length = out.length;
+      } else {
+        next_b = row_b[c].out_state;
+      }
+
+      if (next_a >= a->length || next_b >= b->length || next_b > 0x7fffffff) {
+        failed = 1;
+        break;
+      }
+      ProductKey next = (ProductKey) next_a | (ProductKey) next_b << 32 |
+                        (next_started ? PRODUCT_STARTED : 0);
+      long long target = product_state(&map, next);
+      if (target < 0) {
+        failed = 1;
+        break;
+      }
+
+      FstWideEntry *fwe = row + c;
+      fwe_set_outstate(fwe, (unsigned int) target);
+      if (output_length && output_length == last_length &&
+          memcmp(result->output_pool + last_offset, output, output_length) ==
+              0) {
+        fwe_set_pooled_output(result, fwe, last_offset, output_length);
+      } else {
+        fwe_set_output(result, fwe, output, output_length);
+        if (output_length) {
+          last_offset = fwe->out_offset;
+          last_length = output_length;
+        }
+      }
+    }
+    fwe_finish(result);
+  }
+
+  free(out.data);
+  product_map_destroy(&map);
+  if (failed) {
+    wide_instruction_tape_destroy(result);
+    free(result);
+    return NULL;
+  }
+  fwe_freeze(result);
+  return result;
+}
+
+/**
+ * a then b, as one tape
+ * @return NULL if a tape is empty, broken, or the result too big
+ */
+WideInstructionTape *wide_compose(WideInstructionTape *a,
+                                  WideInstructionTape *b) {
+  return product_build(a, b, PRODUCT_COMPOSE);
+}
+
+/**
+ * Accepts what both a and b accept, with a's output
+ */
+WideInstructionTape *wide_intersect(WideInstructionTape *a,
+                                    WideInstructionTape *b) {
+  return product_build(a, b, PRODUCT_INTERSECT);
+}
+
+/**
+ * Accepts what either a or b accepts, with a's output
+ */
+WideInstructionTape *wide_union(WideInstructionTape *a,
+                                WideInstructionTape *b) {
+  return product_build(a, b, PRODUCT_UNION);
+}
@@ -0,0 +1,33 @@
+#ifndef FST_PRODUCT_H
+#define FST_PRODUCT_H
+
+#include "fst_wide.h"
+
+/*
+ * Product constructions over wide tapes.
+ *
+ * States of the result are pairs of operand states, numbered in the
+ * order a breadth first walk from the pair of start states reaches
+ * them, so only reachable pairs are ever built. The result's start
+ * state is 0, like any tape.
+ *
+ * wide_compose(a, b) is a then b: each input byte steps a, and a's
+ * output for it is run through b. The result emits b's output and
+ * accepts iff a accepts and b, having read at least one byte, accepts;
+ * exactly what matching the input with a and then a's output with b
+ * reports.
+ *
+ * wide_intersect(a, b) and wide_union(a, b) step a and b on the same
+ * input and accept iff both, or either, accept. Their output is a's.
+ */
+
+WideInstructionTape *wide_compose(WideInstructionTape *a,
+                                  WideInstructionTape *b);
+
+WideInstructionTape *wide_intersect(WideInstructionTape *a,
+                                    WideInstructionTape *b);
+
+WideInstructionTape *wide_union(WideInstructionTape *a,
+                                WideInstructionTape *b);
+
+#endif /* FST_PRODUCT_H */
@@ -0,0 +1,303 @@
+/**
+ * Versioned tape registry with epoch based reclamation
+ * @file fst_registry.c
+ */
+#include "fst_registry.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/**
+ * @return a registry with no tape yet, holding one reference
+ */
+TapeRegistry *registry_create(void) {
+  TapeRegistry *reg = (TapeRegistry *) calloc(1, sizeof(TapeRegistry));
+  if (!reg) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  /* 0 marks a reader that isn't in */
+  reg->epoch = 1;
+  reg->refcount = 1;
+  reg->magic = REGISTRY_MAGIC;
+  pthread_mutex_init(&reg->lock, NULL);
+  return reg;
+}
+
+void registry_retain(TapeRegistry *reg) {
+  __atomic_fetch_add(&reg->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void registry_version_destroy(RegistryVersion *rv) {
+  frozen_tape_release(rv->tape);
+  free(rv);
+}
+
+/**
+ * Drop a reference, freeing the registry and the tape references it
+ * holds with the last one. No reader may be in by then.
+ */
+void registry_release(TapeRegistry *reg) {
+  if (__atomic_sub_fetch(&reg->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  if (reg->current) {
+    registry_version_destroy(reg->current);
+  }
+  for (size_t i = 0; i < reg->retired_length; i++) {
+    registry_version_destroy(reg->retired[i]);
+  }
+  free(reg->retired);
+  pthread_mutex_destroy(&reg->lock);
+  reg->magic = 0;
+  free(reg);
+}
+
+/**
+ * The lowest epoch a reader is in at, or ~0 if none is in
+ */
+static unsigned long registry_oldest_reader(TapeRegistry *reg) {
+  unsigned long oldest = ~0UL;
+  for (int i = 0; i < REGISTRY_MAX_READERS; i++) {
+    unsigned long epoch =
+        __atomic_load_n(&reg->readers[i].epoch, __ATOMIC_SEQ_CST);
+    if (epoch && epoch < oldest) {
+      oldest = epoch;
+    }
+  }
+  return oldest;
+}
+
+/* Lock held */
+static void registry_reclaim_locked(TapeRegistry *reg) {
+  unsigned long oldest = registry_oldest_reader(reg);
+  size_t kept = 0;
+  for (size_t i = 0; i < reg->retired_length; i++) {
+    RegistryVersion *rv = reg->retired[i];
+    if (rv->retired_epoch <= oldest) {
+      registry_version_destroy(rv);
+    } else {
+      reg->retired[kept] = rv;
+      kept += 1;
+    }
+  }
+  __atomic_store_n(&reg->retired_length, kept, __ATOMIC_RELAXED);
+}
+
+/**
+ * Make ft the current tape. The registry takes over one reference to
+ * it; the old tape is released once no reader can still be on it.
+ * @return the new version number, counting from 1
+ */
+unsigned long registry_publish(TapeRegistry *reg, FrozenTape *ft) {
+  RegistryVersion *rv = (RegistryVersion *) malloc(sizeof(RegistryVersion));
+  if (!rv) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  rv->tape = ft;
+  rv->retired_epoch = 0;
+
+  pthread_mutex_lock(&reg->lock);
+  reg->version += 1;
+  rv->version = reg->version;
+  RegistryVersion *old =
+      __atomic_exchange_n(&reg->current, rv, __ATOMIC_SEQ_CST);
+  unsigned long epoch =
+      __atomic_add_fetch(&reg->epoch, 1, __ATOMIC_SEQ_CST);
+
+  if (old) {
+    if (reg->retired_length >= reg->retired_capacity) {
+      reg->retired_capacity = MAX(reg->retired_capacity * 2, 4);
+      reg->retired = (RegistryVersion **) realloc(
+          reg->retired, reg->retired_capacity * sizeof(RegistryVersion *));
+      if (!reg->retired) {
+        perror("Memory allocation failure");
+        exit(1);
+      }
+    }
+    old->retired_epoch = epoch;
+    reg->retired[reg->retired_length] = old;
+    __atomic_store_n(&reg->retired_length, reg->retired_length + 1,
+                     __ATOMIC_RELAXED);
+  }
+  registry_reclaim_locked(reg);
+  pthread_mutex_unlock(&reg->lock);
+  return rv->version;
+}
+
+/**
+ * Release whatever retired tapes no reader is on any more
+ */
+void registry_reclaim(TapeRegistry *reg) {
+  pthread_mutex_lock(&reg->lock);
+  registry_reclaim_locked(reg);
+  pthread_mutex_unlock(&reg->lock);
+}
+
+/**
+ * Claim a reader slot, once per reading thread
+ * @return the slot, or -1 if all are taken
+ */
+int registry_reader_register(TapeRegistry *reg) {
+  for (int i = 0; i < REGISTRY_MAX_READERS; i++) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&reg->readers[i].in_use, &expected, 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void registry_reader_unregister(TapeRegistry *reg, int slot) {
+  __atomic_store_n(&reg->readers[slot].epoch, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&reg->readers[slot].in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Pin the current tape until registry_leave. Lock free.
+ * @param version set to the tape's version if not NULL
+ * @return the tape, or NULL if nothing was published yet
+ */
+FrozenTape *registry_enter(TapeRegistry *reg, int slot,
+                           unsigned long *version) {
+  unsigned long epoch = __atomic_load_n(&reg->epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&reg->readers[slot].epoch, epoch, __ATOMIC_SEQ_CST);
+  RegistryVersion *rv = __atomic_load_n(&reg->current, __ATOMIC_SEQ_CST);
+  if (!rv) {
+    if (version) {
+      *version = 0;
+    }
+    return NULL;
+  }
+  if (version) {
+    *version = rv->version;
+  }
+  return rv->tape;
+}
+
+/**
+ * The current tape for a reader already between registry_enter and
+ * registry_leave, which keeps it pinned as well. Lock free.
+ * @return the tape, or NULL if nothing was published yet
+ */
+FrozenTape *registry_current(TapeRegistry *reg, unsigned long *version) {
+  RegistryVersion *rv = __atomic_load_n(&reg->current, __ATOMIC_SEQ_CST);
+  if (version) {
+    *version = rv ? rv->version : 0;
+  }
+  return rv ? rv->tape : NULL;
+}
+
+/**
+ * Unpin the tape registry_enter returned, reclaiming retired tapes if
+ * there are any and the lock is free. Never waits.
+ */
+void registry_leave(TapeRegistry *reg, int slot) {
+  __atomic_store_n(&reg->readers[slot].epoch, 0, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&reg->retired_length, __ATOMIC_RELAXED) > 0 &&
+      pthread_mutex_trylock(&reg->lock) == 0) {
+    registry_reclaim_locked(reg);
+    pthread_mutex_unlock(&reg->lock);
+  }
+}
+
+/**
+ * A reference of one's own to the current tape, for holding on past a
+ * single match. Takes the lock.
+ * @return the tape, to be released by the caller, or NULL
+ */
+FrozenTape *registry_acquire(TapeRegistry *reg, unsigned long *version) {
+  pthread_mutex_lock(&reg->lock);
+  RegistryVersion *rv = __atomic_load_n(&reg->current, __ATOMIC_SEQ_CST);
+  FrozenTape *ft = NULL;
+  if (version) {
+    *version = rv ? rv->version : 0;
+  }
+  if (rv) {
+    ft = rv->tape;
+    frozen_tape_retain(ft);
+  }
+  pthread_mutex_unlock(&reg->lock);
+  return ft;
+}
+
+/**
+ * @return the version last published, 0 if none was
+ */
+unsigned long registry_current_version(TapeRegistry *reg) {
+  pthread_mutex_lock(&reg->lock);
+  unsigned long version = reg->version;
+  pthread_mutex_unlock(&reg->lock);
+  return version;
+}
+
+/**
+ * Exports not yet imported, guarded by registry_exports_lock
+ */
+static TapeRegistry **registry_exports = NULL;
+static size_t registry_exports_length = 0;
+static size_t registry_exports_capacity = 0;
+static pthread_mutex_t registry_exports_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Make a new reference to reg for another thread or Lua state to take
+ * over with registry_import
+ * @return the export's token
+ */
+void *registry_export(TapeRegistry *reg) {
+  registry_retain(reg);
+  pthread_mutex_lock(&registry_exports_lock);
+  if (registry_exports_length == registry_exports_capacity) {
+    size_t capacity = MAX(registry_exports_capacity * 2, 8);
+    TapeRegistry **exports = (TapeRegistry **) realloc(
+        registry_exports, capacity * sizeof(TapeRegistry *));
+    if (!exports) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+    registry_exports = exports;
+    registry_exports_capacity = capacity;
+  }
+  registry_exports[registry_exports_length++] = reg;
+  pthread_mutex_unlock(&registry_exports_lock);
+  return reg;
+}
+
+/**
+ * Take over the reference of a pending export, as frozen_tape_import
+ * @return the registry, or NULL if token is not a pending export
+ */
+TapeRegistry *registry_import(void *token) {
+  TapeRegistry *reg = NULL;
+  pthread_mutex_lock(&registry_exports_lock);
+  for (size_t i = 0; i < registry_exports_length; i++) {
+    if (registry_exports[i] == token) {
+      reg = registry_exports[i];
+      registry_exports[i] = registry_exports[--registry_exports_length];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&registry_exports_lock);
+  if (reg && reg->magic != REGISTRY_MAGIC) {
+    fprintf(stderr, "Tape registry export is corrupt\n");
+    exit(1);
+  }
+  return reg;
+}
+
+/**
+ * Drop the reference of an export that will never be imported
+ * @return 1 if token was a pending export, 0 otherwise
+ */
+int registry_discard_export(void *token) {
+  TapeRegistry *reg = registry_import(token);
+  if (!reg) {
+    return 0;
+  }
+  registry_release(reg);
+  return 1;
+}
@@ -0,0 +1,124 @@
+#ifndef FST_REGISTRY_H
+#define FST_REGISTRY_H
+
+#include "fst_frozen.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+/*
+ * Tape registry: the current version of a frozen tape, swapped
+ * atomically under readers that never take a lock.
+ *
+ * Epoch based reclamation. A reader claims a slot once, then brackets
+ * every match with registry_enter / registry_leave, which only write
+ * the global epoch into its slot and clear it again. Publishing swaps
+ * the current tape, bumps the global epoch to E and retires the old
+ * tape at E. A retired tape loses the registry's reference once no
+ * slot shows an epoch below E, i.e. once every reader that might have
+ * seen it has left; frozen tape references held elsewhere keep it
+ * alive past that.
+ *
+ * Publishing is serialized by a mutex and does the reclaiming, so
+ * matchers never wait on a reload and a reload never waits on them. A
+ * reader leaving while tapes are retired also reclaims, if it gets the
+ * mutex without waiting, so the last reader on an old tape frees it
+ * rather than the next publish.
+ *
+ * Registries cross to other threads or Lua states as single use
+ * exports, as frozen tapes do (fst_frozen.h).
+ */
+
+/**
+ * "FSTR", in every live registry
+ */
+#define REGISTRY_MAGIC 0x52545346u
+
+/**
+ * Number of reader slots, readers past this take the slow path in
+ * registry_acquire
+ */
+#define REGISTRY_MAX_READERS 256
+
+typedef struct RegistryReader RegistryReader;
+
+struct RegistryReader {
+  /**
+   * Epoch the reader entered at, 0 outside registry_enter / leave
+   */
+  unsigned long epoch;
+  int in_use;
+  /* One slot per cache line */
+  char padding[64 - sizeof(unsigned long) - sizeof(int)];
+};
+
+typedef struct RegistryVersion RegistryVersion;
+
+struct RegistryVersion {
+  FrozenTape *tape;
+  unsigned long version;
+  /**
+   * Epoch it was retired at, once it is no longer current
+   */
+  unsigned long retired_epoch;
+};
+
+typedef struct TapeRegistry TapeRegistry;
+
+struct TapeRegistry {
+  /**
+   * REGISTRY_MAGIC, cleared when the registry is freed
+   */
+  unsigned int magic;
+  /**
+   * Current version, NULL before the first publish. Only touched
+   * atomically, as is epoch
+   */
+  RegistryVersion *current;
+  unsigned long epoch;
+
+  RegistryReader readers[REGISTRY_MAX_READERS];
+
+  /**
+   * Writers only, but for retired_length, which readers load atomically
+   */
+  pthread_mutex_t lock;
+  unsigned long version;
+  RegistryVersion **retired;
+  size_t retired_length;
+  size_t retired_capacity;
+
+  int refcount;
+};
+
+TapeRegistry *registry_create(void);
+
+void registry_retain(TapeRegistry *reg);
+
+void registry_release(TapeRegistry *reg);
+
+unsigned long registry_publish(TapeRegistry *reg, FrozenTape *ft);
+
+void registry_reclaim(TapeRegistry *reg);
+
+int registry_reader_register(TapeRegistry *reg);
+
+void registry_reader_unregister(TapeRegistry *reg, int slot);
+
+FrozenTape *registry_enter(TapeRegistry *reg, int slot,
+                           unsigned long *version);
+
+FrozenTape *registry_current(TapeRegistry *reg, unsigned long *version);
+
+void registry_leave(TapeRegistry *reg, int slot);
+
+FrozenTape *registry_acquire(TapeRegistry *reg, unsigned long *version);
+
+unsigned long registry_current_version(TapeRegistry *reg);
+
+void *registry_export(TapeRegistry *reg);
+
+TapeRegistry *registry_import(void *token);
+
+int registry_discard_export(void *token);
+
+#endif /* FST_REGISTRY_H */
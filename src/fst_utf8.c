@@ -0,0 +1,524 @@
+/**
+ * Codepoint range edges compiled to UTF-8 byte tapes
+ * @file fst_utf8.c
+ */
+#include "fst_utf8.h"
+#include "fst_fast.h"
+#include "fst_wide.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static void *utf8_realloc(void *ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (!ptr) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  return ptr;
+}
+
+static unsigned int utf8_new_node(Utf8Builder *ub, unsigned int root) {
+  if (ub->node_count == ub->node_capacity) {
+    ub->node_capacity = MAX(ub->node_capacity * 2, 16);
+    ub->nodes = (Utf8Node *) utf8_realloc(
+        ub->nodes, ub->node_capacity * sizeof(Utf8Node));
+  }
+  Utf8Node *node = ub->nodes + ub->node_count;
+  for (int b = 0; b < 256; b++) {
+    node->entries[b].target = UTF8_UNSET;
+    node->entries[b].output = UTF8_NO_OUTPUT;
+  }
+  node->root = root;
+  return (unsigned int) ub->node_count++;
+}
+
+static unsigned int utf8_clone_node(Utf8Builder *ub, unsigned int n) {
+  unsigned int clone = utf8_new_node(ub, ub->nodes[n].root);
+  memcpy(ub->nodes[clone].entries, ub->nodes[n].entries,
+         sizeof(ub->nodes[n].entries));
+  return clone;
+}
+
+/**
+ * Every state starts out non-final, with itself as its error state
+ */
+void utf8_builder_initialize(Utf8Builder *ub, size_t state_count) {
+  memset(ub, 0, sizeof(Utf8Builder));
+  ub->state_count = state_count;
+  ub->errors = (unsigned int *) utf8_realloc(
+      NULL, MAX(state_count, 1) * sizeof(unsigned int));
+  ub->flags = (int *) utf8_realloc(NULL, MAX(state_count, 1) * sizeof(int));
+  for (size_t i = 0; i < state_count; i++) {
+    ub->errors[i] = (unsigned int) i;
+    ub->flags[i] = 0;
+    utf8_new_node(ub, (unsigned int) i);
+  }
+}
+
+/**
+ * Set where the state goes on bytes without an edge, and its
+ * FST_FLAG_INITIAL and FST_FLAG_FINAL flags
+ */
+int utf8_builder_set_state(Utf8Builder *ub, unsigned int state,
+                           unsigned int error_state, int flags) {
+  if (state >= ub->state_count || error_state >= ub->state_count) {
+    return UTF8_BAD_STATE;
+  }
+  ub->errors[state] = error_state;
+  ub->flags[state] = flags & (FST_FLAG_INITIAL | FST_FLAG_FINAL);
+  return UTF8_OK;
+}
+
+static int utf8_add_output(Utf8Builder *ub, const char *output,
+                           size_t length) {
+  if (ub->output_count == ub->output_capacity) {
+    ub->output_capacity = MAX(ub->output_capacity * 2, 16);
+    ub->outputs = (Utf8Output *) utf8_realloc(
+        ub->outputs, ub->output_capacity * sizeof(Utf8Output));
+  }
+  if (ub->pool_length + length > ub->pool_capacity) {
+    ub->pool_capacity = MAX(ub->pool_capacity * 2, ub->pool_length + length);
+    ub->pool = (char *) utf8_realloc(ub->pool, ub->pool_capacity);
+  }
+  memcpy(ub->pool + ub->pool_length, output, length);
+  ub->outputs[ub->output_count].offset = ub->pool_length;
+  ub->outputs[ub->output_count].length = length;
+  ub->pool_length += length;
+  return (int) ub->output_count++;
+}
+
+static size_t utf8_encode(unsigned long c, unsigned char *out) {
+  if (c < 0x80) {
+    out[0] = (unsigned char) c;
+    return 1;
+  }
+  if (c < 0x800) {
+    out[0] = (unsigned char) (0xc0 | (c >> 6));
+    out[1] = (unsigned char) (0x80 | (c & 0x3f));
+    return 2;
+  }
+  if (c < 0x10000) {
+    out[0] = (unsigned char) (0xe0 | (c >> 12));
+    out[1] = (unsigned char) (0x80 | ((c >> 6) & 0x3f));
+    out[2] = (unsigned char) (0x80 | (c & 0x3f));
+    return 3;
+  }
+  out[0] = (unsigned char) (0xf0 | (c >> 18));
+  out[1] = (unsigned char) (0x80 | ((c >> 12) & 0x3f));
+  out[2] = (unsigned char) (0x80 | ((c >> 6) & 0x3f));
+  out[3] = (unsigned char) (0x80 | (c & 0x3f));
+  return 4;
+}
+
+/**
+ * Decode the codepoint at the start of s, rejecting overlong forms and
+ * surrogates
+ * @return the number of bytes it takes, 0 if s doesn't start with one
+ */
+size_t utf8_decode(const char *s, size_t length, unsigned long *codepoint) {
+  const unsigned char *u = (const unsigned char *) s;
+  if (length == 0) {
+    return 0;
+  }
+  if (u[0] < 0x80) {
+    *codepoint = u[0];
+    return 1;
+  }
+
+  size_t n;
+  unsigned long c;
+  unsigned long min;
+  if ((u[0] & 0xe0) == 0xc0) {
+    n = 2;
+    c = u[0] & 0x1f;
+    min = 0x80;
+  } else if ((u[0] & 0xf0) == 0xe0) {
+    n = 3;
+    c = u[0] & 0x0f;
+    min = 0x800;
+  } else if ((u[0] & 0xf8) == 0xf0) {
+    n = 4;
+    c = u[0] & 0x07;
+    min = 0x10000;
+  } else {
+    return 0;
+  }
+  if (length < n) {
+    return 0;
+  }
+  for (size_t i = 1; i < n; i++) {
+    if ((u[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    c = (c << 6) | (u[i] & 0x3f);
+  }
+  if (c < min || c > UTF8_MAX_CODEPOINT || (c >= 0xd800 && c <= 0xdfff)) {
+    return 0;
+  }
+  *codepoint = c;
+  return n;
+}
+
+/**
+ * Add the byte ranges lo[i]..hi[i] as a chain out of node. Children
+ * are copied before they're changed, since other bytes, outside this
+ * range, may share them.
+ */
+static void utf8_insert(Utf8Builder *ub, unsigned int node,
+                        const unsigned char *lo, const unsigned char *hi,
+                        size_t count, unsigned int to, int output, int echo) {
+  if (count == 1) {
+    for (int b = lo[0]; b <= hi[0]; b++) {
+      ub->nodes[node].entries[b].target = to;
+      ub->nodes[node].entries[b].output = echo ? UTF8_ECHO : output;
+    }
+    return;
+  }
+
+  /* Bytes that shared a child share the child's replacement */
+  unsigned int olds[256];
+  unsigned int news[256];
+  size_t replaced = 0;
+  for (int b = lo[0]; b <= hi[0]; b++) {
+    unsigned int old = ub->nodes[node].entries[b].target;
+    if (old < ub->state_count) {
+      old = UTF8_UNSET;
+    }
+    size_t j = 0;
+    while (j < replaced && olds[j] != old) {
+      j++;
+    }
+    if (j == replaced) {
+      unsigned int child = old == UTF8_UNSET
+                               ? utf8_new_node(ub, ub->nodes[node].root)
+                               : utf8_clone_node(ub, old);
+      utf8_insert(ub, child, lo + 1, hi + 1, count - 1, to, output, echo);
+      olds[replaced] = old;
+      news[replaced] = child;
+      replaced++;
+    }
+    ub->nodes[node].entries[b].target = news[j];
+    ub->nodes[node].entries[b].output = echo ? UTF8_ECHO : UTF8_NO_OUTPUT;
+  }
+}
+
+/**
+ * Split lo..hi until every piece is one run of same length sequences
+ * whose bytes each cover a range, and insert those
+ */
+static void utf8_add_range(Utf8Builder *ub, unsigned int from,
+                           unsigned long lo, unsigned long hi,
+                           unsigned int to, int output, int echo) {
+  static const unsigned long lengths[] = {0x7f, 0x7ff, 0xffff};
+  if (lo > hi) {
+    return;
+  }
+  if (lo <= 0xdfff && hi >= 0xd800) {
+    if (lo < 0xd800) {
+      utf8_add_range(ub, from, lo, 0xd7ff, to, output, echo);
+    }
+    if (hi > 0xdfff) {
+      utf8_add_range(ub, from, 0xe000, hi, to, output, echo);
+    }
+    return;
+  }
+  for (int i = 0; i < 3; i++) {
+    if (lo <= lengths[i] && hi > lengths[i]) {
+      utf8_add_range(ub, from, lo, lengths[i], to, output, echo);
+      utf8_add_range(ub, from, lengths[i] + 1, hi, to, output, echo);
+      return;
+    }
+  }
+  for (int i = 1; i < 4; i++) {
+    unsigned long m = (1UL << (6 * i)) - 1;
+    if ((lo & ~m) != (hi & ~m)) {
+      if (lo & m) {
+        utf8_add_range(ub, from, lo, lo | m, to, output, echo);
+        utf8_add_range(ub, from, (lo | m) + 1, hi, to, output, echo);
+        return;
+      }
+      if ((hi & m) != m) {
+        utf8_add_range(ub, from, lo, (hi & ~m) - 1, to, output, echo);
+        utf8_add_range(ub, from, hi & ~m, hi, to, output, echo);
+        return;
+      }
+    }
+  }
+
+  unsigned char lo_bytes[4];
+  unsigned char hi_bytes[4];
+  size_t count = utf8_encode(lo, lo_bytes);
+  utf8_encode(hi, hi_bytes);
+  utf8_insert(ub, from, lo_bytes, hi_bytes, count, to, output, echo);
+}
+
+/**
+ * Add an edge from state from to state to on every codepoint from lo
+ * to hi. The codepoint outputs output once it has been read, or every
+ * one of its bytes if echo is set. Later edges win where they overlap.
+ * @return UTF8_OK, UTF8_BAD_STATE or UTF8_BAD_RANGE
+ */
+int utf8_builder_add(Utf8Builder *ub, unsigned int from, unsigned long lo,
+                     unsigned long hi, unsigned int to, const char *output,
+                     size_t output_length, int echo) {
+  if (from >= ub->state_count || to >= ub->state_count) {
+    return UTF8_BAD_STATE;
+  }
+  if (lo > hi || hi > UTF8_MAX_CODEPOINT) {
+    return UTF8_BAD_RANGE;
+  }
+  int out = UTF8_NO_OUTPUT;
+  if (output_length && !echo) {
+    out = utf8_add_output(ub, output, output_length);
+  }
+  utf8_add_range(ub, from, lo, hi, to, out, echo);
+  return UTF8_OK;
+}
+
+typedef struct Utf8Minimizer Utf8Minimizer;
+
+/**
+ * Merges intermediate nodes bottom up: a node is replaced by an
+ * earlier one with the same entries once its children are
+ */
+struct Utf8Minimizer {
+  Utf8Builder *ub;
+  /**
+   * Node to its state in the tape, UTF8_UNSET until it's been merged
+   */
+  unsigned int *map;
+
+  /**
+   * The tape's states, the given ones first
+   */
+  Utf8Node *states;
+  size_t state_count;
+  size_t state_capacity;
+
+  /**
+   * States past the given ones, by their entries. UTF8_UNSET marks
+   * an empty slot
+   */
+  unsigned int *table;
+  size_t table_size;
+};
+
+static size_t utf8_hash_entries(const Utf8Entry *entries) {
+  const unsigned char *bytes = (const unsigned char *) entries;
+  size_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < 256 * sizeof(Utf8Entry); i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void utf8_table_insert(Utf8Minimizer *um, unsigned int state) {
+  size_t mask = um->table_size - 1;
+  size_t slot = utf8_hash_entries(um->states[state].entries) & mask;
+  while (um->table[slot] != UTF8_UNSET) {
+    slot = (slot + 1) & mask;
+  }
+  um->table[slot] = state;
+}
+
+static void utf8_table_grow(Utf8Minimizer *um) {
+  free(um->table);
+  um->table_size *= 2;
+  um->table = (unsigned int *) utf8_realloc(
+      NULL, um->table_size * sizeof(unsigned int));
+  memset(um->table, 0xff, um->table_size * sizeof(unsigned int));
+  for (size_t i = um->ub->state_count; i < um->state_count; i++) {
+    utf8_table_insert(um, (unsigned int) i);
+  }
+}
+
+static unsigned int utf8_merge(Utf8Minimizer *um, unsigned int node);
+
+/**
+ * Entries of node with error targets filled in and children merged
+ */
+static void utf8_resolve(Utf8Minimizer *um, unsigned int node,
+                         Utf8Entry *entries) {
+  Utf8Builder *ub = um->ub;
+  unsigned int error = ub->errors[ub->nodes[node].root];
+  for (int b = 0; b < 256; b++) {
+    Utf8Entry entry = ub->nodes[node].entries[b];
+    if (entry.target == UTF8_UNSET) {
+      entry.target = error;
+      entry.output = UTF8_NO_OUTPUT;
+    } else if (entry.target >= ub->state_count) {
+      entry.target = utf8_merge(um, entry.target);
+    }
+    entries[b] = entry;
+  }
+}
+
+static unsigned int utf8_merge(Utf8Minimizer *um, unsigned int node) {
+  if (um->map[node] != UTF8_UNSET) {
+    return um->map[node];
+  }
+
+  Utf8Node resolved;
+  memset(&resolved, 0, sizeof(Utf8Node));
+  utf8_resolve(um, node, resolved.entries);
+
+  size_t mask = um->table_size - 1;
+  size_t slot = utf8_hash_entries(resolved.entries) & mask;
+  for (; um->table[slot] != UTF8_UNSET; slot = (slot + 1) & mask) {
+    unsigned int state = um->table[slot];
+    if (memcmp(um->states[state].entries, resolved.entries,
+               sizeof(resolved.entries)) == 0) {
+      um->map[node] = state;
+      return state;
+    }
+  }
+
+  if (um->state_count == um->state_capacity) {
+    um->state_capacity *= 2;
+    um->states = (Utf8Node *) utf8_realloc(
+        um->states, um->state_capacity * sizeof(Utf8Node));
+  }
+  unsigned int state = (unsigned int) um->state_count++;
+  um->states[state] = resolved;
+  um->map[node] = state;
+  if ((um->state_count - um->ub->state_count) * 2 > um->table_size) {
+    utf8_table_grow(um);
+  } else {
+    um->table[slot] = state;
+  }
+  return state;
+}
+
+/**
+ * The tape's states, with intermediate nodes merged and every entry
+ * resolved. Nodes no given state reaches are dropped along the way.
+ */
+static Utf8Node *utf8_minimize(Utf8Builder *ub, size_t *count) {
+  Utf8Minimizer um;
+  um.ub = ub;
+  um.map = (unsigned int *) utf8_realloc(
+      NULL, MAX(ub->node_count, 1) * sizeof(unsigned int));
+  memset(um.map, 0xff, MAX(ub->node_count, 1) * sizeof(unsigned int));
+  um.state_capacity = MAX(ub->state_count * 2, 16);
+  um.states =
+      (Utf8Node *) utf8_realloc(NULL, um.state_capacity * sizeof(Utf8Node));
+  um.state_count = ub->state_count;
+  um.table_size = 64;
+  um.table =
+      (unsigned int *) utf8_realloc(NULL, um.table_size * sizeof(unsigned int));
+  memset(um.table, 0xff, um.table_size * sizeof(unsigned int));
+
+  Utf8Node resolved;
+  for (size_t i = 0; i < ub->state_count; i++) {
+    utf8_resolve(&um, (unsigned int) i, resolved.entries);
+    resolved.root = (unsigned int) i;
+    um.states[i] = resolved;
+  }
+
+  free(um.map);
+  free(um.table);
+  *count = um.state_count;
+  return um.states;
+}
+
+/**
+ * Compile the edges added so far into a narrow tape. Outputs longer
+ * than a byte are cut to their first byte.
+ * @return the tape, or NULL if it needs more states than a narrow tape
+ * can number
+ */
+InstructionTape *utf8_builder_narrow(Utf8Builder *ub) {
+  size_t count;
+  Utf8Node *states = utf8_minimize(ub, &count);
+  if (count > 65536) {
+    free(states);
+    return NULL;
+  }
+
+  InstructionTape *it = (InstructionTape *) malloc(sizeof(InstructionTape));
+  if (!it) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  fse_initialize_tape(it);
+  fse_grow(it, count);
+  for (size_t i = 0; i < count; i++) {
+    fse_clear_instr(it, 0);
+    if (i < ub->state_count && (ub->flags[i] & FST_FLAG_INITIAL)) {
+      fse_set_initial_flags(it);
+    }
+    if (i < ub->state_count && (ub->flags[i] & FST_FLAG_FINAL)) {
+      fse_set_final_flags(it);
+    }
+    for (int b = 0; b < 256; b++) {
+      Utf8Entry entry = states[i].entries[b];
+      FstStateEntry *fse = fse_get_outgoing(it, (char) b);
+      fse_set_outstate(fse, (unsigned short) entry.target);
+      if (entry.output == UTF8_ECHO) {
+        fse_set_outchar(fse, (char) b);
+      } else if (entry.output >= 0 && ub->outputs[entry.output].length) {
+        fse_set_outchar(fse, ub->pool[ub->outputs[entry.output].offset]);
+      }
+    }
+    fse_finish(it);
+  }
+  free(states);
+  return it;
+}
+
+/**
+ * Compile the edges added so far into a wide tape
+ */
+WideInstructionTape *utf8_builder_wide(Utf8Builder *ub) {
+  size_t count;
+  Utf8Node *states = utf8_minimize(ub, &count);
+
+  WideInstructionTape *wt =
+      (WideInstructionTape *) malloc(sizeof(WideInstructionTape));
+  if (!wt) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  fwe_initialize_tape(wt);
+  fwe_grow(wt, count);
+  /* Each output goes into the tape once, however many entries emit it */
+  size_t outputs = fwe_add_output(wt, ub->pool, ub->pool_length);
+  size_t bytes = fwe_add_byte_table(wt);
+  for (size_t i = 0; i < count; i++) {
+    fwe_clear_instr(wt, 0);
+    if (i < ub->state_count && (ub->flags[i] & FST_FLAG_INITIAL)) {
+      fwe_set_initial_flags(wt);
+    }
+    if (i < ub->state_count && (ub->flags[i] & FST_FLAG_FINAL)) {
+      fwe_set_final_flags(wt);
+    }
+    for (int b = 0; b < 256; b++) {
+      Utf8Entry entry = states[i].entries[b];
+      char c = (char) b;
+      FstWideEntry *fwe = fwe_get_outgoing(wt, c);
+      fwe_set_outstate(fwe, entry.target);
+      if (entry.output == UTF8_ECHO) {
+        fwe_set_pooled_output(wt, fwe, bytes + b, 1);
+      } else if (entry.output >= 0) {
+        fwe_set_pooled_output(wt, fwe,
+                              outputs + ub->outputs[entry.output].offset,
+                              ub->outputs[entry.output].length);
+      }
+    }
+    fwe_finish(wt);
+  }
+  free(states);
+  return wt;
+}
+
+void utf8_builder_destroy(Utf8Builder *ub) {
+  free(ub->errors);
+  free(ub->flags);
+  free(ub->nodes);
+  free(ub->outputs);
+  free(ub->pool);
+  memset(ub, 0, sizeof(Utf8Builder));
+}
@@ -0,0 +1,111 @@
+#ifndef FST_UTF8_H
+#define FST_UTF8_H
+
+#include "fst_fast.h"
+#include "fst_wide.h"
+#include <stdlib.h>
+
+/*
+ * Tapes over Unicode codepoints.
+ *
+ * Edges are given as codepoint ranges, and compiled to the byte level:
+ * each range is split into runs of UTF-8 sequences whose bytes vary
+ * independently (as in RE2 and Go's regexp), and every run becomes a
+ * chain of byte ranges through intermediate states. Surrogates, which
+ * have no UTF-8 form, are left out.
+ *
+ * Codepoints below 0x80 are single byte edges straight out of the
+ * state, so ASCII text costs one lookup per byte as before and never
+ * touches an intermediate state. Bytes that don't continue a sequence
+ * go to the error state of the state the sequence started in.
+ *
+ * Intermediate states are merged when they behave the same, so the
+ * continuation states of a whole script or class collapse into a
+ * handful that every lead byte shares.
+ *
+ * The tape holds the states given to utf8_builder_initialize first,
+ * with the same numbers, followed by the intermediate states.
+ */
+
+#define UTF8_OK 0
+#define UTF8_BAD_STATE 1
+#define UTF8_BAD_RANGE 2
+
+#define UTF8_MAX_CODEPOINT 0x10ffff
+
+/**
+ * Outputs of a Utf8Entry that aren't indices into the outputs
+ */
+#define UTF8_NO_OUTPUT (-1)
+#define UTF8_ECHO (-2)
+
+/**
+ * Target of an entry nothing was added to: the error state
+ */
+#define UTF8_UNSET ((unsigned int) -1)
+
+typedef struct Utf8Entry Utf8Entry;
+
+struct Utf8Entry {
+  unsigned int target;
+  int output;
+};
+
+typedef struct Utf8Node Utf8Node;
+
+struct Utf8Node {
+  Utf8Entry entries[256];
+  /**
+   * The state this node's sequences start from, itself for the states
+   * given to utf8_builder_initialize
+   */
+  unsigned int root;
+};
+
+typedef struct Utf8Output Utf8Output;
+
+struct Utf8Output {
+  size_t offset;
+  size_t length;
+};
+
+typedef struct Utf8Builder Utf8Builder;
+
+struct Utf8Builder {
+  size_t state_count;
+  unsigned int *errors;
+  int *flags;
+
+  /**
+   * The given states, then the intermediate ones
+   */
+  Utf8Node *nodes;
+  size_t node_count;
+  size_t node_capacity;
+
+  Utf8Output *outputs;
+  size_t output_count;
+  size_t output_capacity;
+  char *pool;
+  size_t pool_length;
+  size_t pool_capacity;
+};
+
+void utf8_builder_initialize(Utf8Builder *ub, size_t state_count);
+
+int utf8_builder_set_state(Utf8Builder *ub, unsigned int state,
+                           unsigned int error_state, int flags);
+
+int utf8_builder_add(Utf8Builder *ub, unsigned int from, unsigned long lo,
+                     unsigned long hi, unsigned int to, const char *output,
+                     size_t output_length, int echo);
+
+InstructionTape *utf8_builder_narrow(Utf8Builder *ub);
+
+WideInstructionTape *utf8_builder_wide(Utf8Builder *ub);
+
+void utf8_builder_destroy(Utf8Builder *ub);
+
+size_t utf8_decode(const char *s, size_t length, unsigned long *codepoint);
+
+#endif /* FST_UTF8_H */
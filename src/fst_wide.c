@@ -0,0 +1,536 @@
+/**
+ * Wide FST tapes: 32 bit states, arbitrary length outputs
+ * @file fst_wide.c
+ */
+#include "fst_wide.h"
+#include "fst_arena.h"
+#include "fst_fast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/**
+ * Written before a wide dump so it can't be mistaken for a narrow one
+ */
+static const char wide_magic[4] = {'F', 'S', 'T', 'W'};
+
+/**
+ * Initialize wide tape
+ */
+void fwe_initialize_tape(WideInstructionTape *instrtape) {
+  instrtape->capacity = 10;
+  instrtape->beginning =
+      (FstWideEntry *) malloc(instrtape->capacity * sizeof(FstWideEntry) * 256);
+  instrtape->pool_capacity = 64;
+  instrtape->output_pool = (char *) malloc(instrtape->pool_capacity);
+  if (!(instrtape->beginning) || !(instrtape->output_pool)) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  instrtape->current = instrtape->beginning;
+  instrtape->length = 0;
+  instrtape->pool_length = 0;
+  instrtape->arena = NULL;
+  instrtape->mapped_size = 0;
+}
+
+/**
+ * Initialize wide tape that builds its states in an arena.
+ * Nothing but the fwe_* builders may read it before fwe_freeze.
+ */
+void fwe_initialize_arena_tape(WideInstructionTape *instrtape) {
+  fwe_initialize_tape(instrtape);
+  free(instrtape->beginning);
+  instrtape->beginning = NULL;
+  instrtape->current = NULL;
+  instrtape->capacity = 0;
+  instrtape->arena = arena_create(sizeof(FstWideEntry) * 256);
+}
+
+/**
+ * Grow wide tape if neccessary
+ */
+void fwe_grow(WideInstructionTape *instrtape, size_t targetlen) {
+  if (instrtape->arena) {
+    /* Arena chunks are added as states are cleared */
+    return;
+  }
+  if (instrtape->capacity < targetlen) {
+    instrtape->capacity = MAX(instrtape->capacity * 2, targetlen);
+    size_t offset = instrtape->current - instrtape->beginning;
+    if (instrtape->mapped_size) {
+      /* Growing a frozen tape: back to the heap */
+      FstWideEntry *grown = (FstWideEntry *) malloc(
+          instrtape->capacity * sizeof(FstWideEntry) * 256);
+      if (grown) {
+        memcpy(grown, instrtape->beginning,
+               instrtape->length * sizeof(FstWideEntry) * 256);
+      }
+      arena_unmap(instrtape->beginning, instrtape->mapped_size);
+      instrtape->mapped_size = 0;
+      instrtape->beginning = grown;
+    } else {
+      instrtape->beginning = (FstWideEntry *) realloc(
+          (void *) instrtape->beginning,
+          instrtape->capacity * sizeof(FstWideEntry) * 256);
+    }
+    if (!(instrtape->beginning)) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+    instrtape->current = instrtape->beginning + offset;
+  }
+}
+
+/**
+ * Move the states into one region, on huge pages when the tape is big
+ * enough to use them. Pointers from fwe_get_outgoing are invalid after.
+ */
+void fwe_freeze(WideInstructionTape *instrtape) {
+  size_t size = instrtape->length * sizeof(FstWideEntry) * 256;
+  if (instrtape->mapped_size ||
+      (!instrtape->arena && size < ARENA_HUGE_PAGE_SIZE)) {
+    return;
+  }
+
+  size_t mapped_size = 0;
+  FstWideEntry *region = NULL;
+  if (size >= ARENA_HUGE_PAGE_SIZE) {
+    region = (FstWideEntry *) arena_map(size, &mapped_size);
+  }
+  if (!region) {
+    if (!instrtape->arena) {
+      return;
+    }
+    mapped_size = 0;
+    region = (FstWideEntry *) malloc(MAX(size, 1));
+    if (!region) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+  }
+
+  if (instrtape->arena) {
+    arena_copy_out(instrtape->arena, (unsigned char *) region,
+                   instrtape->length);
+    arena_destroy(instrtape->arena);
+    instrtape->arena = NULL;
+  } else {
+    memcpy(region, instrtape->beginning, size);
+    free(instrtape->beginning);
+  }
+  instrtape->beginning = region;
+  instrtape->current = region + instrtape->length * 256;
+  instrtape->capacity = instrtape->length;
+  instrtape->mapped_size = mapped_size;
+}
+
+/**
+ * Freeze instrtape if its states are still in an arena, as
+ * fse_freeze_arena
+ */
+void fwe_freeze_arena(WideInstructionTape *instrtape) {
+  if (instrtape->arena) {
+    fwe_freeze(instrtape);
+  }
+}
+
+/**
+ * Grow the output pool if neccessary
+ */
+void fwe_grow_pool(WideInstructionTape *instrtape, size_t targetlen) {
+  if (instrtape->pool_capacity <= targetlen) {
+    instrtape->pool_capacity = MAX(instrtape->pool_capacity * 2, targetlen);
+    instrtape->output_pool = (char *) realloc(
+        (void *) instrtape->output_pool, instrtape->pool_capacity);
+    if (!(instrtape->output_pool)) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+  }
+}
+
+/**
+ * Clear an entire instruction
+ */
+void fwe_clear_instr(WideInstructionTape *instrtape, unsigned int errorstate) {
+  if (instrtape->arena) {
+    instrtape->current =
+        (FstWideEntry *) arena_row(instrtape->arena, instrtape->length);
+  } else {
+    fwe_grow(instrtape, instrtape->length + 1);
+  }
+  instrtape->length += 1;
+
+  FstWideEntry cleared;
+  cleared.out_state = errorstate;
+  cleared.flags = FST_FLAG_VALID;
+  cleared.out_offset = 0;
+  cleared.out_length = 0;
+
+  FstWideEntry *fwe = instrtape->current;
+  for (int i = 0; i < 256; i++) {
+    fwe[i] = cleared;
+  }
+}
+
+void fwe_set_final_flags(WideInstructionTape *instrtape) {
+  FstWideEntry *fwe = instrtape->current;
+  for (int i = 0; i < 256; i++) {
+    fwe->flags |= FST_FLAG_FINAL;
+    fwe += 1;
+  }
+}
+
+void fwe_set_initial_flags(WideInstructionTape *instrtape) {
+  FstWideEntry *fwe = instrtape->current;
+  for (int i = 0; i < 256; i++) {
+    fwe->flags |= FST_FLAG_INITIAL;
+    fwe += 1;
+  }
+}
+
+/**
+ * Get the outgoing edge on the character
+ */
+FstWideEntry *fwe_get_outgoing(WideInstructionTape *instrtape, char c) {
+  return instrtape->current + (unsigned char) c;
+}
+
+void fwe_set_outstate(FstWideEntry *fwe, unsigned int outstate) {
+  fwe->out_state = outstate;
+}
+
+/**
+ * Copy output to the end of the tape's pool
+ * @return its offset in the pool
+ */
+size_t fwe_add_output(WideInstructionTape *instrtape, const char *output,
+                      size_t length) {
+  size_t offset = instrtape->pool_length;
+  fwe_grow_pool(instrtape, offset + length);
+  if (length) {
+    memcpy(instrtape->output_pool + offset, output, length);
+  }
+  instrtape->pool_length += length;
+  return offset;
+}
+
+/**
+ * Add the bytes 0 to 255 to the pool, so an entry echoing byte b can
+ * point at the returned offset plus b
+ */
+size_t fwe_add_byte_table(WideInstructionTape *instrtape) {
+  char bytes[256];
+  for (int b = 0; b < 256; b++) {
+    bytes[b] = (char) b;
+  }
+  return fwe_add_output(instrtape, bytes, sizeof(bytes));
+}
+
+/**
+ * Point fwe at length bytes already in the tape's pool at offset, so
+ * every entry with the same output shares one copy. A zero length
+ * means the transition has no output. Exits if the output is longer
+ * than FWE_MAX_OUTPUT_LENGTH or lies past what an entry can point into.
+ */
+void fwe_set_pooled_output(WideInstructionTape *instrtape, FstWideEntry *fwe,
+                           size_t offset, size_t length) {
+  if (length == 0) {
+    fwe->out_offset = 0;
+    fwe->out_length = 0;
+    return;
+  }
+  if (length > FWE_MAX_OUTPUT_LENGTH || offset > FWE_MAX_POOL_OFFSET ||
+      offset + length > instrtape->pool_length) {
+    fprintf(stderr, "Wide tape output pool overflow\n");
+    exit(1);
+  }
+  fwe->out_offset = (unsigned int) offset;
+  fwe->out_length = (unsigned int) length;
+}
+
+/**
+ * Copy output into the tape's pool and point fwe at it, as
+ * fwe_set_pooled_output
+ */
+void fwe_set_output(WideInstructionTape *instrtape, FstWideEntry *fwe,
+                    const char *output, size_t length) {
+  if (length == 0) {
+    fwe_set_pooled_output(instrtape, fwe, 0, 0);
+    return;
+  }
+  size_t offset = fwe_add_output(instrtape, output, length);
+  fwe_set_pooled_output(instrtape, fwe, offset, length);
+}
+
+/**
+ * Finish the current FST vertex
+ */
+void fwe_finish(WideInstructionTape *instrtape) {
+  instrtape->current += 256;
+}
+
+/**
+ * Free resources in instrtape
+ */
+void wide_instruction_tape_destroy(WideInstructionTape *instrtape) {
+  if (instrtape->arena) {
+    arena_destroy(instrtape->arena);
+    instrtape->arena = NULL;
+  }
+  if (instrtape->mapped_size) {
+    arena_unmap(instrtape->beginning, instrtape->mapped_size);
+  } else {
+    free(instrtape->beginning);
+  }
+  free(instrtape->output_pool);
+}
+
+static void wide_match_grow_char(WideMatchObject *match_object,
+                                 size_t targetlen) {
+  if (match_object->char_capacity <= targetlen) {
+    match_object->char_capacity =
+        MAX(match_object->char_capacity * 2, targetlen);
+    match_object->char_output = (char *) realloc(
+        (void *) match_object->char_output, match_object->char_capacity);
+    if (!match_object->char_output) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+  }
+}
+
+static void wide_match_grow_states(WideMatchObject *match_object,
+                                   size_t targetlen) {
+  if (match_object->state_capacity <= targetlen) {
+    match_object->state_capacity =
+        MAX(match_object->state_capacity * 2, targetlen);
+    match_object->state_output = (unsigned int *) realloc(
+        (void *) match_object->state_output,
+        match_object->state_capacity * sizeof(unsigned int));
+    if (!match_object->state_output) {
+      perror("Memory allocation failure");
+      exit(1);
+    }
+  }
+}
+
+void wide_match_initialize(WideMatchObject *match_object,
+                           WideInstructionTape *instrtape) {
+  fwe_freeze_arena(instrtape);
+  match_object->state_capacity = 10;
+  match_object->state_length = 0;
+  match_object->char_capacity = 10;
+  match_object->char_length = 0;
+  match_object->beginning = instrtape->beginning;
+  match_object->output_pool = instrtape->output_pool;
+  match_object->current = match_object->beginning;
+  match_object->state_output = (unsigned int *) malloc(
+      match_object->state_capacity * sizeof(unsigned int));
+  match_object->char_output = (char *) malloc(match_object->char_capacity);
+  if (!match_object->state_output || !match_object->char_output) {
+    perror("Memory allocation failure");
+    exit(1);
+  }
+  match_object->match_success = 0;
+}
+
+void wide_match_destroy(WideMatchObject *match_object) {
+  free(match_object->state_output);
+  free(match_object->char_output);
+  match_object->state_output = 0;
+  match_object->char_output = 0;
+  match_object->beginning = 0;
+  match_object->output_pool = 0;
+  match_object->current = 0;
+}
+
+/**
+ * Match a single character on a single state.
+ * The FST must be deterministic.
+ */
+void wide_match_one_char(WideMatchObject *match_object, char input) {
+  FstWideEntry *fwe = match_object->current + (unsigned char) input;
+
+  if (fwe->out_length) {
+    wide_match_grow_char(match_object,
+                         match_object->char_length + fwe->out_length);
+    memcpy(match_object->char_output + match_object->char_length,
+           match_object->output_pool + fwe->out_offset, fwe->out_length);
+    match_object->char_length += fwe->out_length;
+  }
+
+  wide_match_grow_states(match_object, match_object->state_length + 1);
+
+  match_object->state_output[match_object->state_length] = fwe->out_state;
+  match_object->state_length += 1;
+  match_object->current =
+      match_object->beginning + (size_t) fwe->out_state * 256;
+}
+
+/**
+ * Match length more bytes of input on from where match object stopped,
+ * as match_continue
+ */
+void wide_match_continue(WideMatchObject *match_object, const char *input,
+                         size_t length) {
+  wide_match_grow_states(match_object, match_object->state_length + length + 1);
+  for (size_t i = 0; i < length; i++) {
+    wide_match_one_char(match_object, input[i]);
+  }
+}
+
+/**
+ * Set match_success once all input has been matched, as match_finish
+ */
+void wide_match_finish(WideInstructionTape *instrtape,
+                       WideMatchObject *match_object) {
+  fwe_freeze_arena(instrtape);
+  match_object->match_success = 0;
+  if (match_object->state_length > 0) {
+    FstWideEntry *last_state =
+        instrtape->beginning +
+        (size_t) match_object->state_output[match_object->state_length - 1] *
+            256;
+    if (last_state->flags & FST_FLAG_FINAL) {
+      match_object->match_success = 1;
+    }
+  }
+}
+
+/**
+ * Using instrtape, match length bytes of input, NUL included, into
+ * match object
+ * @param instrtape the wide instruction tape
+ * @param match object the match object to be filled in
+ * @param input the input bytes
+ * @param length the number of bytes
+ */
+void wide_match_bytes(WideInstructionTape *instrtape,
+                      WideMatchObject *match_object, const char *input,
+                      size_t length) {
+  fwe_freeze_arena(instrtape);
+  wide_match_initialize(match_object, instrtape);
+  wide_match_continue(match_object, input, length);
+  wide_match_finish(instrtape, match_object);
+}
+
+/**
+ * Using instrtape, match input into match object
+ * @param instrtape the wide instruction tape
+ * @param match object the match object to be filled in
+ * @param input the input string, up to its NUL
+ */
+void wide_match_string(WideInstructionTape *instrtape,
+                       WideMatchObject *match_object, const char *input) {
+  wide_match_bytes(instrtape, match_object, input, strlen(input));
+}
+
+/**
+ * Copy a narrow tape into a new wide one
+ */
+WideInstructionTape *wide_from_narrow(InstructionTape *it) {
+  fse_freeze_arena(it);
+  WideInstructionTape *wt =
+      (WideInstructionTape *) malloc(sizeof(WideInstructionTape));
+  fwe_initialize_tape(wt);
+  fwe_grow(wt, it->length);
+
+  /* Byte b lives at offset b of the pool */
+  fwe_add_byte_table(wt);
+
+  FstStateEntry *fse = (FstStateEntry *) it->beginning;
+  FstWideEntry *fwe = wt->beginning;
+  for (size_t i = 0; i < it->length * 256; i++) {
+    unsigned char outchar = (unsigned char) fse[i].components.outchar;
+    fwe[i].out_state = fse[i].components.out_state;
+    fwe[i].flags = (unsigned char) fse[i].components.flags;
+    fwe[i].out_offset = outchar;
+    fwe[i].out_length = outchar ? 1 : 0;
+  }
+  wt->length = it->length;
+  wt->current = wt->beginning + wt->length * 256;
+  return wt;
+}
+
+/**
+ * Copy a wide tape into a new narrow one
+ * @return NULL if wt has more than 65536 states, or an output that isn't
+ * a single non-NUL byte
+ */
+InstructionTape *narrow_from_wide(WideInstructionTape *wt) {
+  if (wt->length > 65536) {
+    return NULL;
+  }
+  fwe_freeze_arena(wt);
+  FstWideEntry *fwe = wt->beginning;
+  for (size_t i = 0; i < wt->length * 256; i++) {
+    if (fwe[i].out_length > 1 ||
+        (fwe[i].out_length == 1 && !wt->output_pool[fwe[i].out_offset])) {
+      return NULL;
+    }
+  }
+
+  InstructionTape *it = (InstructionTape *) malloc(sizeof(InstructionTape));
+  fse_initialize_tape(it);
+  fse_grow(it, wt->length);
+  FstStateEntry *fse = (FstStateEntry *) it->beginning;
+  for (size_t i = 0; i < wt->length * 256; i++) {
+    fse[i].components.flags = (char) fwe[i].flags;
+    fse[i].components.outchar =
+        fwe[i].out_length ? wt->output_pool[fwe[i].out_offset] : 0;
+    fse[i].components.out_state = (unsigned short) fwe[i].out_state;
+  }
+  it->length = wt->length;
+  return it;
+}
+
+/**
+ * Dump the wide tape: magic, state count, pool length, states, pool
+ */
+void wide_inspector_dumpfile(FILE *f, WideInstructionTape *it) {
+  fwe_freeze_arena(it);
+  fwrite(wide_magic, sizeof(wide_magic), 1, f);
+  fwrite((void *) &(it->length), sizeof(size_t), 1, f);
+  fwrite((void *) &(it->pool_length), sizeof(size_t), 1, f);
+  fwrite((void *) it->beginning, sizeof(FstWideEntry) * 256, it->length, f);
+  fwrite((void *) it->output_pool, 1, it->pool_length, f);
+}
+
+/**
+ * Load a tape written by wide_inspector_dumpfile.
+ * Returns NULL if f does not hold a complete wide dump.
+ */
+WideInstructionTape *wide_inspector_loadfile(FILE *f) {
+  char magic[sizeof(wide_magic)];
+  size_t len = 0;
+  size_t pool_len = 0;
+  if (fread(magic, sizeof(magic), 1, f) != 1 ||
+      memcmp(magic, wide_magic, sizeof(magic)) != 0 ||
+      fread((void *) &len, sizeof(size_t), 1, f) != 1 ||
+      fread((void *) &pool_len, sizeof(size_t), 1, f) != 1) {
+    return NULL;
+  }
+
+  WideInstructionTape *it =
+      (WideInstructionTape *) malloc(sizeof(WideInstructionTape));
+  fwe_initialize_tape(it);
+  fwe_grow(it, len);
+  fwe_grow_pool(it, pool_len);
+
+  if (fread((void *) it->beginning, sizeof(FstWideEntry) * 256, len, f) !=
+          len ||
+      fread((void *) it->output_pool, 1, pool_len, f) != pool_len) {
+    wide_instruction_tape_destroy(it);
+    free(it);
+    return NULL;
+  }
+  it->length = len;
+  it->pool_length = pool_len;
+  it->current = it->beginning + len * 256;
+
+  return it;
+}
@@ -0,0 +1,195 @@
+#ifndef FST_WIDE_H
+#define FST_WIDE_H
+
+#include "fst_arena.h"
+#include "fst_fast.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Wide instruction tapes.
+ *
+ * Same layout as InstructionTape (256 entries per state, the state's
+ * index is the state #), but each entry holds a 32 bit out-state and a
+ * slice of a shared output pool instead of a single out-character.
+ * A transition may therefore emit up to FWE_MAX_OUTPUT_LENGTH bytes,
+ * NUL included, and a tape may hold up to 2^32 states.
+ *
+ * The flags share a word with the output length, so an entry takes 12
+ * bytes and a row 3 KiB.
+ */
+
+#define FWE_MAX_OUTPUT_LENGTH ((1u << 29) - 1)
+
+/**
+ * Largest pool offset an entry can point at
+ */
+#define FWE_MAX_POOL_OFFSET ((size_t) UINT_MAX)
+
+typedef struct FstWideEntry FstWideEntry;
+
+struct FstWideEntry {
+  /**
+   * The state reached on this input
+   */
+  unsigned int out_state;
+  /**
+   * Offset of the output in the tape's output pool
+   */
+  unsigned int out_offset;
+  /**
+   * Number of output bytes, 0 for no output
+   */
+  unsigned int out_length : 29;
+  /**
+   * FST_FLAG_* bits, same meaning as in FstStateEntry
+   */
+  unsigned int flags : 3;
+};
+
+typedef struct WideInstructionTape WideInstructionTape;
+
+struct WideInstructionTape {
+  FstWideEntry *beginning;
+  FstWideEntry *current;
+  size_t length;
+  size_t capacity;
+
+  /**
+   * Every transition output, back to back
+   */
+  char *output_pool;
+  size_t pool_length;
+  size_t pool_capacity;
+
+  /**
+   * Chunks the states are built in, NULL once frozen (see fst_arena.h)
+   */
+  TapeArena *arena;
+
+  /**
+   * Size of the mapping holding beginning, 0 if it was malloc'd
+   */
+  size_t mapped_size;
+};
+
+void fwe_initialize_tape(WideInstructionTape *instrtape);
+
+void fwe_initialize_arena_tape(WideInstructionTape *instrtape);
+
+void fwe_grow(WideInstructionTape *instrtape, size_t targetlen);
+
+void fwe_freeze(WideInstructionTape *instrtape);
+
+void fwe_freeze_arena(WideInstructionTape *instrtape);
+
+void fwe_grow_pool(WideInstructionTape *instrtape, size_t targetlen);
+
+void fwe_clear_instr(WideInstructionTape *instrtape, unsigned int errorstate);
+
+void fwe_set_final_flags(WideInstructionTape *instrtape);
+
+void fwe_set_initial_flags(WideInstructionTape *instrtape);
+
+FstWideEntry *fwe_get_outgoing(WideInstructionTape *instrtape, char c);
+
+void fwe_set_outstate(FstWideEntry *fwe, unsigned int outstate);
+
+size_t fwe_add_output(WideInstructionTape *instrtape, const char *output,
+                      size_t length);
+
+size_t fwe_add_byte_table(WideInstructionTape *instrtape);
+
+void fwe_set_pooled_output(WideInstructionTape *instrtape, FstWideEntry *fwe,
+                           size_t offset, size_t length);
+
+void fwe_set_output(WideInstructionTape *instrtape, FstWideEntry *fwe,
+                    const char *output, size_t length);
+
+void fwe_finish(WideInstructionTape *instrtape);
+
+void wide_instruction_tape_destroy(WideInstructionTape *instrtape);
+
+typedef struct WideMatchObject WideMatchObject;
+
+struct WideMatchObject {
+  /**
+   * The state output
+   */
+  unsigned int *state_output;
+  /**
+   * The character output
+   */
+  char *char_output;
+
+  /**
+   * The char length
+   */
+  size_t char_length;
+
+  /**
+   * The char capacity
+   */
+  size_t char_capacity;
+
+  /**
+   * The state length
+   */
+  size_t state_length;
+
+  /**
+   * The state capacity
+   */
+  size_t state_capacity;
+
+  /**
+   * Match success
+   */
+  int match_success;
+
+  /**
+   * Beginning fst state
+   */
+  FstWideEntry *beginning;
+
+  /**
+   * Output pool of the tape being matched
+   */
+  const char *output_pool;
+
+  /**
+   * Current FST location
+   */
+  FstWideEntry *current;
+};
+
+void wide_match_initialize(WideMatchObject *match_object,
+                           WideInstructionTape *instrtape);
+
+void wide_match_destroy(WideMatchObject *match_object);
+
+void wide_match_one_char(WideMatchObject *match_object, char input);
+
+void wide_match_continue(WideMatchObject *match_object, const char *input,
+                         size_t length);
+
+void wide_match_finish(WideInstructionTape *instrtape,
+                       WideMatchObject *match_object);
+
+void wide_match_bytes(WideInstructionTape *instrtape,
+                      WideMatchObject *match_object, const char *input,
+                      size_t length);
+
+void wide_match_string(WideInstructionTape *instrtape,
+                       WideMatchObject *match_object, char const *input);
+
+WideInstructionTape *wide_from_narrow(InstructionTape *it);
+
+InstructionTape *narrow_from_wide(WideInstructionTape *wt);
+
+void wide_inspector_dumpfile(FILE *f, WideInstructionTape *it);
+
+WideInstructionTape *wide_inspector_loadfile(FILE *f);
+
+#endif /* FST_WIDE_H */
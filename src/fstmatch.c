@@ -0,0 +1,367 @@
+/**
+ * fstmatch: run a dumped tape over files or stdin, no Lua involved
+ * @file fstmatch.c
+ *
+ * fstmatch [-j threads] [-q] [-l] [-s] tape [file...]
+ *
+ * Writes what the tape outputs for each file (stdin if there are none,
+ * or for "-", which may be given once) to stdout, file after file. -j
+ * matches up to that many files at once: the earliest file still being
+ * matched writes straight to stdout, and each later one buffers up to
+ * FSTMATCH_BUFFER_LIMIT bytes before it waits for its turn. -q writes
+ * no output, -l prints "accept" or "reject"
+ * and the file name to stderr for each file. -s repacks a narrow tape
+ * into a hybrid tape first, for tapes too sparse to match well from
+ * full rows.
+ *
+ * Exits 0 if every input was accepted, 1 if one was rejected, and 2 on
+ * any error.
+ */
+#include "fst_abi.h"
+#include "fst_frozen.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define FSTMATCH_CHUNK_SIZE ((size_t) 1024 * 1024)
+#define FSTMATCH_OUTPUT_SIZE ((size_t) 64 * 1024)
+#define FSTMATCH_BUFFER_LIMIT ((size_t) 16 * 1024 * 1024)
+
+typedef struct Order Order;
+
+/**
+ * Hands stdout to the jobs one at a time, in the order they were given
+ */
+struct Order {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  /**
+   * The job that may write, only touched atomically
+   */
+  size_t turn;
+};
+
+static void order_wait(Order *order, size_t index) {
+  pthread_mutex_lock(&order->lock);
+  while (__atomic_load_n(&order->turn, __ATOMIC_ACQUIRE) != index) {
+    pthread_cond_wait(&order->changed, &order->lock);
+  }
+  pthread_mutex_unlock(&order->lock);
+}
+
+static void order_pass(Order *order) {
+  pthread_mutex_lock(&order->lock);
+  __atomic_add_fetch(&order->turn, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&order->changed);
+  pthread_mutex_unlock(&order->lock);
+}
+
+typedef struct Output Output;
+
+/**
+ * A job's output: buffered until it is the job's turn, then written
+ * through the buffer to stdout
+ */
+struct Output {
+  Order *order;
+  size_t index;
+  /**
+   * Whether it is this job's turn, so the buffer can be written
+   */
+  int writing;
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
+/**
+ * Write out the buffer, waiting for the job's turn if it must
+ */
+static void output_flush(Output *out) {
+  if (!out->writing) {
+    order_wait(out->order, out->index);
+    out->writing = 1;
+  }
+  if (out->length) {
+    fwrite(out->data, 1, out->length, stdout);
+    out->length = 0;
+  }
+}
+
+static void output_append(Output *out, const char *data, size_t length) {
+  if (out->length + length > out->capacity &&
+      (out->writing || out->capacity >= FSTMATCH_BUFFER_LIMIT ||
+       __atomic_load_n(&out->order->turn, __ATOMIC_ACQUIRE) == out->index)) {
+    output_flush(out);
+  }
+  if (out->length + length > out->capacity) {
+    out->capacity = MAX(MAX(out->capacity * 2, out->length + length),
+                        FSTMATCH_OUTPUT_SIZE);
+    out->data = (char *) realloc(out->data, out->capacity);
+    if (!out->data) {
+      perror("Memory allocation failure");
+      exit(2);
+    }
+  }
+  memcpy(out->data + out->length, data, length);
+  out->length += length;
+}
+
+typedef struct Job Job;
+
+struct Job {
+  const char *path;
+  Output out;
+  int accepted;
+  /**
+   * errno if the file couldn't be read, else 0
+   */
+  int error;
+};
+
+typedef struct Run Run;
+
+struct Run {
+  const FrozenTape *tape;
+  int quiet;
+  Order order;
+  Job *jobs;
+  size_t job_count;
+  /**
+   * Next job to take, only touched atomically
+   */
+  size_t next;
+};
+
+/**
+ * Match all of f from the start state into out, a chunk at a time
+ * through fst_match_continue
+ * @return 1 if accepted, 0 if not, -1 with errno set on a read error
+ */
+static int match_stream(const FrozenTape *tape, FILE *f, Output *out,
+                        int quiet) {
+  char *buffer = (char *) malloc(FSTMATCH_CHUNK_SIZE);
+  /* Enough for a narrow chunk, grown for wide outputs */
+  size_t output_capacity = quiet ? 0 : FSTMATCH_CHUNK_SIZE;
+  char *output = (char *) malloc(MAX(output_capacity, 1));
+  if (!buffer || !output) {
+    perror("Memory allocation failure");
+    exit(2);
+  }
+
+  unsigned int state = 0;
+  size_t total = 0;
+  size_t got;
+  FstMatchResult result;
+  result.accepted = 0;
+  errno = 0;
+  while ((got = fread(buffer, 1, FSTMATCH_CHUNK_SIZE, f)) > 0) {
+    unsigned int from = state;
+    if (fst_match_continue(tape, &state, buffer, got,
+                           quiet ? NULL : output, output_capacity, NULL, 0,
+                           &result)) {
+      /* Only output can be cut short: match the chunk again with room */
+      output_capacity = result.output_length;
+      output = (char *) realloc(output, output_capacity);
+      if (!output) {
+        perror("Memory allocation failure");
+        exit(2);
+      }
+      state = from;
+      fst_match_continue(tape, &state, buffer, got, output, output_capacity,
+                         NULL, 0, &result);
+    }
+    if (!quiet) {
+      output_append(out, output, result.output_length);
+    }
+    total += got;
+  }
+  free(buffer);
+  free(output);
+
+  if (ferror(f)) {
+    if (!errno) {
+      errno = EIO;
+    }
+    return -1;
+  }
+  return total > 0 && result.accepted;
+}
+
+static void match_job(const FrozenTape *tape, Job *job, int quiet) {
+  int use_stdin = strcmp(job->path, "-") == 0;
+  FILE *f = use_stdin ? stdin : fopen(job->path, "rb");
+  if (!f) {
+    job->error = errno;
+    return;
+  }
+  int status = match_stream(tape, f, &job->out, quiet);
+  if (status < 0) {
+    job->error = errno;
+  } else {
+    job->accepted = status;
+  }
+  if (!use_stdin) {
+    fclose(f);
+  }
+}
+
+static void *run_worker(void *arg) {
+  Run *run = (Run *) arg;
+  size_t i;
+  while ((i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) <
+         run->job_count) {
+    Job *job = run->jobs + i;
+    match_job(run->tape, job, run->quiet);
+    /* Jobs are taken in order, so the one whose turn it is always runs */
+    output_flush(&job->out);
+    fflush(stdout);
+    free(job->out.data);
+    job->out.data = NULL;
+    order_pass(&run->order);
+  }
+  return NULL;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: fstmatch [-j threads] [-q] [-l] [-s] tape [file...]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int threads = 1;
+  int quiet = 0;
+  int list = 0;
+  int hybrid = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:qls")) != -1) {
+    switch (opt) {
+    case 'j':
+      threads = atoi(optarg);
+      if (threads < 1) {
+        usage();
+      }
+      break;
+    case 'q':
+      quiet = 1;
+      break;
+    case 'l':
+      list = 1;
+      break;
+    case 's':
+      hybrid = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind >= argc) {
+    usage();
+  }
+
+  const char *tape_path = argv[optind];
+  FrozenTape *tape = fst_tape_load(tape_path);
+  if (!tape) {
+    fprintf(stderr, "fstmatch: %s is not a tape dump\n", tape_path);
+    return 2;
+  }
+  if (fst_tape_length(tape) == 0) {
+    fprintf(stderr, "fstmatch: %s is an empty tape\n", tape_path);
+    fst_tape_release(tape);
+    return 2;
+  }
+  if (hybrid && tape->kind == FROZEN_NARROW) {
+    FrozenTape *narrow = tape;
+    tape = frozen_tape_hybrid_from_narrow(&narrow->narrow);
+    fst_tape_release(narrow);
+  }
+
+  static char *stdin_only[] = {"-"};
+  char **paths = argv + optind + 1;
+  size_t count = argc - optind - 1;
+  if (count == 0) {
+    paths = stdin_only;
+    count = 1;
+  }
+  size_t stdin_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    stdin_count += strcmp(paths[i], "-") == 0;
+  }
+  if (stdin_count > 1) {
+    fprintf(stderr, "fstmatch: - given more than once\n");
+    fst_tape_release(tape);
+    return 2;
+  }
+
+  Run run;
+  run.tape = tape;
+  run.quiet = quiet;
+  run.job_count = count;
+  run.next = 0;
+  pthread_mutex_init(&run.order.lock, NULL);
+  pthread_cond_init(&run.order.changed, NULL);
+  run.order.turn = 0;
+  run.jobs = (Job *) calloc(count, sizeof(Job));
+  if (!run.jobs) {
+    perror("Memory allocation failure");
+    return 2;
+  }
+  for (size_t i = 0; i < count; i++) {
+    run.jobs[i].path = paths[i];
+    run.jobs[i].out.order = &run.order;
+    run.jobs[i].out.index = i;
+  }
+
+  if (threads == 1 || count == 1) {
+    run_worker(&run);
+  } else {
+    threads = (int) (count < (size_t) threads ? count : (size_t) threads);
+    pthread_t *workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+    int *started = (int *) calloc(threads, sizeof(int));
+    if (!workers || !started) {
+      perror("Memory allocation failure");
+      return 2;
+    }
+    for (int i = 1; i < threads; i++) {
+      started[i] = pthread_create(workers + i, NULL, run_worker, &run) == 0;
+    }
+    run_worker(&run);
+    for (int i = 1; i < threads; i++) {
+      if (started[i]) {
+        pthread_join(workers[i], NULL);
+      }
+    }
+    free(started);
+    free(workers);
+  }
+
+  int status = 0;
+  for (size_t i = 0; i < count; i++) {
+    Job *job = run.jobs + i;
+    if (job->error) {
+      fprintf(stderr, "fstmatch: %s: %s\n", job->path, strerror(job->error));
+      status = 2;
+      continue;
+    }
+    if (list) {
+      fprintf(stderr, "%s\t%s\n", job->accepted ? "accept" : "reject",
+              job->path);
+    }
+    if (!job->accepted && status == 0) {
+      status = 1;
+    }
+  }
+  fflush(stdout);
+
+  free(run.jobs);
+  pthread_mutex_destroy(&run.order.lock);
+  pthread_cond_destroy(&run.order.changed);
+  fst_tape_release(tape);
+  return status;
+}
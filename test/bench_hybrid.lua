@@ -0,0 +1,61 @@
+-- Memory and matching speed of a hybrid tape against the narrow tape
+-- it is frozen from.
+--
+--    luajit test/bench_hybrid.lua [states] [megabytes] [seed]
+--
+-- The tape has states states (60000 by default). Nine in ten have 1 to
+-- 6 letters leading somewhere other than their default, the rest up to
+-- 26, which makes them dense. The input is megabytes (50) of random
+-- lowercase letters, so the match is a random walk over the whole
+-- tape. Both tapes are matched through the FFI with no state trace, so
+-- the time is the match loop's own.
+
+local fst_fast = require("fst_fast_system")
+
+if not jit then
+   error("bench_hybrid.lua runs under LuaJIT, it matches through the FFI")
+end
+local fst_ffi = require("fst_fast_ffi")
+
+local n = tonumber(arg and arg[1]) or 60000
+local megabytes = tonumber(arg and arg[2]) or 50
+math.randomseed(tonumber(arg and arg[3]) or 1)
+
+local states = {}
+for i = 1, n do
+   local edges = {}
+   local exceptions = i % 10 == 1 and 100 or math.random(1, 6)
+   for k = 1, exceptions do
+      local letter = math.random(97, 122)
+      edges[k] = {letter, letter, math.random(0, n - 1)}
+   end
+   states[i] = {initial = i == 1, default = math.random(0, n - 1),
+                edges = edges}
+end
+local tape = fst_fast.build_tape({states = states})
+local narrow = fst_fast.freeze_tape(tape)
+local hybrid = fst_fast.freeze_hybrid_tape(tape)
+fst_fast.instruction_tape_destroy(tape)
+
+local chunk = {}
+for i = 1, 1024 * 1024 do
+   chunk[i] = string.char(math.random(97, 122))
+end
+local input = string.rep(table.concat(chunk), megabytes)
+
+local function time(frozen)
+   local handle = fst_ffi.from_frozen(frozen)
+   local out = fst_ffi.output_buffer(1)
+   local res = fst_ffi.result()
+   local start = os.clock()
+   fst_ffi.C.fst_match(handle, input, #input, out, 0, nil, 0, res)
+   return os.clock() - start
+end
+
+local kinds = hybrid:row_kinds()
+print(string.format("%d states: %d default, %d sparse, %d dense rows",
+                    n, kinds.default, kinds.sparse, kinds.dense))
+print(string.format("narrow %8.1f MB %6.2f s",
+                    narrow:length() * 1024 / 1e6, time(narrow)))
+print(string.format("hybrid %8.1f MB %6.2f s",
+                    kinds.bytes / 1e6, time(hybrid)))
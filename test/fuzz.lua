@@ -0,0 +1,612 @@
+-- Differential fuzzing of every matching engine against the reference,
+-- the match_one_char loop behind fst_fast.match_string.
+--
+--    lua test/fuzz.lua [iterations] [seed]
+--
+-- Each iteration builds a random narrow tape with build_tape and runs
+-- random inputs through every engine: the parallel matcher, frozen
+-- tapes, registries, the match cache, stepped matchers, match_file,
+-- each dump format loaded back, wide tapes, hybrid tapes, a tape built
+-- edge by edge in an arena, and the FFI under LuaJIT. The output, the
+-- accept bit and the state trace must all equal the reference's.
+--
+-- Each iteration also builds a random wide tape, whose outputs run to
+-- several bytes and include NULs, and checks the engines that take
+-- wide tapes against fst_fast.wide_match_string.
+--
+-- A mismatch is shrunk to a small tape and input, then reported as Lua
+-- source.
+
+local fst_fast = require("fst_fast_system")
+
+local fuzz = {}
+
+-- Long inputs the parallel engine matched in more than one chunk
+fuzz.splits = 0
+
+local function random_byte(hot)
+   if #hot > 0 and math.random() < 0.8 then
+      return hot[math.random(#hot)]
+   end
+   return math.random(0, 255)
+end
+
+-- A build_tape spec with up to 6 states
+function fuzz.random_spec()
+   local n = math.random(1, 6)
+   local spec = {default = math.random(0, n - 1), states = {}}
+   for i = 1, n do
+      local state = {initial = i == 1, final = math.random() < 0.4,
+                     edges = {}}
+      if math.random() < 0.3 then
+         state.default = math.random(0, n - 1)
+      end
+      for _ = 1, math.random(0, 5) do
+         local lo = math.random(0, 255)
+         local hi = math.min(255, lo + (math.random() < 0.7 and 0 or
+                                           math.random(0, 40)))
+         local output
+         local r = math.random()
+         if r < 0.3 then
+            output = string.char(math.random(1, 255))
+         elseif r < 0.5 then
+            output = true
+         end
+         table.insert(state.edges, {lo, hi, math.random(0, n - 1), output})
+      end
+      spec.states[i] = state
+   end
+   return spec
+end
+
+-- A wide build_tape spec with up to 6 states, whose outputs are up to
+-- 6 bytes long and often hold NULs
+function fuzz.random_wide_spec()
+   local spec = fuzz.random_spec()
+   spec.wide = true
+   for _, state in ipairs(spec.states) do
+      for _, edge in ipairs(state.edges) do
+         if type(edge[4]) == "string" then
+            local bytes = {}
+            for i = 1, math.random(1, 6) do
+               bytes[i] = string.char(math.random() < 0.3 and 0 or
+                                         math.random(0, 255))
+            end
+            edge[4] = table.concat(bytes)
+         end
+      end
+   end
+   return spec
+end
+
+-- Bytes named by the spec's edges, which random inputs favour
+local function hot_bytes(spec)
+   local hot = {}
+   for _, state in ipairs(spec.states) do
+      for _, edge in ipairs(state.edges) do
+         table.insert(hot, math.random(edge[1], edge[2]))
+      end
+   end
+   return hot
+end
+
+function fuzz.random_input(spec, long)
+   local hot = hot_bytes(spec)
+   -- Long inputs are past 4 threads * PARALLEL_MIN_CHUNK, so they split
+   local length = long and math.random(270000, 400000) or math.random(0, 40)
+   local bytes = {}
+   for i = 1, math.min(length, 4096) do
+      bytes[i] = string.char(random_byte(hot))
+   end
+   local input = table.concat(bytes)
+   if length > #input then
+      input = string.rep(input, math.ceil(length / #input)):sub(1, length)
+   end
+   return input
+end
+
+local function tmpname()
+   local path = os.tmpname()
+   os.remove(path)
+   return path
+end
+
+local function has_nul_edge(spec)
+   for _, state in ipairs(spec.states) do
+      for _, edge in ipairs(state.edges) do
+         if edge[1] == 0 then
+            return true
+         end
+      end
+   end
+   return false
+end
+
+-- The same tape as build_tape(spec), built one edge at a time in an
+-- arena. The edge calls can't name byte 0, so this gives up on specs
+-- that do.
+local function arena_tape(spec)
+   if has_nul_edge(spec) then
+      return nil
+   end
+   local tape = fst_fast.get_instruction_tape({arena = true})
+   for _, state in ipairs(spec.states) do
+      fst_fast.fse_clear_instr(tape, state.default or spec.default)
+      if state.initial then
+         fst_fast.fse_set_initial_flags(tape)
+      end
+      if state.final then
+         fst_fast.fse_set_final_flags(tape)
+      end
+      -- Later edges win, as in build_tape
+      local targets = {}
+      for _, edge in ipairs(state.edges) do
+         for b = edge[1], edge[2] do
+            targets[b] = edge
+         end
+      end
+      for b, edge in pairs(targets) do
+         local c = string.char(b)
+         local fse = fst_fast.fse_get_outgoing(tape, c)
+         fst_fast.fse_set_outstate(fse, edge[3])
+         local output = edge[4] == true and c or edge[4]
+         if output then
+            fst_fast.fse_set_outchar(fse, output)
+         end
+      end
+      fst_fast.fse_finish(tape)
+   end
+   return tape
+end
+
+local function same_states(a, b)
+   if #a ~= #b then
+      return false
+   end
+   for i = 1, #a do
+      if a[i] ~= b[i] then
+         return false
+      end
+   end
+   return true
+end
+
+-- Match each input on a frozen tape twice through a match cache, which
+-- must answer the second time exactly as the first
+local function cache_engine(name, freeze)
+   return {name = name, setup = function(tape)
+       local frozen = freeze(tape)
+       local cache = fst_fast.match_cache(1024 * 1024)
+       return function(input)
+          local outstr, match_success, matched_states =
+             cache:match_string(frozen, input)
+          local hit_outstr, hit_success, hit_states =
+             cache:match_string(frozen, input)
+          if hit_outstr ~= outstr or hit_success ~= match_success or
+             not same_states(hit_states, matched_states) then
+             return nil, "cache hit differs from its miss"
+          end
+          return outstr, match_success, matched_states
+       end
+   end}
+end
+
+-- Step a matcher on a frozen tape through each input
+local function matcher_engine(name, freeze)
+   return {name = name, setup = function(tape)
+       local frozen = freeze(tape)
+       return function(input)
+          local m = fst_fast.matcher(frozen, input)
+          local budget = math.random(1, 17)
+          local outstr, match_success, matched_states = m:step(budget)
+          while not outstr do
+             outstr, match_success, matched_states = m:step(budget)
+          end
+          return outstr, match_success, matched_states
+       end
+   end}
+end
+
+-- Each engine's setup takes the reference tape and its spec and
+-- returns a match function, plus a cleanup function if it needs one
+fuzz.engines = {
+   {name = "parallel", setup = function(tape)
+       return function(input)
+          local outstr, match_success, matched_states, chunks =
+             fst_fast.match_string_parallel(input, tape, 4)
+          if chunks > 1 then
+             fuzz.splits = fuzz.splits + 1
+          end
+          return outstr, match_success, matched_states
+       end
+   end},
+   {name = "slice", setup = function(tape)
+       return function(input)
+          return fst_fast.match_string("<<" .. input .. ">>", tape, 2, #input)
+       end
+   end},
+   {name = "frozen", setup = function(tape)
+       local frozen = fst_fast.freeze_tape(tape)
+       return function(input) return frozen:match_string(input) end
+   end},
+   {name = "import", setup = function(tape)
+       local frozen = fst_fast.import_tape(fst_fast.freeze_tape(tape):export())
+       return function(input) return frozen:match_string(input) end
+   end},
+   {name = "registry", setup = function(tape)
+       local registry = fst_fast.tape_registry()
+       registry:publish(fst_fast.freeze_tape(tape))
+       return function(input)
+          local outstr, match_success, matched_states =
+             registry:match_string(input)
+          return outstr, match_success, matched_states
+       end
+   end},
+   cache_engine("cache", fst_fast.freeze_tape),
+   matcher_engine("matcher", fst_fast.freeze_tape),
+   {name = "file", setup = function(tape)
+       local frozen = fst_fast.freeze_tape(tape)
+       local path = tmpname()
+       return function(input)
+          local f = assert(io.open(path, "wb"))
+          f:write(input)
+          f:close()
+          return fst_fast.match_file(frozen, path, {threads = 4})
+       end, function() os.remove(path) end
+   end},
+   {name = "dump", setup = function(tape)
+       local path = tmpname()
+       fst_fast.inspector_dumpfile(tape, path)
+       local loaded = fst_fast.inspector_loadfile(path)
+       os.remove(path)
+       return function(input) return fst_fast.match_string(input, loaded) end,
+          function() fst_fast.instruction_tape_destroy(loaded) end
+   end},
+   {name = "compact", setup = function(tape)
+       local path = tmpname()
+       fst_fast.compact_dumpfile(tape, path)
+       local loaded = fst_fast.compact_loadfile(path, 2)
+       os.remove(path)
+       return function(input) return fst_fast.match_string(input, loaded) end,
+          function() fst_fast.instruction_tape_destroy(loaded) end
+   end},
+   {name = "wide", setup = function(tape)
+       local wide = fst_fast.wide_from_narrow(tape)
+       return function(input) return fst_fast.wide_match_string(input, wide) end,
+          function() fst_fast.wide_instruction_tape_destroy(wide) end
+   end},
+   {name = "wide dump", setup = function(tape)
+       local wide = fst_fast.wide_from_narrow(tape)
+       local path = tmpname()
+       fst_fast.wide_inspector_dumpfile(wide, path)
+       fst_fast.wide_instruction_tape_destroy(wide)
+       local loaded = fst_fast.wide_inspector_loadfile(path)
+       os.remove(path)
+       return function(input)
+          return fst_fast.wide_match_string(input, loaded)
+       end, function() fst_fast.wide_instruction_tape_destroy(loaded) end
+   end},
+   {name = "wide compact", setup = function(tape)
+       local wide = fst_fast.wide_from_narrow(tape)
+       local path = tmpname()
+       fst_fast.wide_compact_dumpfile(wide, path)
+       fst_fast.wide_instruction_tape_destroy(wide)
+       local loaded = fst_fast.wide_compact_loadfile(path)
+       os.remove(path)
+       return function(input)
+          return fst_fast.wide_match_string(input, loaded)
+       end, function() fst_fast.wide_instruction_tape_destroy(loaded) end
+   end},
+   {name = "wide frozen", setup = function(tape)
+       local wide = fst_fast.wide_from_narrow(tape)
+       local frozen = fst_fast.freeze_wide_tape(wide)
+       fst_fast.wide_instruction_tape_destroy(wide)
+       return function(input) return frozen:match_string(input) end
+   end},
+   {name = "hybrid", setup = function(tape)
+       local frozen = fst_fast.freeze_hybrid_tape(tape)
+       return function(input) return frozen:match_string(input) end
+   end},
+   matcher_engine("hybrid matcher", fst_fast.freeze_hybrid_tape),
+   {name = "hybrid file", setup = function(tape)
+       local frozen = fst_fast.freeze_hybrid_tape(tape)
+       local path = tmpname()
+       return function(input)
+          local f = assert(io.open(path, "wb"))
+          f:write(input)
+          f:close()
+          return fst_fast.match_file(frozen, path)
+       end, function() os.remove(path) end
+   end},
+   {name = "arena", setup = function(tape, spec)
+       local built = arena_tape(spec)
+       if not built then
+          return nil
+       end
+       return function(input) return fst_fast.match_string(input, built) end,
+          function() fst_fast.instruction_tape_destroy(built) end
+   end},
+}
+
+-- The same for wide tapes, checked against wide_match_string
+fuzz.wide_engines = {
+   {name = "slice", setup = function(tape)
+       return function(input)
+          return fst_fast.wide_match_string("<<" .. input .. ">>", tape, 2,
+                                            #input)
+       end
+   end},
+   {name = "frozen", setup = function(tape)
+       local frozen = fst_fast.freeze_wide_tape(tape)
+       return function(input) return frozen:match_string(input) end
+   end},
+   {name = "registry", setup = function(tape)
+       local registry = fst_fast.tape_registry()
+       registry:publish(fst_fast.freeze_wide_tape(tape))
+       return function(input)
+          local outstr, match_success, matched_states =
+             registry:match_string(input)
+          return outstr, match_success, matched_states
+       end
+   end},
+   cache_engine("cache", fst_fast.freeze_wide_tape),
+   matcher_engine("matcher", fst_fast.freeze_wide_tape),
+   {name = "file", setup = function(tape)
+       local path = tmpname()
+       return function(input)
+          local f = assert(io.open(path, "wb"))
+          f:write(input)
+          f:close()
+          return fst_fast.match_file(tape, path, {wide = true})
+       end, function() os.remove(path) end
+   end},
+   {name = "dump", setup = function(tape)
+       local path = tmpname()
+       fst_fast.wide_inspector_dumpfile(tape, path)
+       local loaded = fst_fast.wide_inspector_loadfile(path)
+       os.remove(path)
+       return function(input)
+          return fst_fast.wide_match_string(input, loaded)
+       end, function() fst_fast.wide_instruction_tape_destroy(loaded) end
+   end},
+   {name = "compact", setup = function(tape)
+       local path = tmpname()
+       fst_fast.wide_compact_dumpfile(tape, path)
+       local loaded = fst_fast.wide_compact_loadfile(path)
+       os.remove(path)
+       return function(input)
+          return fst_fast.wide_match_string(input, loaded)
+       end, function() fst_fast.wide_instruction_tape_destroy(loaded) end
+   end},
+}
+
+local function ffi_engine(name, freeze)
+   return {name = name, setup = function(tape)
+       local ffi = require("ffi")
+       local fst_ffi = require("fst_fast_ffi")
+       local handle = fst_ffi.from_frozen(freeze(tape))
+       local res = fst_ffi.result()
+       return function(input)
+          -- Wide outputs are at most 6 bytes a step
+          local capacity = 6 * #input + 1
+          local out = fst_ffi.output_buffer(capacity)
+          local states = fst_ffi.state_buffer(#input + 1)
+          fst_ffi.match(handle, input, #input, out, capacity, states,
+                        #input + 1, res)
+          local matched_states = {}
+          for i = 1, tonumber(res.state_length) do
+             matched_states[i] = states[i - 1]
+          end
+          return ffi.string(out, res.output_length), res.accepted ~= 0,
+             matched_states
+       end
+   end}
+end
+
+if jit then
+   table.insert(fuzz.engines, ffi_engine("ffi", fst_fast.freeze_tape))
+   table.insert(fuzz.engines,
+                ffi_engine("ffi hybrid", fst_fast.freeze_hybrid_tape))
+   table.insert(fuzz.wide_engines,
+                ffi_engine("ffi", fst_fast.freeze_wide_tape))
+end
+
+-- The kinds of tape fuzzed: how to make a spec, the reference match,
+-- how to free a tape and the engines checked against the reference
+fuzz.families = {
+   {name = "narrow", random_spec = fuzz.random_spec,
+    match = fst_fast.match_string,
+    destroy = fst_fast.instruction_tape_destroy, engines = fuzz.engines},
+   {name = "wide", random_spec = fuzz.random_wide_spec,
+    match = fst_fast.wide_match_string,
+    destroy = fst_fast.wide_instruction_tape_destroy,
+    engines = fuzz.wide_engines},
+}
+
+-- A Lua string literal for s, with every unprintable byte escaped
+local function quote(s)
+   return '"' .. (s:gsub('[%c"\\\128-\255]', function(c)
+      return string.format("\\%d", c:byte())
+   end)) .. '"'
+end
+
+-- nil if engine agrees with family's reference on input, else what
+-- differs
+local function compare(family, tape, run, input)
+   local outstr, match_success, matched_states = family.match(input, tape)
+   local ok, got_outstr, got_success, got_states = pcall(run, input)
+   if not ok then
+      return "raised " .. tostring(got_outstr)
+   end
+   if got_outstr == nil then
+      return tostring(got_success)
+   end
+   if got_outstr ~= outstr then
+      return "output " .. quote(got_outstr) .. ", expected " .. quote(outstr)
+   end
+   if got_success ~= match_success then
+      return string.format("accept %s, expected %s", tostring(got_success),
+                           tostring(match_success))
+   end
+   if not same_states(got_states, matched_states) then
+      return "state trace differs"
+   end
+   return nil
+end
+
+-- Run one engine on one spec and input, nil if they agree
+local function check(family, engine, spec, input)
+   local tape = fst_fast.build_tape(spec)
+   local run, cleanup = engine.setup(tape, spec)
+   local difference
+   if run then
+      difference = compare(family, tape, run, input)
+   end
+   if cleanup then
+      cleanup()
+   end
+   family.destroy(tape)
+   collectgarbage()
+   return difference
+end
+
+local function copy_spec(spec)
+   local copy = {wide = spec.wide, default = spec.default, states = {}}
+   for i, state in ipairs(spec.states) do
+      local edges = {}
+      for j, edge in ipairs(state.edges) do
+         edges[j] = {edge[1], edge[2], edge[3], edge[4]}
+      end
+      copy.states[i] = {initial = state.initial, final = state.final,
+                        default = state.default, edges = edges}
+   end
+   return copy
+end
+
+-- Shrink a failing case: drop input bytes, then edges, then outputs,
+-- keeping every change that still fails
+function fuzz.minimize(family, engine, spec, input)
+   local chunk = math.floor(#input / 2)
+   while chunk >= 1 do
+      local start = 1
+      while start <= #input do
+         local smaller = input:sub(1, start - 1) .. input:sub(start + chunk)
+         if check(family, engine, spec, smaller) then
+            input = smaller
+         else
+            start = start + chunk
+         end
+      end
+      chunk = math.floor(chunk / 2)
+   end
+
+   for state_index = 1, #spec.states do
+      local j = 1
+      while j <= #spec.states[state_index].edges do
+         local smaller = copy_spec(spec)
+         table.remove(smaller.states[state_index].edges, j)
+         if check(family, engine, smaller, input) then
+            spec = smaller
+         else
+            local plain = copy_spec(spec)
+            plain.states[state_index].edges[j][4] = nil
+            if spec.states[state_index].edges[j][4] ~= nil and
+               check(family, engine, plain, input) then
+               spec = plain
+            end
+            j = j + 1
+         end
+      end
+   end
+   return spec, input
+end
+
+local function serialize(v)
+   if type(v) == "table" then
+      local parts = {}
+      for k, x in pairs(v) do
+         if type(k) == "number" then
+            parts[#parts + 1] = serialize(x)
+         else
+            parts[#parts + 1] = k .. " = " .. serialize(x)
+         end
+      end
+      return "{" .. table.concat(parts, ", ") .. "}"
+   elseif type(v) == "string" then
+      return quote(v)
+   end
+   return tostring(v)
+end
+
+-- Fuzz one family's engines on spec, nil if they all agree, else a
+-- report on the first mismatch, shrunk
+local function run_family(family, iteration, spec, inputs)
+   local tape = fst_fast.build_tape(spec)
+   for _, engine in ipairs(family.engines) do
+      local run, cleanup = engine.setup(tape, spec)
+      for _, input in ipairs(inputs) do
+         if run and compare(family, tape, run, input) then
+            if cleanup then
+               cleanup()
+            end
+            family.destroy(tape)
+            local small_spec, small_input =
+               fuzz.minimize(family, engine, spec, input)
+            return string.format(
+               "%s engine %s, iteration %d: %s\nspec = %s\ninput = %s",
+               family.name, engine.name, iteration,
+               check(family, engine, small_spec, small_input) or "flaky",
+               serialize(small_spec), quote(small_input))
+         end
+      end
+      if cleanup then
+         cleanup()
+      end
+   end
+   family.destroy(tape)
+   collectgarbage()
+   return nil
+end
+
+-- Fuzz for iterations tapes of each family. Returns nil if every engine
+-- always agreed, else a report on the first mismatch, shrunk.
+function fuzz.run(iterations, seed)
+   math.randomseed(seed or os.time())
+   fuzz.splits = 0
+   for iteration = 1, iterations do
+      for _, family in ipairs(fuzz.families) do
+         local spec = family.random_spec()
+         local inputs = {}
+         for i = 1, 8 do
+            inputs[i] = fuzz.random_input(spec, false)
+         end
+         if iteration % 10 == 0 then
+            table.insert(inputs, fuzz.random_input(spec, true))
+         end
+         local report = run_family(family, iteration, spec, inputs)
+         if report then
+            return report
+         end
+      end
+   end
+   -- Every tenth iteration's long input should have been split
+   if iterations >= 10 and fuzz.splits == 0 then
+      return "the parallel engine never split an input"
+   end
+   return nil
+end
+
+if arg and arg[0] and arg[0]:match("fuzz%.lua$") then
+   local iterations = tonumber(arg[1]) or 1000
+   local seed = tonumber(arg[2]) or os.time()
+   local report = fuzz.run(iterations, seed)
+   if report then
+      print("seed " .. seed .. ": " .. report)
+      os.exit(1)
+   end
+   print(string.format("%d tapes, %d + %d engines, %d parallel splits, " ..
+                          "seed %d: no differences", iterations,
+                       #fuzz.engines, #fuzz.wide_engines, fuzz.splits, seed))
+end
+
+return fuzz
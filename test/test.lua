@@ -101,4 +101,974 @@ function testFromLua()
    fst_fast.instruction_tape_destroy(instrtape)
 end
 
+function testWide()
+   -- Emits "<" .. input .. ">" with a NUL after each "b"
+   local wt = fst_fast.get_wide_instruction_tape()
+
+   -- State 0
+   fst_fast.fwe_clear_instr(wt, 2)
+   fst_fast.fwe_set_initial_flags(wt)
+
+   local fwe = fst_fast.fwe_get_outgoing(wt, 'a')
+   fst_fast.fwe_set_outstate(fwe, 1)
+   fst_fast.fwe_set_output(wt, fwe, "<a")
+
+   fst_fast.fwe_finish(wt)
+
+   -- State 1
+   fst_fast.fwe_clear_instr(wt, 2)
+   fst_fast.fwe_set_final_flags(wt)
+
+   local fwe = fst_fast.fwe_get_outgoing(wt, 'b')
+   fst_fast.fwe_set_outstate(fwe, 1)
+   fst_fast.fwe_set_output(wt, fwe, "b\0")
+
+   local fwe = fst_fast.fwe_get_outgoing(wt, '\255')
+   fst_fast.fwe_set_outstate(fwe, 1)
+   fst_fast.fwe_set_output(wt, fwe, ">>")
+
+   fst_fast.fwe_finish(wt)
+
+   -- State 2
+   fst_fast.fwe_clear_instr(wt, 2)
+   fst_fast.fwe_finish(wt)
+
+   local outstr, match_success, matched_states = fst_fast.wide_match_string("abb\255", wt)
+
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(outstr, "<ab\0b\0>>")
+   luaunit.assertEquals(matched_states, {1, 1, 1, 1})
+
+   local filename = os.tmpname()
+   fst_fast.wide_inspector_dumpfile(wt, filename)
+   fst_fast.wide_instruction_tape_destroy(wt)
+
+   local loaded = fst_fast.wide_inspector_loadfile(filename)
+   os.remove(filename)
+
+   luaunit.assertEquals(fst_fast.wide_inspector_get_length(loaded), 3)
+
+   local outstr, match_success, matched_states = fst_fast.wide_match_string("ac", loaded)
+
+   luaunit.assertFalse(match_success)
+   luaunit.assertEquals(outstr, "<a")
+   luaunit.assertEquals(matched_states, {1, 2})
+
+   fst_fast.wide_instruction_tape_destroy(loaded)
+end
+
+function testBuildTape()
+   -- Same little guy as testFromLua, in one call
+   local instrtape = fst_fast.build_tape({
+         default = 6,
+         states = {
+            {initial = true, edges = {{'a', 'a', 1, 'a'}}},
+            {edges = {{'a', 'a', 2, 'a'}, {'b', 'b', 4, 'b'}}},
+            {edges = {{'x', 'x', 3, 'x'}}},
+            {final = true},
+            {edges = {{'x', 'x', 5, 'x'}}},
+            {final = true},
+            {}
+         }
+   })
+
+   local outstr, match_success, matched_states = fst_fast.match_string("aax", instrtape)
+
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(outstr, "aax")
+   luaunit.assertEquals(matched_states, {1, 2, 3})
+   luaunit.assertEquals(fst_fast.inspector_get_length(instrtape), 7)
+
+   fst_fast.instruction_tape_destroy(instrtape)
+
+   -- Byte ranges: echo lowercase words, drop digits
+   local wt = fst_fast.build_tape({
+         wide = true,
+         states = {
+            {final = true, default = 1,
+             edges = {{'a', 'z', 0, true}, {'0', '9', 0}, {' ', ' ', 0, "_"}}},
+            {default = 1}
+         }
+   })
+
+   local outstr, match_success = fst_fast.wide_match_string("ab1 c", wt)
+
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(outstr, "ab_c")
+
+   fst_fast.wide_instruction_tape_destroy(wt)
+
+   -- An edge's output is pooled once, not once per byte or state
+   wt = fst_fast.build_tape({
+         wide = true,
+         states = {
+            {edges = {{0, 255, 1, "hello"}}},
+            {final = true, edges = {{0, 255, 0, "hello"}, {'a', 'z', 1, true}}}
+         }
+   })
+   outstr, match_success = fst_fast.wide_match_string("xab", wt)
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(outstr, "helloab")
+   local path = os.tmpname()
+   fst_fast.wide_inspector_dumpfile(wt, path)
+   local f = io.open(path, "rb")
+   local size = f:seek("end")
+   f:close()
+   os.remove(path)
+   local pool_length = size - 4 - 2 * 8 - 2 * 256 * 12
+   luaunit.assertEquals(pool_length, 2 * 5 + 256)
+   fst_fast.wide_instruction_tape_destroy(wt)
+
+   luaunit.assertError(fst_fast.build_tape, {states = {{edges = {{'a', 'a', 2}}}}})
+end
+
+function testBuildDictionary()
+   local words = {
+      {"", "empty"}, {"mop", "noun"}, {"mope", "verb"}, {"moped", "noun"},
+      {"top", "noun"}, {"tope", "verb"}, {"toped", "verb\0past"}
+   }
+
+   local i = 0
+   local wt = fst_fast.build_dictionary(function()
+         i = i + 1
+         if words[i] then
+            return words[i][1], words[i][2]
+         end
+   end)
+
+   for _, word in ipairs(words) do
+      local outstr, match_success = fst_fast.wide_match_string(word[1] .. "\n", wt)
+      luaunit.assertTrue(match_success)
+      luaunit.assertEquals(outstr, word[2])
+   end
+
+   local _, match_success = fst_fast.wide_match_string("mo\n", wt)
+   luaunit.assertFalse(match_success)
+   local _, match_success = fst_fast.wide_match_string("mope", wt)
+   luaunit.assertFalse(match_success)
+
+   -- start, error, accept, and the suffixes "", "d", "ed", "ped" shared
+   -- only where the outputs agree
+   luaunit.assertTrue(fst_fast.wide_inspector_get_length(wt) < 14)
+
+   fst_fast.wide_instruction_tape_destroy(wt)
+
+   local filename = os.tmpname()
+   local f = io.open(filename, "w")
+   f:write("apple,1\napply,2\nbanana,3\n")
+   f:close()
+
+   local wt = fst_fast.build_dictionary(filename, {separator = ",", terminator = ";"})
+   os.remove(filename)
+
+   local outstr, match_success = fst_fast.wide_match_string("apply;", wt)
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(outstr, "2")
+
+   fst_fast.wide_instruction_tape_destroy(wt)
+
+   local unsorted = {"b", "a"}
+   local j = 0
+   luaunit.assertError(fst_fast.build_dictionary, function()
+         j = j + 1
+         return unsorted[j], "x"
+   end)
+end
+
+function testCompactDumpLoad()
+   local instrtape = fst_fast.get_instruction_tape()
+   fst_fast.create_pegreg_diffmatch(instrtape)
+
+   local filename = os.tmpname()
+   fst_fast.compact_dumpfile(instrtape, filename)
+   fst_fast.instruction_tape_destroy(instrtape)
+
+   local f = io.open(filename, "rb")
+   luaunit.assertTrue(f:seek("end") < 7 * 256)
+   f:close()
+
+   local loaded = fst_fast.compact_loadfile(filename, 2)
+   os.remove(filename)
+
+   local outstr, match_success, matched_states = fst_fast.match_string("aax", loaded)
+
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(outstr, "aax")
+   luaunit.assertEquals(matched_states, {1, 2, 3})
+   luaunit.assertEquals(fst_fast.inspector_get_length(loaded), 7)
+
+   fst_fast.instruction_tape_destroy(loaded)
+
+   local words = {{"ab", "1"}, {"abc", "2\0"}, {"b", "3"}}
+   local i = 0
+   local wt = fst_fast.build_dictionary(function()
+         i = i + 1
+         if words[i] then
+            return words[i][1], words[i][2]
+         end
+   end)
+
+   fst_fast.wide_compact_dumpfile(wt, filename)
+   fst_fast.wide_instruction_tape_destroy(wt)
+
+   luaunit.assertError(fst_fast.compact_loadfile, filename)
+
+   local loaded = fst_fast.wide_compact_loadfile(filename)
+   os.remove(filename)
+
+   for _, word in ipairs(words) do
+      local outstr, match_success = fst_fast.wide_match_string(word[1] .. "\n", loaded)
+      luaunit.assertTrue(match_success)
+      luaunit.assertEquals(outstr, word[2])
+   end
+
+   fst_fast.wide_instruction_tape_destroy(loaded)
+
+   -- Every letter shares one long output: it is stored once, before and
+   -- after a round trip
+   local long = string.rep("x", 1000)
+   local shared = fst_fast.build_tape({
+         wide = true,
+         states = {{initial = true, final = true,
+                    edges = {{'a', 'z', 0, long}}}}
+   })
+   for _ = 1, 2 do
+      fst_fast.wide_compact_dumpfile(shared, filename)
+      fst_fast.wide_instruction_tape_destroy(shared)
+      f = io.open(filename, "rb")
+      luaunit.assertTrue(f:seek("end") < 2 * #long)
+      f:close()
+      shared = fst_fast.wide_compact_loadfile(filename)
+   end
+   os.remove(filename)
+   luaunit.assertEquals(fst_fast.wide_match_string("abz", shared),
+                        string.rep(long, 3))
+   fst_fast.wide_instruction_tape_destroy(shared)
+end
+
+function testProducts()
+   local diffmatch = fst_fast.get_instruction_tape()
+   fst_fast.create_pegreg_diffmatch(diffmatch)
+
+   -- Uppercases a and b, deletes x, accepts anything
+   local upper = fst_fast.build_tape({
+         states = {
+            {final = true,
+             edges = {{0, 255, 0, true}, {'a', 'a', 0, 'A'}, {'b', 'b', 0, 'B'},
+                {'x', 'x', 0}}}
+         }
+   })
+
+   local fused = fst_fast.compose(diffmatch, upper)
+
+   for _, input in ipairs({"aax", "abx", "ab", "aaxa", "b", "x"}) do
+      local mid, ok1 = fst_fast.match_string(input, diffmatch)
+      local out, ok2 = fst_fast.match_string(mid, upper)
+      local outstr, match_success = fst_fast.match_string(input, fused)
+      luaunit.assertEquals(outstr, out)
+      luaunit.assertEquals(match_success, ok1 and ok2)
+   end
+
+   local both = fst_fast.intersect(diffmatch, upper)
+   local either = fst_fast.union(upper, diffmatch)
+
+   local outstr, match_success = fst_fast.match_string("abx", both)
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(outstr, "abx")
+   local _, match_success = fst_fast.match_string("abb", both)
+   luaunit.assertFalse(match_success)
+
+   local outstr, match_success = fst_fast.match_string("abb", either)
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(outstr, "ABB")
+
+   -- Only reachable pairs are built
+   luaunit.assertEquals(fst_fast.inspector_get_length(both), 7)
+
+   for _, tape in ipairs({diffmatch, upper, fused, both, either}) do
+      fst_fast.instruction_tape_destroy(tape)
+   end
+end
+
+function testArenaTape()
+   -- Big enough to span several arena chunks and a huge page
+   local n = 5000
+   local instrtape = fst_fast.get_instruction_tape({arena = true})
+
+   fst_fast.fse_clear_instr(instrtape, 1)
+   fst_fast.fse_set_initial_flags(instrtape)
+   local first = fst_fast.fse_get_outgoing(instrtape, 'a')
+   fst_fast.fse_finish(instrtape)
+
+   for i = 1, n - 1 do
+      fst_fast.fse_clear_instr(instrtape, (i + 1) % n)
+      if i == n - 1 then
+         fst_fast.fse_set_final_flags(instrtape)
+      end
+      fst_fast.fse_finish(instrtape)
+   end
+
+   -- Still good after the arena grew
+   fst_fast.fse_set_outstate(first, n - 1)
+   fst_fast.fse_set_outchar(first, 'z')
+
+   fst_fast.fse_freeze(instrtape)
+
+   local outstr, match_success, matched_states = fst_fast.match_string("a", instrtape)
+
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(outstr, "z")
+   luaunit.assertEquals(matched_states, {n - 1})
+
+   local _, _, matched_states = fst_fast.match_string("bbb", instrtape)
+   luaunit.assertEquals(matched_states, {1, 2, 3})
+
+   fst_fast.instruction_tape_destroy(instrtape)
+end
+
+function testArenaTapeReaders()
+   -- 'a' goes to the final state 1 writing 'x', anything else stays
+   local function narrow()
+      local tape = fst_fast.get_instruction_tape({arena = true})
+      fst_fast.fse_clear_instr(tape, 0)
+      fst_fast.fse_set_initial_flags(tape)
+      local outgoing = fst_fast.fse_get_outgoing(tape, 'a')
+      fst_fast.fse_set_outstate(outgoing, 1)
+      fst_fast.fse_set_outchar(outgoing, 'x')
+      fst_fast.fse_finish(tape)
+      fst_fast.fse_clear_instr(tape, 1)
+      fst_fast.fse_set_final_flags(tape)
+      fst_fast.fse_finish(tape)
+      return tape
+   end
+   local function wide()
+      local tape = fst_fast.get_wide_instruction_tape({arena = true})
+      fst_fast.fwe_clear_instr(tape, 0)
+      fst_fast.fwe_set_initial_flags(tape)
+      local outgoing = fst_fast.fwe_get_outgoing(tape, 'a')
+      fst_fast.fwe_set_outstate(outgoing, 1)
+      fst_fast.fwe_set_output(tape, outgoing, "x")
+      fst_fast.fwe_finish(tape)
+      fst_fast.fwe_clear_instr(tape, 1)
+      fst_fast.fwe_set_final_flags(tape)
+      fst_fast.fwe_finish(tape)
+      return tape
+   end
+   local path = os.tmpname()
+
+   -- Each reader gets a tape still in its arena
+   local tape = narrow()
+   luaunit.assertTrue(fst_fast.inspector_is_final(tape, 1))
+   fst_fast.instruction_tape_destroy(tape)
+
+   tape = narrow()
+   local outgoings = fst_fast.inspector_outgoings(tape, 0)
+   luaunit.assertEquals(outgoings[98], {input = "a", output = "x", state = 1})
+   fst_fast.instruction_tape_destroy(tape)
+
+   tape = narrow()
+   fst_fast.inspector_dumpfile(tape, path)
+   fst_fast.instruction_tape_destroy(tape)
+   tape = fst_fast.inspector_loadfile(path)
+   luaunit.assertEquals(fst_fast.match_string("ba", tape), "x")
+   fst_fast.instruction_tape_destroy(tape)
+
+   tape = narrow()
+   fst_fast.compact_dumpfile(tape, path)
+   fst_fast.instruction_tape_destroy(tape)
+   tape = fst_fast.compact_loadfile(path)
+   luaunit.assertEquals(fst_fast.match_string("ba", tape), "x")
+   fst_fast.instruction_tape_destroy(tape)
+
+   tape = narrow()
+   local wt = fst_fast.wide_from_narrow(tape)
+   fst_fast.instruction_tape_destroy(tape)
+   local outstr, match_success = fst_fast.wide_match_string("ba", wt)
+   luaunit.assertEquals(outstr, "x")
+   luaunit.assertTrue(match_success)
+   fst_fast.wide_instruction_tape_destroy(wt)
+
+   wt = wide()
+   fst_fast.wide_inspector_dumpfile(wt, path)
+   fst_fast.wide_instruction_tape_destroy(wt)
+   wt = fst_fast.wide_inspector_loadfile(path)
+   luaunit.assertEquals(fst_fast.wide_match_string("ba", wt), "x")
+   fst_fast.wide_instruction_tape_destroy(wt)
+
+   wt = wide()
+   tape = fst_fast.narrow_from_wide(wt)
+   fst_fast.wide_instruction_tape_destroy(wt)
+   luaunit.assertEquals(fst_fast.match_string("ba", tape), "x")
+   fst_fast.instruction_tape_destroy(tape)
+
+   local a, b = wide(), wide()
+   wt = fst_fast.wide_intersect(a, b)
+   outstr, match_success = fst_fast.wide_match_string("ba", wt)
+   luaunit.assertTrue(match_success)
+   fst_fast.wide_instruction_tape_destroy(wt)
+   fst_fast.wide_instruction_tape_destroy(a)
+   fst_fast.wide_instruction_tape_destroy(b)
+   os.remove(path)
+end
+
+-- A tape counting 'a's mod 3 and writing an 'x' every third one; any
+-- other byte keeps the count
+local function counting_tape(wide)
+   return fst_fast.build_tape({
+         wide = wide,
+         states = {
+            {initial = true, final = true,
+             edges = {{0, 255, 0}, {'a', 'a', 1}}},
+            {edges = {{0, 255, 1}, {'a', 'a', 2}}},
+            {edges = {{0, 255, 2}, {'a', 'a', 0, 'x'}}}
+         }
+   })
+end
+
+function testParallelMatch()
+   local instrtape = counting_tape()
+
+   local input = string.rep("abaab", 60000) .. "a"
+   local outstr, match_success, matched_states = fst_fast.match_string(input, instrtape)
+   local poutstr, pmatch_success, pmatched_states, chunks =
+      fst_fast.match_string_parallel(input, instrtape, 4)
+   luaunit.assertEquals(chunks, 4)
+
+   luaunit.assertEquals(poutstr, outstr)
+   luaunit.assertEquals(pmatch_success, match_success)
+   luaunit.assertEquals(#pmatched_states, #matched_states)
+   for i = 1, #matched_states do
+      if pmatched_states[i] ~= matched_states[i] then
+         luaunit.assertEquals(pmatched_states[i], matched_states[i])
+      end
+   end
+
+   fst_fast.instruction_tape_destroy(instrtape)
+end
+
+function testFrozenTape()
+   local instrtape = fst_fast.get_instruction_tape()
+   fst_fast.fse_clear_instr(instrtape, 0)
+   fst_fast.fse_set_initial_flags(instrtape)
+   fst_fast.fse_set_outchar(fst_fast.fse_get_outgoing(instrtape, 'a'), 'b')
+   fst_fast.fse_set_outstate(fst_fast.fse_get_outgoing(instrtape, 'a'), 1)
+   fst_fast.fse_finish(instrtape)
+   fst_fast.fse_clear_instr(instrtape, 0)
+   fst_fast.fse_set_final_flags(instrtape)
+   fst_fast.fse_finish(instrtape)
+
+   local frozen = fst_fast.freeze_tape(instrtape)
+   -- The frozen tape is a copy, the original can go
+   fst_fast.instruction_tape_destroy(instrtape)
+
+   luaunit.assertEquals(frozen:length(), 2)
+   luaunit.assertFalse(frozen:is_wide())
+   local outstr, match_success, matched_states = frozen:match_string("a")
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(outstr, "b")
+   luaunit.assertEquals(matched_states, {1})
+
+   -- As another Lua state would see it
+   local handle = frozen:export()
+   frozen = nil
+   collectgarbage()
+   local imported = fst_fast.import_tape(handle)
+   luaunit.assertEquals(imported:match_string("a"), "b")
+
+   -- Each export is taken over once, and nothing else is taken at all
+   luaunit.assertError(fst_fast.import_tape, handle)
+   luaunit.assertFalse(fst_fast.discard_export(handle))
+   handle = imported:export()
+   luaunit.assertError(fst_fast.import_registry, handle)
+   luaunit.assertTrue(fst_fast.discard_export(handle))
+
+   local wide = fst_fast.build_tape({
+         wide = true,
+         default = 1,
+         states = {
+            {initial = true, edges = {{'a', 'a', 2, "xy"}}},
+            {},
+            {final = true}
+         }
+   })
+   local frozen_wide = fst_fast.freeze_wide_tape(wide)
+   fst_fast.wide_instruction_tape_destroy(wide)
+   luaunit.assertTrue(frozen_wide:is_wide())
+   local outstr, match_success = frozen_wide:match_string("a")
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(outstr, "xy")
+end
+
+function testTapeRegistry()
+   local function echo_tape(to)
+      local instrtape = fst_fast.build_tape({
+            default = 1,
+            states = {
+               {initial = true, edges = {{'a', 'a', 2, to}}},
+               {},
+               {final = true}
+            }
+      })
+      local frozen = fst_fast.freeze_tape(instrtape)
+      fst_fast.instruction_tape_destroy(instrtape)
+      return frozen
+   end
+
+   local registry = fst_fast.tape_registry()
+   luaunit.assertEquals(registry:version(), 0)
+   luaunit.assertError(registry.match_string, registry, "a")
+
+   luaunit.assertEquals(registry:publish(echo_tape('b')), 1)
+   local outstr, match_success, _, version = registry:match_string("a")
+   luaunit.assertEquals(outstr, "b")
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(version, 1)
+
+   -- Holding on to version 1 across the swap
+   local old = registry:acquire()
+
+   local other = fst_fast.import_registry(registry:export())
+   local handle = registry:export()
+   luaunit.assertError(fst_fast.import_tape, handle)
+   luaunit.assertTrue(fst_fast.discard_export(handle))
+   luaunit.assertEquals(other:publish(echo_tape('c')), 2)
+   local outstr, _, _, version = registry:match_string("a")
+   luaunit.assertEquals(outstr, "c")
+   luaunit.assertEquals(version, 2)
+   luaunit.assertEquals(old:match_string("a"), "b")
+end
+
+function testRegistryReclaim()
+   local function echo_tape(to)
+      local instrtape = fst_fast.build_tape({
+            default = 1,
+            states = {
+               {initial = true, edges = {{'a', 'a', 2, to}}},
+               {},
+               {final = true}
+            }
+      })
+      local frozen = fst_fast.freeze_tape(instrtape)
+      fst_fast.instruction_tape_destroy(instrtape)
+      return frozen
+   end
+
+   local registry = fst_fast.tape_registry()
+   local first = echo_tape('b')
+   registry:publish(first)
+   luaunit.assertEquals(first:references(), 2)
+
+   -- Retired under a reader, first is freed by that reader leaving
+   luaunit.assertEquals(registry:enter(), 1)
+   luaunit.assertEquals(registry:match_string("a"), "b")
+   registry:publish(echo_tape('c'))
+   registry:publish(echo_tape('d'))
+   luaunit.assertEquals(registry:match_string("a"), "d")
+   luaunit.assertEquals(first:references(), 2)
+   registry:leave()
+   luaunit.assertEquals(first:references(), 1)
+   luaunit.assertError(registry.leave, registry)
+
+   -- A reader that goes away without leaving leaves it to reclaim
+   local second = echo_tape('e')
+   registry:publish(second)
+   local other = fst_fast.import_registry(registry:export())
+   other:enter()
+   registry:publish(echo_tape('f'))
+   other = nil
+   collectgarbage()
+   luaunit.assertEquals(second:references(), 2)
+   registry:reclaim()
+   luaunit.assertEquals(second:references(), 1)
+end
+
+function testMatchFile()
+   local instrtape = counting_tape()
+
+   local path = os.tmpname()
+   local f = io.open(path, "wb")
+   f:write("aa\0a\0aaa")
+   f:close()
+
+   local outstr, match_success, matched_states = fst_fast.match_file(instrtape, path)
+   luaunit.assertEquals(outstr, "xx")
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(matched_states, {1, 2, 2, 0, 0, 1, 2, 0})
+
+   local frozen = fst_fast.freeze_tape(instrtape)
+   luaunit.assertEquals(fst_fast.match_file(frozen, path), "xx")
+
+   -- Big enough to be split between threads
+   f = io.open(path, "wb")
+   f:write(string.rep("abaab", 60000))
+   f:close()
+   local outstr, match_success, matched_states =
+      fst_fast.match_file(instrtape, path, {threads = 4})
+   luaunit.assertEquals(#outstr, 60000)
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(#matched_states, 300000)
+
+   os.remove(path)
+   luaunit.assertError(fst_fast.match_file, instrtape, path)
+   fst_fast.instruction_tape_destroy(instrtape)
+end
+
+function testMatchBytes()
+   local instrtape = counting_tape()
+
+   -- NUL bytes are input like any other
+   local outstr, match_success, matched_states = fst_fast.match_string("a\0aa\0", instrtape)
+   luaunit.assertEquals(outstr, "x")
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(matched_states, {1, 1, 2, 0, 0})
+
+   -- Slices: skip 2 bytes, match 3
+   local outstr, match_success, matched_states = fst_fast.match_string("bbaaab", instrtape, 2, 3)
+   luaunit.assertEquals(outstr, "x")
+   luaunit.assertEquals(matched_states, {1, 2, 0})
+   local _, _, matched_states = fst_fast.match_string("bbaaab", instrtape, 4)
+   luaunit.assertEquals(matched_states, {1, 1})
+   local _, match_success, matched_states = fst_fast.match_string("bbaaab", instrtape, 6)
+   luaunit.assertFalse(match_success)
+   luaunit.assertEquals(matched_states, {})
+   luaunit.assertError(fst_fast.match_string, "ab", instrtape, 3)
+   luaunit.assertError(fst_fast.match_string, "ab", instrtape, 1, 2)
+
+   local frozen = fst_fast.freeze_tape(instrtape)
+   luaunit.assertEquals(frozen:match_string("aa\0a", 1), "")
+   luaunit.assertEquals(frozen:match_string("aa\0a"), "x")
+
+   local wide = counting_tape(true)
+   luaunit.assertEquals(fst_fast.wide_match_string("\0aaa\0aaa", wide, 1, 6), "x")
+
+   fst_fast.wide_instruction_tape_destroy(wide)
+   fst_fast.instruction_tape_destroy(instrtape)
+end
+
+-- The FFI module needs LuaJIT
+if jit then
+   function testFfi()
+      local ffi = require("ffi")
+      local fst_ffi = require("fst_fast_ffi")
+
+      local instrtape = fst_fast.build_tape({
+            default = 1,
+            states = {
+               {initial = true, edges = {{'a', 'a', 2, 'b'}}},
+               {},
+               {final = true, edges = {{'a', 'a', 2, 'c'}}}
+            }
+      })
+      local path = os.tmpname()
+      fst_fast.compact_dumpfile(instrtape, path)
+
+      for _, tape in ipairs({fst_ffi.load(path),
+                             fst_ffi.from_frozen(fst_fast.freeze_tape(instrtape))}) do
+         luaunit.assertEquals(tonumber(fst_ffi.C.fst_tape_length(tape)), 3)
+         local out = fst_ffi.output_buffer(8)
+         local states = fst_ffi.state_buffer(8)
+         local res = fst_ffi.result()
+         luaunit.assertTrue(fst_ffi.match(tape, "aaa", 3, out, 8, states, 8, res))
+         luaunit.assertEquals(ffi.string(out, res.output_length), "bcc")
+         luaunit.assertEquals(res.accepted, 1)
+         luaunit.assertEquals({states[0], states[1], states[2]}, {2, 2, 2})
+
+         -- Too small: counted, not written
+         luaunit.assertFalse(fst_ffi.match(tape, "aaa", 3, out, 2, nil, 0, res))
+         luaunit.assertEquals(tonumber(res.output_length), 3)
+      end
+
+      os.remove(path)
+      fst_fast.instruction_tape_destroy(instrtape)
+   end
+
+   function testFfiLoadChecksDumps()
+      local fst_ffi = require("fst_fast_ffi")
+      local states = {{initial = true, edges = {{'a', 'a', 1, 'b'}}},
+                      {final = true}}
+      local narrow = fst_fast.build_tape({states = states})
+      local wide = fst_fast.build_tape({wide = true, states = states})
+      local path = os.tmpname()
+
+      -- Dump tape, check it loads, then overwrite the bytes at offset
+      -- with bytes: the load must refuse the dump
+      local function corrupt(dump, tape, offset, bytes)
+         dump(tape, path)
+         luaunit.assertNotNil(fst_ffi.load(path))
+         local f = io.open(path, "r+b")
+         f:seek("set", offset)
+         f:write(bytes)
+         f:close()
+         luaunit.assertNil(fst_ffi.load(path))
+      end
+
+      local size_t = require("ffi").sizeof("size_t")
+      -- Entry 'a' of state 0: out_state past the tape
+      corrupt(fst_fast.inspector_dumpfile, narrow, size_t + 97 * 4 + 2,
+              "\9\0")
+      local wide_entry = 4 + 2 * size_t + 97 * 12
+      corrupt(fst_fast.wide_inspector_dumpfile, wide, wide_entry, "\9\0\0\0")
+      -- Its output past the end of the pool
+      corrupt(fst_fast.wide_inspector_dumpfile, wide, wide_entry + 4,
+              "\1\0\0\0")
+
+      os.remove(path)
+      fst_fast.wide_instruction_tape_destroy(wide)
+      fst_fast.instruction_tape_destroy(narrow)
+   end
+end
+
+function testMatchCache()
+   local instrtape = fst_fast.build_tape({
+         default = 1,
+         states = {
+            {initial = true, edges = {{'a', 'a', 2, 'b'}}},
+            {},
+            {final = true}
+         }
+   })
+   local frozen = fst_fast.freeze_tape(instrtape)
+   fst_fast.instruction_tape_destroy(instrtape)
+
+   local cache = fst_fast.match_cache(4096)
+   for i = 1, 2 do
+      local outstr, match_success, matched_states = cache:match_string(frozen, "a")
+      luaunit.assertEquals(outstr, "b")
+      luaunit.assertTrue(match_success)
+      luaunit.assertEquals(matched_states, {2})
+   end
+   luaunit.assertEquals(cache:match_string(frozen, "xa", 1), "b")
+   luaunit.assertFalse(select(2, cache:match_string(frozen, "x")))
+   local stats = cache:stats()
+   luaunit.assertEquals(stats.hits, 2)
+   luaunit.assertEquals(stats.misses, 2)
+   luaunit.assertEquals(stats.entries, 2)
+
+   -- A new version of the tape isn't answered from the old one's entries
+   local registry = fst_fast.tape_registry()
+   registry:publish(frozen)
+   local outstr, _, _, version = cache:match_string(registry, "a")
+   luaunit.assertEquals(outstr, "b")
+   luaunit.assertEquals(version, 1)
+   luaunit.assertEquals(cache:stats().hits, 3)
+   instrtape = fst_fast.build_tape({
+         default = 1,
+         states = {
+            {initial = true, edges = {{'a', 'a', 2, 'c'}}},
+            {},
+            {final = true}
+         }
+   })
+   registry:publish(fst_fast.freeze_tape(instrtape))
+   fst_fast.instruction_tape_destroy(instrtape)
+   local outstr, _, _, version = cache:match_string(registry, "a")
+   luaunit.assertEquals(outstr, "c")
+   luaunit.assertEquals(version, 2)
+
+   -- Staying in the budget
+   for i = 1, 200 do
+      cache:match_string(frozen, "x" .. i)
+   end
+   stats = cache:stats()
+   luaunit.assertTrue(stats.evictions > 0)
+   luaunit.assertTrue(stats.bytes <= 4096)
+   cache:clear()
+   luaunit.assertEquals(cache:stats().entries, 0)
+
+   local no_states = fst_fast.match_cache(4096, {states = false})
+   for i = 1, 2 do
+      local outstr, match_success, matched_states =
+         no_states:match_string(frozen, "a")
+      luaunit.assertEquals(outstr, "b")
+      luaunit.assertTrue(match_success)
+      luaunit.assertNil(matched_states)
+   end
+end
+
+function testMatcher()
+   local instrtape = fst_fast.build_tape({
+         default = 0,
+         states = {
+            {initial = true, edges = {{'a', 'a', 1, 'b'}}},
+            {final = true, edges = {{'a', 'a', 1, 'c'}}}
+         }
+   })
+   local input = string.rep("a", 1000)
+   local outstr, match_success, matched_states =
+      fst_fast.match_string(input, instrtape)
+
+   -- Stepped from a coroutine, yielding between slices
+   luaunit.assertError(fst_fast.matcher, instrtape, input)
+   local frozen = fst_fast.freeze_tape(instrtape)
+   fst_fast.instruction_tape_destroy(instrtape)
+   local m = fst_fast.matcher(frozen, input)
+   local co = coroutine.wrap(function()
+         local outstr, match_success, matched_states = m:step(64)
+         while not outstr do
+            coroutine.yield(false)
+            outstr, match_success, matched_states = m:step(64)
+         end
+         return outstr, match_success, matched_states
+   end)
+   local steps = 1
+   local step_outstr, step_success, step_states = co()
+   while not step_outstr do
+      steps = steps + 1
+      step_outstr, step_success, step_states = co()
+   end
+   luaunit.assertEquals(steps, 16)
+   luaunit.assertEquals(step_outstr, outstr)
+   luaunit.assertEquals(step_success, match_success)
+   luaunit.assertEquals(step_states, matched_states)
+   luaunit.assertEquals({m:position()}, {1000, 1000})
+   luaunit.assertError(m.step, m)
+
+   -- A slice of the input, outliving the tape's last Lua reference
+   m = fst_fast.matcher(frozen, "xaa", 1)
+   frozen = nil
+   collectgarbage()
+   luaunit.assertNil(m:step(1))
+   luaunit.assertEquals({m:step(1)}, {"bc", true, {1, 1}})
+
+   local wide = fst_fast.build_tape({
+         wide = true,
+         default = 1,
+         states = {
+            {initial = true, edges = {{'a', 'a', 2, "xy"}}},
+            {},
+            {final = true}
+         }
+   })
+   local frozen_wide = fst_fast.freeze_wide_tape(wide)
+   fst_fast.wide_instruction_tape_destroy(wide)
+   luaunit.assertEquals({fst_fast.matcher(frozen_wide, "a"):step()},
+      {"xy", true, {2}})
+end
+
+function testUtf8Tape()
+   local greek = fst_fast.build_utf8_tape({
+         default = 2,
+         states = {
+            {initial = true, edges = {{"Α", "ω", 1, true}}},
+            {final = true, edges = {{"Α", "ω", 1, true}, {"0", "9", 1, true}}},
+            {}
+         }
+   })
+   local outstr, match_success = fst_fast.match_string("αβγ42", greek)
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(outstr, "αβγ42")
+   luaunit.assertFalse(select(2, fst_fast.match_string("αβx", greek)))
+   luaunit.assertFalse(select(2, fst_fast.match_string("α\xce", greek)))
+   luaunit.assertFalse(select(2, fst_fast.match_string("\xce\xff", greek)))
+   fst_fast.instruction_tape_destroy(greek)
+
+   -- Every non-ASCII codepoint shares 7 continuation states
+   for _, wide in ipairs({false, true}) do
+      local mask = fst_fast.build_utf8_tape({
+            wide = wide,
+            states = {
+               {initial = true, final = true,
+                edges = {{0, 0x7f, 0, true}, {0x80, 0x10ffff, 0, "?"}}}
+            }
+      })
+      local match = wide and fst_fast.wide_match_string or fst_fast.match_string
+      luaunit.assertEquals(match("h\195\169llo w\195\182rld \240\159\152\128", mask),
+                           "h?llo w?rld ?")
+      if wide then
+         luaunit.assertEquals(fst_fast.wide_inspector_get_length(mask), 8)
+         fst_fast.wide_instruction_tape_destroy(mask)
+      else
+         luaunit.assertEquals(fst_fast.inspector_get_length(mask), 8)
+         fst_fast.instruction_tape_destroy(mask)
+      end
+   end
+
+   luaunit.assertError(fst_fast.build_utf8_tape,
+                       {states = {{edges = {{"ab", "c", 0}}}}})
+end
+
+function testDifferential()
+   -- Every engine against match_string on random tapes, see fuzz.lua
+   local fuzz = require("test.fuzz")
+   luaunit.assertNil(fuzz.run(40, 2718))
+end
+
+function testAnalyze()
+   local instrtape = fst_fast.build_tape({
+         default = 3,
+         states = {
+            {initial = true, edges = {{'a', 'a', 1, 'x'}, {'b', 'b', 0}}},
+            {final = true, edges = {{'a', 'a', 1, true}, {255, 255, 0}}},
+            {default = 2},
+            {}
+         }
+   })
+
+   luaunit.assertTrue(fst_fast.inspector_is_initial(instrtape, 0))
+   luaunit.assertFalse(fst_fast.inspector_is_initial(instrtape, 1))
+   local outgoings = fst_fast.inspector_outgoings(instrtape, 1)
+   luaunit.assertEquals(#outgoings, 256)
+   luaunit.assertEquals(outgoings[256], {input = "\255", output = "", state = 0})
+   luaunit.assertEquals(outgoings[98], {input = "a", output = "a", state = 1})
+
+   local analysis = fst_fast.inspector_analyze(instrtape)
+   luaunit.assertEquals(analysis.states, 4)
+   luaunit.assertEquals(analysis.edge_count, 4)
+   luaunit.assertEquals(analysis.density, 4 / 1024)
+   luaunit.assertEquals(analysis.self_loop_ratio, 514 / 1024)
+   luaunit.assertEquals(analysis.fan_out, {2, 2, 0, 0})
+   luaunit.assertEquals(analysis.distinct_targets, {3, 3, 1, 1})
+   luaunit.assertEquals(analysis.reachable, {0, 1, 3})
+   luaunit.assertEquals(analysis.dead, {2, 3})
+   luaunit.assertEquals(analysis.defaults,
+                        "\0\3\0" .. "\0\3\0" .. "\0\2\0" .. "\0\3\0")
+   luaunit.assertEquals(analysis.edges,
+                        "\0\0ax\1\0" .. "\0\0b\0\0\0" ..
+                        "\1\0aa\1\0" .. "\1\0\255\0\0\0")
+   fst_fast.instruction_tape_destroy(instrtape)
+end
+
+function testHybridTape()
+   local instrtape = fst_fast.build_tape({
+         default = 2,
+         states = {
+            {initial = true, edges = {{'a', 'a', 1, 'x'}, {'b', 'b', 2}}},
+            {final = true, edges = {{'a', 'z', 1, true}}},
+            {}
+         }
+   })
+   local hybrid = fst_fast.freeze_hybrid_tape(instrtape)
+   luaunit.assertEquals(hybrid:length(), 3)
+   luaunit.assertFalse(hybrid:is_wide())
+
+   local kinds = hybrid:row_kinds()
+   luaunit.assertEquals(kinds.default, 1)
+   luaunit.assertEquals(kinds.sparse, 1)
+   luaunit.assertEquals(kinds.dense, 1)
+   luaunit.assertTrue(kinds.bytes < 2 * 1024)
+   luaunit.assertNil(fst_fast.freeze_tape(instrtape):row_kinds())
+
+   for _, input in ipairs({"", "a", "abc", "aZ", "b", "c", "a\0", "ab\255"}) do
+      local outstr, match_success, matched_states =
+         fst_fast.match_string(input, instrtape)
+      local h_outstr, h_success, h_states = hybrid:match_string(input)
+      luaunit.assertEquals(h_outstr, outstr)
+      luaunit.assertEquals(h_success, match_success)
+      luaunit.assertEquals(h_states, matched_states)
+   end
+
+   local outstr, match_success, matched_states = hybrid:match_string("abc")
+   luaunit.assertEquals(outstr, "xbc")
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(matched_states, {1, 1, 1})
+
+   local m = fst_fast.matcher(hybrid, "abcb")
+   luaunit.assertNil(m:step(3))
+   outstr, match_success, matched_states = m:step(3)
+   luaunit.assertEquals(outstr, "xbcb")
+   luaunit.assertTrue(match_success)
+   luaunit.assertEquals(matched_states, {1, 1, 1, 1})
+   fst_fast.instruction_tape_destroy(instrtape)
+end
+
 os.exit(luaunit.LuaUnit.run())